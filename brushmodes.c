@@ -17,9 +17,9 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
-#include "fastapprox/fastpow.h"
 
 #include "brushmodes.h"
 #include "helpers.h"
@@ -36,6 +36,9 @@
 //
 // opacity: overall strength of the blending mode. Has the same
 //          influence on the dab as the values inside the mask.
+//
+// spectral_cache: Optional (may be NULL) log-spectral representation of
+//                 the tile's pixels, used and updated by the pigment modes.
 
 
 // We are manipulating pixels with premultiplied alpha directly.
@@ -70,23 +73,58 @@ void draw_dab_pixels_BlendMode_Normal (uint16_t * mask,
   }
 };
 
+// Mixes the log-spectral color a into the (premultiplied, non-transparent)
+// pixel, weighted fac_a, and writes the straight rgb result to rgb_.
+//
+// If the pixel has a cache entry that is still current, its log-spectral
+// color is used instead of converting the pixel again. The entry is updated
+// with the mix, so the caller must either store the new pixel value as the
+// key with update_spectral_key(), or invalidate it.
+static inline void
+mix_pixel_spectral(const float *log_spectral_a, float fac_a,
+                   const uint16_t *rgba, SpectralCachePixel *cached,
+                   float *rgb_)
+{
+  const float r = (float)rgba[0] / rgba[3];
+  const float g = (float)rgba[1] / rgba[3];
+  const float b = (float)rgba[2] / rgba[3];
+  if (!cached) {
+    log_spectral_mix_rgb(log_spectral_a, fac_a, r, g, b, rgb_);
+    return;
+  }
+  if (memcmp(cached->rgba, rgba, sizeof(cached->rgba)) != 0) {
+    rgb_to_log_spectral_fast(r, g, b, cached->log_spectral);
+  }
+  log_spectral_mix_in_place(log_spectral_a, fac_a, cached->log_spectral, rgb_);
+}
+
+static inline void
+update_spectral_key(SpectralCachePixel *cached, const uint16_t *rgba)
+{
+  if (cached) {
+    memcpy(cached->rgba, rgba, sizeof(cached->rgba));
+  }
+}
+
 void draw_dab_pixels_BlendMode_Normal_Paint (uint16_t * mask,
                                        uint16_t * rgba,
                                        uint16_t color_r,
                                        uint16_t color_g,
                                        uint16_t color_b,
-                                       uint16_t opacity) {
+                                       uint16_t opacity,
+                                             SpectralCachePixel * spectral_cache) {
 
-  // convert top to spectral.  Already straight color
-  float spectral_a[10] = {0};
-  rgb_to_spectral((float)color_r / (1 << 15), (float)color_g / (1 << 15), (float)color_b / (1 << 15), spectral_a);
+  // convert top to log spectral.  Already straight color
+  float log_spectral_a[10];
+  rgb_to_log_spectral((float)color_r / (1 << 15), (float)color_g / (1 << 15), (float)color_b / (1 << 15), log_spectral_a);
   // pigment-mode does not like very low opacity, probably due to rounding
   // errors with int->float->int round-trip.  Once we convert to pure
   // float engine this might be fixed.  For now enforce a minimum opacity:
   opacity = MAX(opacity, 150);
 
+  int px = 0;
   while (1) {
-    for (; mask[0]; mask++, rgba+=4) {
+    for (; mask[0]; mask++, rgba+=4, px++) {
       uint32_t opa_a = mask[0]*(uint32_t)opacity/(1<<15); // topAlpha
       uint32_t opa_b = (1<<15)-opa_a; // bottomAlpha
       // optimization- if background has 0 alpha we can just do normal additive
@@ -100,31 +138,25 @@ void draw_dab_pixels_BlendMode_Normal_Paint (uint16_t * mask,
       }
       //alpha-weighted ratio for WGM (sums to 1.0)
       float fac_a = (float)opa_a / (opa_a + opa_b * rgba[3] / (1<<15));
-      float fac_b = 1.0 - fac_a;
-
-      //convert bottom to spectral.  Un-premult alpha to obtain reflectance
-      //color noise is not a problem since low alpha also implies low weight
-      float spectral_b[10] = {0};
-
-      rgb_to_spectral((float)rgba[0] / rgba[3], (float)rgba[1] / rgba[3], (float)rgba[2] / rgba[3], spectral_b);
 
-      // mix to the two spectral reflectances using WGM
-      float spectral_result[10] = {0};
-      for (int i=0; i<10; i++) {
-        spectral_result[i] = fastpow(spectral_a[i], fac_a) * fastpow(spectral_b[i], fac_b);
-      }
+      // Un-premult alpha to obtain the bottom reflectance, then mix the two
+      // spectral reflectances using WGM and convert back to RGB.
+      // Color noise is not a problem since low alpha also implies low weight
+      SpectralCachePixel *cached = spectral_cache ? &spectral_cache[px] : NULL;
+      float rgb_result[3];
+      mix_pixel_spectral(log_spectral_a, fac_a, rgba, cached, rgb_result);
 
-      // convert back to RGB and premultiply alpha
-      float rgb_result[3] = {0};
-      spectral_to_rgb(spectral_result, rgb_result);
+      // premultiply alpha
       rgba[3] = opa_a + opa_b * rgba[3] / (1<<15);
 
       for (int i=0; i<3; i++) {
         rgba[i] =(rgb_result[i] * rgba[3]) + 0.5;
       }
+      update_spectral_key(cached, rgba);
     }
     if (!mask[1]) break;
     rgba += mask[1];
+    px += mask[1]/4;
     mask += 2;
   }
 };
@@ -133,23 +165,32 @@ void draw_dab_pixels_BlendMode_Normal_Paint (uint16_t * mask,
 //reduces colors by adjustable amount (posterize_num).
 //posterize the canvas, then blend that via opacity
 //does not affect alpha
+//
+//The level of a channel value c is ROUND(c / 2^15 * posterize_num), which is
+//computed exactly in integers as c * posterize_num <= 2^22. The posterized
+//value of each level is looked up in a table built once per call. Levels are
+//clamped to the table, in case a channel is above 2^15.
+//posterize_num must be within 1..128, see draw_dab_operation_init().
 
 void draw_dab_pixels_BlendMode_Posterize (uint16_t * mask,
                                        uint16_t * rgba,
                                        uint16_t opacity,
                                        uint16_t posterize_num) {
 
+  assert(posterize_num >= 1 && posterize_num <= 128);
+  uint16_t levels[128+1];
+  for (uint32_t i = 0; i <= posterize_num; i++) {
+    levels[i] = (1<<15) * i / posterize_num;
+  }
+  const uint32_t num = posterize_num;
+
   while (1) {
     for (; mask[0]; mask++, rgba+=4) {
-     
-      float r = (float)rgba[0] / (1<<15);
-      float g = (float)rgba[1] / (1<<15);
-      float b = (float)rgba[2] / (1<<15);
-
-      uint32_t post_r = (1<<15) * ROUND(r * posterize_num) / posterize_num;
-      uint32_t post_g = (1<<15) * ROUND(g * posterize_num) / posterize_num;
-      uint32_t post_b = (1<<15) * ROUND(b * posterize_num) / posterize_num;
-      
+
+      const uint32_t post_r = levels[MIN((rgba[0]*num + (1<<14)) >> 15, num)];
+      const uint32_t post_g = levels[MIN((rgba[1]*num + (1<<14)) >> 15, num)];
+      const uint32_t post_b = levels[MIN((rgba[2]*num + (1<<14)) >> 15, num)];
+
       uint32_t opa_a = mask[0]*(uint32_t)opacity/(1<<15); // topAlpha
       uint32_t opa_b = (1<<15)-opa_a; // bottomAlpha
       rgba[0] = (opa_a*post_r + opa_b*rgba[0])/(1<<15);
@@ -190,61 +231,15 @@ static const float LUMA_BLUE_COEFF  = 0.0722 * (1<<15);
    ((r)*LUMA_RED_COEFF + (g)*LUMA_GREEN_COEFF + (b)*LUMA_BLUE_COEFF)
 
 
-/*
- * Sets the output RGB triple's luminance to that of the input, retaining its
- * colour. Inputs and outputs are scaled ints having factor 2**-15, and must
- * not store premultiplied alpha.
- */
-
-inline static void
-set_rgb16_lum_from_rgb16(const uint16_t topr,
-                         const uint16_t topg,
-                         const uint16_t topb,
-                         uint16_t *botr,
-                         uint16_t *botg,
-                         uint16_t *botb)
-{
-    // Spec: SetLum()
-    // Colours potentially can go out of band to both sides, hence the
-    // temporary representation inflation.
-    const uint16_t botlum = LUMA(*botr, *botg, *botb) / (1<<15);
-    const uint16_t toplum = LUMA(topr, topg, topb) / (1<<15);
-    const int16_t diff = botlum - toplum;
-    int32_t r = topr + diff;
-    int32_t g = topg + diff;
-    int32_t b = topb + diff;
-
-    // Spec: ClipColor()
-    // Clip out of band values
-    int32_t lum = LUMA(r, g, b) / (1<<15);
-    int32_t cmin = MIN3(r, g, b);
-    int32_t cmax = MAX3(r, g, b);
-    if (cmin < 0) {
-        r = lum + (((r - lum) * lum) / (lum - cmin));
-        g = lum + (((g - lum) * lum) / (lum - cmin));
-        b = lum + (((b - lum) * lum) / (lum - cmin));
-    }
-    if (cmax > (1<<15)) {
-        r = lum + (((r - lum) * ((1<<15)-lum)) / (cmax - lum));
-        g = lum + (((g - lum) * ((1<<15)-lum)) / (cmax - lum));
-        b = lum + (((b - lum) * ((1<<15)-lum)) / (cmax - lum));
-    }
-#ifdef HEAVY_DEBUG
-    assert((0 <= r) && (r <= (1<<15)));
-    assert((0 <= g) && (g <= (1<<15)));
-    assert((0 <= b) && (b <= (1<<15)));
-#endif
-
-    *botr = r;
-    *botg = g;
-    *botb = b;
-}
-
-
 // The method is an implementation of that described in the official Adobe "PDF
 // Blend Modes: Addendum" document, dated January 23, 2006; specifically it's
 // the "Color" nonseparable blend mode. We do however use different
 // coefficients for the Luma value.
+//
+// The luminance of the bottom pixel is set on the top colour, which is the
+// same for every pixel. So are its luminance, and which of its channels are
+// the smallest and the largest, so those are computed once per call. Only
+// pixels whose new colour is out of band need the divisions of ClipColor().
 
 void
 draw_dab_pixels_BlendMode_Color (uint16_t *mask,
@@ -254,6 +249,10 @@ draw_dab_pixels_BlendMode_Color (uint16_t *mask,
                                  uint16_t color_b,  // }
                                  uint16_t opacity)
 {
+  const uint16_t toplum = LUMA(color_r, color_g, color_b) / (1<<15);
+  const int32_t topmin = MIN3(color_r, color_g, color_b);
+  const int32_t topmax = MAX3(color_r, color_g, color_b);
+
   while (1) {
     for (; mask[0]; mask++, rgba+=4) {
       // De-premult
@@ -267,12 +266,38 @@ draw_dab_pixels_BlendMode_Color (uint16_t *mask,
       }
 
       // Apply luminance
-      set_rgb16_lum_from_rgb16(color_r, color_g, color_b, &r, &g, &b);
+      // Spec: SetLum()
+      // Colours potentially can go out of band to both sides, hence the
+      // temporary representation inflation.
+      const uint16_t botlum = LUMA(r, g, b) / (1<<15);
+      const int16_t diff = botlum - toplum;
+      int32_t lr = color_r + diff;
+      int32_t lg = color_g + diff;
+      int32_t lb = color_b + diff;
+
+      // Spec: ClipColor()
+      // Clip out of band values. At most one side can be out of band,
+      // as the channels are no further apart than those of the top colour.
+      const int32_t cmin = topmin + diff;
+      const int32_t cmax = topmax + diff;
+      if (cmin < 0 || cmax > (1<<15)) {
+        const int32_t lum = LUMA(lr, lg, lb) / (1<<15);
+        const int32_t scale = cmin < 0 ? lum : (1<<15) - lum;
+        const int32_t range = cmin < 0 ? lum - cmin : cmax - lum;
+        lr = lum + (((lr - lum) * scale) / range);
+        lg = lum + (((lg - lum) * scale) / range);
+        lb = lum + (((lb - lum) * scale) / range);
+      }
+#ifdef HEAVY_DEBUG
+      assert((0 <= lr) && (lr <= (1<<15)));
+      assert((0 <= lg) && (lg <= (1<<15)));
+      assert((0 <= lb) && (lb <= (1<<15)));
+#endif
 
       // Re-premult
-      r = ((uint32_t) r) * a / (1<<15);
-      g = ((uint32_t) g) * a / (1<<15);
-      b = ((uint32_t) b) * a / (1<<15);
+      r = ((uint32_t)(uint16_t) lr) * a / (1<<15);
+      g = ((uint32_t)(uint16_t) lg) * a / (1<<15);
+      b = ((uint32_t)(uint16_t) lb) * a / (1<<15);
 
       // And combine as normal.
       uint32_t opa_a = mask[0] * opacity / (1<<15); // topAlpha
@@ -336,19 +361,21 @@ void draw_dab_pixels_BlendMode_Normal_and_Eraser_Paint (uint16_t * mask,
                                                   uint16_t color_g,
                                                   uint16_t color_b,
                                                   uint16_t color_a,
-                                                  uint16_t opacity) {
+                                                  uint16_t opacity,
+                                                  SpectralCachePixel * spectral_cache) {
 
-  // Convert input color to spectral, it is not premultiplied
-  float spectral_a[10] = {0};
-  rgb_to_spectral(
+  // Convert input color to log spectral, it is not premultiplied
+  float log_spectral_a[10];
+  rgb_to_log_spectral(
     (float)color_r / (1<<15),
     (float)color_g / (1<<15),
     (float)color_b / (1<<15),
-    spectral_a
+    log_spectral_a
     );
 
+  int px = 0;
   while (1) {
-    for (; mask[0]; mask++, rgba+=4) {
+    for (; mask[0]; mask++, rgba+=4, px++) {
       const uint32_t opa_a = mask[0]*(uint32_t)opacity/(1<<15); // topAlpha
       const uint32_t opa_b = (1<<15)-opa_a; // bottomAlpha
       const uint32_t opa_a2 = opa_a * color_a / (1<<15); // erase-adjusted alpha
@@ -372,30 +399,24 @@ void draw_dab_pixels_BlendMode_Normal_and_Eraser_Paint (uint16_t * mask,
         rgb[2] = (opa_a2 * color_b + opa_b * rgba[2]) / (1 << 15);
       }
 
-      if (spectral_factor && rgba[3] != 0) {
-        // Convert straightened tile pixel color to a spectral
-        float spectral_b[10] = {0};
-        rgb_to_spectral(
-          (float)rgba[0] / rgba[3],
-          (float)rgba[1] / rgba[3],
-          (float)rgba[2] / rgba[3],
-          spectral_b
-          );
+      // Only purely spectral results can be kept in the cache
+      SpectralCachePixel *cached = NULL;
+      if (spectral_cache) {
+        cached = &spectral_cache[px];
+        if (additive_factor) {
+          cached->rgba[3] = 0;
+          cached = NULL;
+        }
+      }
 
+      if (spectral_factor && rgba[3] != 0) {
         float fac_a = (float)opa_a / (opa_a + opa_b * rgba[3] / (1 << 15));
         fac_a *= (float)color_a / (1 << 15);
-        float fac_b = 1.0 - fac_a;
-
-        // Mix input and tile pixel colors using WGM
-        float spectral_result[10] = {0};
-        for (int i = 0; i < 10; i++) {
-          spectral_result[i] =
-              fastpow(spectral_a[i], fac_a) * fastpow(spectral_b[i], fac_b);
-        }
 
-        // Convert back to RGB
-        float rgb_result[3] = {0};
-        spectral_to_rgb(spectral_result, rgb_result);
+        // Mix input and straightened tile pixel colors using WGM,
+        // and convert back to RGB
+        float rgb_result[3];
+        mix_pixel_spectral(log_spectral_a, fac_a, rgba, cached, rgb_result);
 
         for (int i = 0; i < 3; i++) {
           rgb[i] = (additive_factor * rgb[i]) + (spectral_factor * rgb_result[i] * opa_out);
@@ -406,9 +427,11 @@ void draw_dab_pixels_BlendMode_Normal_and_Eraser_Paint (uint16_t * mask,
       for (int i = 0; i < 3; i++) {
         rgba[i] = rgb[i];
       }
+      update_spectral_key(cached, rgba);
     }
     if (!mask[1]) break;
     rgba += mask[1];
+    px += mask[1]/4;
     mask += 2;
   }
 };
@@ -445,15 +468,17 @@ void draw_dab_pixels_BlendMode_LockAlpha_Paint (uint16_t * mask,
                                           uint16_t color_r,
                                           uint16_t color_g,
                                           uint16_t color_b,
-                                          uint16_t opacity) {
+                                          uint16_t opacity,
+                                                SpectralCachePixel * spectral_cache) {
 
-  // convert top to spectral.  Already straight color
-  float spectral_a[10] = {0};
-  rgb_to_spectral((float)color_r / (1<<15), (float)color_g / (1<<15), (float)color_b / (1<<15), spectral_a);
+  // convert top to log spectral.  Already straight color
+  float log_spectral_a[10];
+  rgb_to_log_spectral((float)color_r / (1<<15), (float)color_g / (1<<15), (float)color_b / (1<<15), log_spectral_a);
   opacity = MAX(opacity, 150);
 
+  int px = 0;
   while (1) {
-    for (; mask[0]; mask++, rgba+=4) {
+    for (; mask[0]; mask++, rgba+=4, px++) {
       uint32_t opa_a = mask[0]*(uint32_t)opacity/(1<<15); // topAlpha
       uint32_t opa_b = (1<<15)-opa_a; // bottomAlpha
       opa_a *= rgba[3];
@@ -465,25 +490,20 @@ void draw_dab_pixels_BlendMode_LockAlpha_Paint (uint16_t * mask,
         continue;
       }
       float fac_a = (float)opa_a / (opa_a + opa_b * rgba[3] / (1<<15));
-      float fac_b = 1.0 - fac_a;
-      float spectral_b[10] = {0};
-      rgb_to_spectral((float)rgba[0] / rgba[3], (float)rgba[1] / rgba[3], (float)rgba[2] / rgba[3], spectral_b);
-
-      // mix to the two spectral colors using WGM
-      float spectral_result[10] = {0};
-      for (int i=0; i<10; i++) {
-        spectral_result[i] = fastpow(spectral_a[i], fac_a) * fastpow(spectral_b[i], fac_b);
-      }
-      // convert back to RGB
-      float rgb_result[3] = {0};
-      spectral_to_rgb(spectral_result, rgb_result);
+
+      // mix to the two spectral colors using WGM, and convert back to RGB
+      SpectralCachePixel *cached = spectral_cache ? &spectral_cache[px] : NULL;
+      float rgb_result[3];
+      mix_pixel_spectral(log_spectral_a, fac_a, rgba, cached, rgb_result);
 
       for (int i=0; i<3; i++) {
         rgba[i] =(rgb_result[i] * rgba[3]) + 0.5;
       }
+      update_spectral_key(cached, rgba);
     }
     if (!mask[1]) break;
     rgba += mask[1];
+    px += mask[1]/4;
     mask += 2;
   }
 };
@@ -542,7 +562,7 @@ void get_color_pixels_legacy (
 // The sample rate is the probability of any pixel being sampled,
 // with the exception of the guaranteed ones. Range: 0.0..1.0.
 // The random sample rate can be set to 0, in which case no random
-// sampling will occur.
+// sampling will occur. The random choices only depend on the seed.
 void get_color_pixels_accumulate (uint16_t * mask,
                                   uint16_t * rgba,
                                   float * sum_weight,
@@ -552,7 +572,8 @@ void get_color_pixels_accumulate (uint16_t * mask,
                                   float * sum_a,
                                   float paint,
                                   uint16_t sample_interval,
-                                  float random_sample_rate
+                                  float random_sample_rate,
+                                  uint32_t random_seed
                                   ) {
   // Fall back to legacy sampling if using static 0 paint setting
   // Indicated by passing a negative paint factor (normal range 0..1)
@@ -566,10 +587,12 @@ void get_color_pixels_accumulate (uint16_t * mask,
   // Average the results normally
   // Only sample a partially random subset of pixels
 
-  float avg_spectral[10] = {0};
+  // The spectral average is kept in the log domain, where the WGM
+  // update is a weighted sum.
+  float avg_log_spectral[10] = {0};
   float avg_rgb[3] = {*sum_r, *sum_g, *sum_b};
   if (paint > 0.0f) {
-    rgb_to_spectral(*sum_r, *sum_g, *sum_b, avg_spectral);
+    rgb_to_log_spectral(*sum_r, *sum_g, *sum_b, avg_log_spectral);
   }
 
   // Rolling counter determining which pixels to sample
@@ -577,13 +600,16 @@ void get_color_pixels_accumulate (uint16_t * mask,
   // Ideally, the selection of pixels to be sampled should
   // be determined before this function is called.
   uint16_t interval_counter = 0;
-  const int random_sample_threshold = (int)(random_sample_rate * RAND_MAX);
+  // Numerical Recipes LCG, compared on its upper 24 bits
+  uint32_t random_state = random_seed;
+  const uint32_t random_sample_threshold = (uint32_t)(random_sample_rate * (1 << 24));
 
   while (1) {
     for (; mask[0]; mask++, rgba+=4) {
       // Sample every n pixels, and a percentage of the rest.
       // At least one pixel (the first) will always be sampled.
-      if (interval_counter == 0 || rand() < random_sample_threshold) {
+      random_state = random_state * 1664525u + 1013904223u;
+      if (interval_counter == 0 || (random_state >> 8) < random_sample_threshold) {
 
         float a = (float)mask[0] * rgba[3] / (1 << 30);
         float alpha_sums = a + *sum_a;
@@ -595,11 +621,11 @@ void get_color_pixels_accumulate (uint16_t * mask,
           fac_b = 1.0 - fac_a;
         }
         if (paint > 0.0f && rgba[3] > 0) {
-          float spectral[10] = {0};
-          rgb_to_spectral((float)rgba[0] / rgba[3], (float)rgba[1] / rgba[3], (float)rgba[2] / rgba[3], spectral);
+          float log_spectral[10];
+          rgb_to_log_spectral_fast((float)rgba[0] / rgba[3], (float)rgba[1] / rgba[3], (float)rgba[2] / rgba[3], log_spectral);
 
           for (int i = 0; i < 10; i++) {
-            avg_spectral[i] = fastpow(spectral[i], fac_a) * fastpow(avg_spectral[i], fac_b);
+            avg_log_spectral[i] = fac_a * log_spectral[i] + fac_b * avg_log_spectral[i];
           }
         }
         if (paint < 1.0f && rgba[3] > 0) {
@@ -618,9 +644,40 @@ void get_color_pixels_accumulate (uint16_t * mask,
   // Convert the spectral average to rgb and write the result
   // back weighted with the rgb average.
   float spec_rgb[3] = {0};
-  spectral_to_rgb(avg_spectral, spec_rgb);
+  if (paint > 0.0f) {
+    log_spectral_to_rgb(avg_log_spectral, spec_rgb);
+  }
 
   *sum_r = spec_rgb[0] * paint + (1.0 - paint) * avg_rgb[0];
   *sum_g = spec_rgb[1] * paint + (1.0 - paint) * avg_rgb[1];
   *sum_b = spec_rgb[2] * paint + (1.0 - paint) * avg_rgb[2];
 };
+
+// Sum up the mask weight and the mask-weighted alpha inside the masked
+// region. Called by get_alpha(). Unlike get_color_pixels_accumulate(),
+// every pixel is sampled, and the sums are exact integers: the sum of
+// mask * alpha takes at most 30 + 12 bits per tile.
+void get_alpha_pixels_accumulate (uint16_t * mask,
+                                  uint16_t * rgba,
+                                  uint64_t * sum_weight,
+                                  uint64_t * sum_alpha
+                                  ) {
+  uint64_t weight = 0;
+  uint64_t alpha = 0;
+  while (1) {
+    // Find the end of the run first, so that the loop below can be vectorized
+    int n = 0;
+    while (mask[n]) n++;
+    for (int i = 0; i < n; i++) {
+      weight += mask[i];
+      alpha += (uint32_t)mask[i] * rgba[i*4+3];
+    }
+    mask += n;
+    rgba += n*4;
+    if (!mask[1]) break;
+    rgba += mask[1];
+    mask += 2;
+  }
+  *sum_weight += weight;
+  *sum_alpha += alpha;
+}
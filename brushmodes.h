@@ -2,6 +2,7 @@
 #define BRUSHMODES_H
 
 #include <stdint.h>
+#include "spectralcache.h"
 
 void draw_dab_pixels_BlendMode_Normal (uint16_t * mask,
                                        uint16_t * rgba,
@@ -15,7 +16,8 @@ void draw_dab_pixels_BlendMode_Normal_Paint (uint16_t * mask,
                                        uint16_t color_r,
                                        uint16_t color_g,
                                        uint16_t color_b,
-                                       uint16_t opacity);
+                                       uint16_t opacity,
+                                       SpectralCachePixel * spectral_cache);
 void
 draw_dab_pixels_BlendMode_Color (uint16_t *mask,
                                  uint16_t *rgba, // b=bottom, premult
@@ -43,7 +45,8 @@ void draw_dab_pixels_BlendMode_Normal_and_Eraser_Paint (uint16_t * mask,
                                                   uint16_t color_g,
                                                   uint16_t color_b,
                                                   uint16_t color_a,
-                                                  uint16_t opacity);
+                                                  uint16_t opacity,
+                                                  SpectralCachePixel * spectral_cache);
 
 void draw_dab_pixels_BlendMode_LockAlpha (uint16_t * mask,
                                           uint16_t * rgba,
@@ -57,7 +60,8 @@ void draw_dab_pixels_BlendMode_LockAlpha_Paint (uint16_t * mask,
                                           uint16_t color_r,
                                           uint16_t color_g,
                                           uint16_t color_b,
-                                          uint16_t opacity);
+                                          uint16_t opacity,
+                                          SpectralCachePixel * spectral_cache);
 
 void get_color_pixels_accumulate (uint16_t * mask,
                                   uint16_t * rgba,
@@ -68,7 +72,14 @@ void get_color_pixels_accumulate (uint16_t * mask,
                                   float * sum_a,
                                   float paint,
                                   uint16_t sample_interval,
-                                  float random_sample_rate
+                                  float random_sample_rate,
+                                  uint32_t random_seed
+                                  );
+
+void get_alpha_pixels_accumulate (uint16_t * mask,
+                                  uint16_t * rgba,
+                                  uint64_t * sum_weight,
+                                  uint64_t * sum_alpha
                                   );
 
 
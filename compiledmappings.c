@@ -0,0 +1,196 @@
+/* libmypaint - The MyPaint Brush Library
+ * Copyright (C) 2019 The MyPaint Team
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "compiledmappings.h"
+
+// Flattened form of a set of mappings, for evaluating all of them once per
+// dab. Only (setting, input) pairs with control points are stored. Each
+// pair is a run of segments with their slopes worked out in advance, and
+// the segment is found by counting the breakpoints below the input value.
+
+typedef struct {
+    int setting;
+    int input;
+    int breaks_n; // interior control points, one less than the segments
+    int offset; // into breaks and segments
+} CompiledTerm;
+
+typedef struct {
+    float x0;
+    float y0;
+    float slope;
+} CompiledSegment;
+
+struct CompiledMappings {
+    int settings_n;
+    float *base_values;
+    CompiledTerm *terms;
+    int terms_n;
+    uint32_t inputs_used;
+    float *breaks;
+    CompiledSegment *segments;
+};
+
+CompiledMappings *
+compiled_mappings_new(int settings_n)
+{
+    CompiledMappings *self = (CompiledMappings *)malloc(sizeof(CompiledMappings));
+    if (!self) {
+        return NULL;
+    }
+    self->settings_n = settings_n;
+    self->base_values = (float *)calloc(settings_n, sizeof(float));
+    self->terms = NULL;
+    self->terms_n = 0;
+    self->inputs_used = 0;
+    self->breaks = NULL;
+    self->segments = NULL;
+    if (!self->base_values) {
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+static void
+free_terms(CompiledMappings *self)
+{
+    free(self->terms);
+    free(self->breaks);
+    free(self->segments);
+    self->terms = NULL;
+    self->breaks = NULL;
+    self->segments = NULL;
+    self->terms_n = 0;
+    self->inputs_used = 0;
+}
+
+void
+compiled_mappings_free(CompiledMappings *self)
+{
+    free_terms(self);
+    free(self->base_values);
+    free(self);
+}
+
+// Rebuilds the compiled form from one mapping per setting.
+// Returns FALSE if out of memory, the old compiled form is dropped then.
+gboolean
+compiled_mappings_compile(CompiledMappings *self, MyPaintMapping **mappings, int inputs_n)
+{
+    int terms_n = 0;
+    int segments_n = 0;
+
+    assert(inputs_n <= 32);
+    free_terms(self);
+
+    for (int s = 0; s < self->settings_n; s++) {
+        self->base_values[s] = mypaint_mapping_get_base_value(mappings[s]);
+        if (mypaint_mapping_is_constant(mappings[s])) {
+            continue;
+        }
+        for (int i = 0; i < inputs_n; i++) {
+            const int n = mypaint_mapping_get_n(mappings[s], i);
+            if (n) {
+                terms_n++;
+                segments_n += n - 1;
+            }
+        }
+    }
+
+    if (terms_n == 0) {
+        return TRUE;
+    }
+
+    self->terms = (CompiledTerm *)malloc(terms_n * sizeof(CompiledTerm));
+    self->breaks = (float *)malloc(segments_n * sizeof(float));
+    self->segments = (CompiledSegment *)malloc(segments_n * sizeof(CompiledSegment));
+    if (!self->terms || !self->breaks || !self->segments) {
+        free_terms(self);
+        return FALSE;
+    }
+
+    int offset = 0;
+    for (int s = 0; s < self->settings_n; s++) {
+        if (mypaint_mapping_is_constant(mappings[s])) {
+            continue;
+        }
+        for (int i = 0; i < inputs_n; i++) {
+            const int n = mypaint_mapping_get_n(mappings[s], i);
+            if (!n) {
+                continue;
+            }
+            CompiledTerm *term = &self->terms[self->terms_n++];
+            term->setting = s;
+            term->input = i;
+            term->breaks_n = n - 2;
+            term->offset = offset;
+            self->inputs_used |= 1u << i;
+
+            float x0, y0;
+            mypaint_mapping_get_point(mappings[s], i, 0, &x0, &y0);
+            for (int p = 1; p < n; p++) {
+                float x1, y1;
+                mypaint_mapping_get_point(mappings[s], i, p, &x1, &y1);
+                CompiledSegment *segment = &self->segments[offset];
+                segment->x0 = x0;
+                segment->y0 = y0;
+                // Flat and vertical segments evaluate to their first point
+                segment->slope = (x0 == x1 || y0 == y1) ? 0.0f : (y1 - y0) / (x1 - x0);
+                self->breaks[offset] = x1;
+                offset++;
+                x0 = x1;
+                y0 = y1;
+            }
+        }
+    }
+    assert(offset == segments_n);
+    return TRUE;
+}
+
+// Bit i is set if input i affects any setting
+uint32_t
+compiled_mappings_get_inputs_used(const CompiledMappings *self)
+{
+    return self->inputs_used;
+}
+
+// Same result as mypaint_mapping_calculate() for each setting, up to
+// rounding. The inputs outside of the outermost control points continue
+// along the first and last segments.
+void
+compiled_mappings_evaluate(const CompiledMappings *self, const float *inputs, float *values)
+{
+    memcpy(values, self->base_values, self->settings_n * sizeof(float));
+
+    for (int t = 0; t < self->terms_n; t++) {
+        const CompiledTerm *term = &self->terms[t];
+        const float x = inputs[term->input];
+        const float *breaks = self->breaks + term->offset;
+        int index = 0;
+        for (int b = 0; b < term->breaks_n; b++) {
+            index += x > breaks[b];
+        }
+        const CompiledSegment *segment = &self->segments[term->offset + index];
+        values[term->setting] += segment->y0 + segment->slope * (x - segment->x0);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef COMPILEDMAPPINGS_H
+#define COMPILEDMAPPINGS_H
+
+#include <stdint.h>
+
+#include "mypaint-config.h"
+#include "mypaint-glib-compat.h"
+#include "mypaint-mapping.h"
+
+G_BEGIN_DECLS
+
+typedef struct CompiledMappings CompiledMappings;
+
+CompiledMappings *compiled_mappings_new(int settings_n);
+void compiled_mappings_free(CompiledMappings *self);
+
+gboolean compiled_mappings_compile(CompiledMappings *self, MyPaintMapping **mappings, int inputs_n);
+uint32_t compiled_mappings_get_inputs_used(const CompiledMappings *self);
+void compiled_mappings_evaluate(const CompiledMappings *self, const float *inputs, float *values);
+
+G_END_DECLS
+
+#endif // COMPILEDMAPPINGS_H
@@ -5,9 +5,10 @@
 
 #include "helpers.c"
 #include "brushmodes.c"
-#include "fifo.c"
+#include "compiledmappings.c"
 #include "operationqueue.c"
 #include "rng-double.c"
+#include "spectralcache.c"
 #include "write_ppm.c"
 #include "tilemap.c"
 
@@ -19,5 +20,6 @@
 #include "mypaint-symmetry.c"
 #include "mypaint-surface.c"
 #include "mypaint-tiled-surface.c"
+#include "mypaint-tracing.c"
 #include "mypaint-rectangle.c"
 #include "mypaint-mapping.c"
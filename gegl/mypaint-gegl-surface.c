@@ -18,6 +18,7 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <math.h>
 
 #include "mypaint-gegl-surface.h"
 #include <gegl-utils.h>
@@ -34,12 +35,48 @@ struct MyPaintGeglTiledSurface {
     GeglRectangle extent_rect; // TODO: remove, just use the extent of the buffer
     GeglBuffer *buffer;
     const Babl *format;
+    gboolean buffer_native; // buffer has our format and tile size, see update_buffer_native()
+    GHashTable *foreign_tiles; // ForeignTile set, while in a transaction on a foreign buffer
+    GMutex mutex; // Protects extent_rect from concurrent tile requests
 };
 
+// Tile of a foreign buffer, converted to our format once per transaction
+typedef struct {
+    int tx;
+    int ty;
+    uint16_t *data;
+    gboolean dirty;
+} ForeignTile;
+
 void free_gegl_tiledsurf(MyPaintSurface *surface);
 
+static guint
+foreign_tile_hash(gconstpointer key)
+{
+    const ForeignTile *tile = (const ForeignTile *)key;
+    return (guint)tile->tx * 73856093u ^ (guint)tile->ty * 19349663u;
+}
+
 static gboolean
-buffer_is_native(MyPaintGeglTiledSurface *self) {
+foreign_tile_equal(gconstpointer a, gconstpointer b)
+{
+    const ForeignTile *tile_a = (const ForeignTile *)a;
+    const ForeignTile *tile_b = (const ForeignTile *)b;
+    return tile_a->tx == tile_b->tx && tile_a->ty == tile_b->ty;
+}
+
+static void
+foreign_tile_free(gpointer data)
+{
+    ForeignTile *tile = (ForeignTile *)data;
+    gegl_free(tile->data);
+    g_free(tile);
+}
+
+// Checking the buffer properties is too slow to do for every tile request,
+// so this is only done when the buffer changes.
+static void
+update_buffer_native(MyPaintGeglTiledSurface *self) {
     const int tile_size = self->parent.tile_size;
 
     int tile_height = -1;
@@ -51,7 +88,7 @@ buffer_is_native(MyPaintGeglTiledSurface *self) {
     const gboolean correct_format = gegl_buffer_get_format(self->buffer) == self->format;
     const gboolean correct_tile_size = tile_height == tile_size && tile_width == tile_size;
 
-    return correct_format && correct_tile_size;
+    self->buffer_native = correct_format && correct_tile_size;
 }
 
 void *
@@ -76,13 +113,18 @@ tile_request_start(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *reque
     } else {
         read_write_flags = GEGL_BUFFER_READWRITE;
 
-        // Extend the bounding box
-        gegl_rectangle_bounding_box(&self->extent_rect, &self->extent_rect, &tile_bbox);
-        gboolean success = gegl_buffer_set_extent(self->buffer, &self->extent_rect);
-        g_assert(success);
+        // Extend the bounding box. This is normally done up front by end_atomic(),
+        // so that parallel requests do not resize the buffer.
+        g_mutex_lock(&self->mutex);
+        if (!gegl_rectangle_contains(&self->extent_rect, &tile_bbox)) {
+            gegl_rectangle_bounding_box(&self->extent_rect, &self->extent_rect, &tile_bbox);
+            gboolean success = gegl_buffer_set_extent(self->buffer, &self->extent_rect);
+            g_assert(success);
+        }
+        g_mutex_unlock(&self->mutex);
     }
 
-    if (buffer_is_native(self)) {
+    if (self->buffer_native) {
         GeglBufferIterator *iterator = gegl_buffer_iterator_new(
           self->buffer, &tile_bbox, 0, self->format,
           read_write_flags, GEGL_ABYSS_NONE
@@ -110,6 +152,25 @@ tile_request_start(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *reque
 
         // So we can finish the iterator in tile_request_end()
         request->context = (void *)iterator;
+    } else if (self->foreign_tiles) {
+        // Convert each tile only once per transaction, it is written
+        // back when the transaction ends
+        ForeignTile key = {request->tx, request->ty, NULL, FALSE};
+        ForeignTile *tile = (ForeignTile *)g_hash_table_lookup(self->foreign_tiles, &key);
+        if (!tile) {
+            tile = g_new(ForeignTile, 1);
+            *tile = key;
+            tile->data = alloc_for_format(self->format, tile_size*tile_size);
+            g_assert(tile->data);
+            gegl_buffer_get(self->buffer, &tile_bbox, 1, self->format,
+                            tile->data, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+            g_hash_table_add(self->foreign_tiles, tile);
+        }
+        if (!request->readonly) {
+            tile->dirty = TRUE;
+        }
+        request->buffer = tile->data;
+        request->context = (void *)tile;
     } else {
         // Extract a linear rectangular chunk of appropriate BablFormat,
         // potentially triggering copying and color conversions
@@ -117,6 +178,7 @@ tile_request_start(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *reque
         gegl_buffer_get(self->buffer, &tile_bbox, 1, self->format,
                         request->buffer, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
         g_assert(request->buffer);
+        request->context = NULL;
     }
 }
 
@@ -125,27 +187,110 @@ tile_request_end(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *request
 {
     MyPaintGeglTiledSurface *self = (MyPaintGeglTiledSurface *)tiled_surface;
 
-    if (buffer_is_native(self)) {
+    if (self->buffer_native) {
         GeglBufferIterator *iterator = (GeglBufferIterator *)request->context;
 
         if (iterator) {
             gegl_buffer_iterator_next(iterator);
             request->context = NULL;
         }
+    } else if (request->context) {
+        // Cached in foreign_tiles, written back by flush_foreign_tiles()
+        request->context = NULL;
     } else {
-        // Push our linear buffer back into the GeglBuffer
-        const int tile_size = tiled_surface->tile_size;
-        GeglRectangle tile_bbox;
-
         g_assert(request->buffer);
-        gegl_rectangle_set(&tile_bbox, request->tx*tile_size, request->ty*tile_size, tile_size, tile_size);
-        gegl_buffer_set(self->buffer, &tile_bbox, 0, self->format,
-                        request->buffer, GEGL_AUTO_ROWSTRIDE);
+        if (!request->readonly) {
+            // Push our linear buffer back into the GeglBuffer
+            const int tile_size = tiled_surface->tile_size;
+            GeglRectangle tile_bbox;
+
+            gegl_rectangle_set(&tile_bbox, request->tx*tile_size, request->ty*tile_size, tile_size, tile_size);
+            gegl_buffer_set(self->buffer, &tile_bbox, 0, self->format,
+                            request->buffer, GEGL_AUTO_ROWSTRIDE);
+        }
         gegl_free(request->buffer);
     }
 
 }
 
+// Write back the tiles of a foreign buffer changed in this transaction
+static void
+flush_foreign_tiles(MyPaintGeglTiledSurface *self)
+{
+    if (!self->foreign_tiles) {
+        return;
+    }
+    const int tile_size = self->parent.tile_size;
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init(&iter, self->foreign_tiles);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        ForeignTile *tile = (ForeignTile *)key;
+        if (tile->dirty) {
+            GeglRectangle tile_bbox;
+            gegl_rectangle_set(&tile_bbox, tile->tx*tile_size, tile->ty*tile_size, tile_size, tile_size);
+            gegl_buffer_set(self->buffer, &tile_bbox, 0, self->format,
+                            tile->data, GEGL_AUTO_ROWSTRIDE);
+        }
+    }
+    g_hash_table_destroy(self->foreign_tiles);
+    self->foreign_tiles = NULL;
+}
+
+static void
+begin_atomic(MyPaintSurface *surface)
+{
+    MyPaintGeglTiledSurface *self = (MyPaintGeglTiledSurface *)surface;
+
+    mypaint_tiled_surface_begin_atomic(&self->parent);
+
+    if (!self->buffer_native && !self->foreign_tiles) {
+        self->foreign_tiles = g_hash_table_new_full(foreign_tile_hash, foreign_tile_equal,
+                                                    foreign_tile_free, NULL);
+    }
+}
+
+// Grow the buffer to cover all tiles touched in this transaction, before
+// they are processed in parallel
+static void
+extend_to_dirty_area(MyPaintGeglTiledSurface *self)
+{
+    const int tile_size = self->parent.tile_size;
+    GeglRectangle extent = self->extent_rect;
+
+    for (int i = 0; i < self->parent.num_bboxes_dirtied; i++) {
+        const MyPaintRectangle *bbox = &self->parent.bboxes[i];
+        if (bbox->width <= 0 || bbox->height <= 0) {
+            continue;
+        }
+        // Align to whole tiles, as tile requests do
+        const int tx0 = floor((double)bbox->x / tile_size);
+        const int ty0 = floor((double)bbox->y / tile_size);
+        const int tx1 = floor((double)(bbox->x + bbox->width - 1) / tile_size);
+        const int ty1 = floor((double)(bbox->y + bbox->height - 1) / tile_size);
+        GeglRectangle tiles_bbox;
+        gegl_rectangle_set(&tiles_bbox, tx0 * tile_size, ty0 * tile_size,
+                           (tx1 - tx0 + 1) * tile_size, (ty1 - ty0 + 1) * tile_size);
+        gegl_rectangle_bounding_box(&extent, &extent, &tiles_bbox);
+    }
+    if (!gegl_rectangle_equal(&extent, &self->extent_rect)) {
+        self->extent_rect = extent;
+        gboolean success = gegl_buffer_set_extent(self->buffer, &self->extent_rect);
+        g_assert(success);
+    }
+}
+
+static void
+end_atomic(MyPaintSurface *surface, MyPaintRectangles *roi)
+{
+    MyPaintGeglTiledSurface *self = (MyPaintGeglTiledSurface *)surface;
+
+    extend_to_dirty_area(self);
+    mypaint_tiled_surface_end_atomic(&self->parent, roi);
+    flush_foreign_tiles(self);
+}
+
 void
 save_png(MyPaintSurface *surface, const char *path,
          int x, int y, int width, int height)
@@ -187,6 +332,7 @@ mypaint_gegl_tiled_surface_set_buffer(MyPaintGeglTiledSurface *self, GeglBuffer
     }
 
     if (self->buffer) {
+        flush_foreign_tiles(self);
         g_object_unref(self->buffer);
     }
 
@@ -205,8 +351,10 @@ mypaint_gegl_tiled_surface_set_buffer(MyPaintGeglTiledSurface *self, GeglBuffer
     }
     g_assert(GEGL_IS_BUFFER(self->buffer));
 
-
-    self->parent.threadsafe_tile_requests = buffer_is_native(self);
+    update_buffer_native(self);
+    // Tiles of foreign buffers share the tile table and go through babl
+    // conversions, so they are only requested from one thread
+    self->parent.threadsafe_tile_requests = self->buffer_native;
 }
 
 MyPaintGeglTiledSurface *
@@ -219,10 +367,15 @@ mypaint_gegl_tiled_surface_new(void)
     // MyPaintSurface vfuncs
     self->parent.parent.destroy = free_gegl_tiledsurf;
     self->parent.parent.save_png = save_png;
+    self->parent.parent.begin_atomic = begin_atomic;
+    self->parent.parent.end_atomic = end_atomic;
 
     self->parent.threadsafe_tile_requests = TRUE;
+    g_mutex_init(&self->mutex);
 
     self->buffer = NULL;
+    self->buffer_native = FALSE;
+    self->foreign_tiles = NULL;
 
     gegl_rectangle_set(&self->extent_rect, 0, 0, 0, 0);
 
@@ -241,7 +394,9 @@ void free_gegl_tiledsurf(MyPaintSurface *surface)
     MyPaintGeglTiledSurface *self = (MyPaintGeglTiledSurface *)surface;
 
     mypaint_tiled_surface_destroy(&self->parent);
+    flush_foreign_tiles(self);
     g_object_unref(self->buffer);
+    g_mutex_clear(&self->mutex);
 
     free(self);
 }
@@ -22,7 +22,15 @@
 #include <assert.h>
 #include <stdint.h>
 #include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #include "fastapprox/fastpow.h"
+#include "fastapprox/fastlog.h"
 
 #include "helpers.h"
 
@@ -58,6 +66,44 @@ static const float spectral_b_small[10] = {0.537052150373386,0.546646402401469,0
 ,0.041709923751716,0.012662638828324,0.007485593127390,0.006766900622462
 ,0.006699764779016,0.006676219883241};
 
+// The tables below are the ones above with the WGM_EPSILON offset folded
+// in, so that the conversions used for pigment mixing reduce to:
+//
+//   spectral[i] = r * SPECTRAL_BASIS[0][i] + g * SPECTRAL_BASIS[1][i]
+//               + b * SPECTRAL_BASIS[2][i] + SPECTRAL_BASIS_OFFSET[i]
+//   rgb[c] = CLAMP(sum_i(T_MATRIX_BASIS[c][i] * spectral[i]) - RGB_BASIS_OFFSET, 0, 1)
+//
+// SPECTRAL_BASIS is spectral_*_small scaled by (1 - WGM_EPSILON), the offset
+// is WGM_EPSILON times the sum of the three bases, T_MATRIX_BASIS is
+// T_MATRIX_SMALL divided by (1 - WGM_EPSILON) and RGB_BASIS_OFFSET is
+// WGM_EPSILON / (1 - WGM_EPSILON).
+
+static const float SPECTRAL_BASIS[3][10] = {{0.009272081425165, 0.009722894414974, 0.011242998484430, 0.015090473070923
+,0.024773126253040, 0.083538962916904, 0.976887180677489, 0.999000000000000
+,0.998961085098228, 0.998999992764065}
+,{0.002851273308339, 0.003913672090234, 0.012120019547488, 0.747510946712095
+,0.999000000000000, 0.864830241594263, 0.037439991771860, 0.022793972935991
+,0.021725672027010, 0.021363555631736}
+,{0.536515098223013, 0.546099755999068, 0.574926317254909, 0.258520050804290
+,0.041668213827964, 0.012649976189496, 0.007478107534263, 0.006760133721840
+,0.006693065014237, 0.006669543663358}};
+
+static const float SPECTRAL_BASIS_OFFSET[10] = {0.000549187640597, 0.000560296619123, 0.000598888223510
+,0.001022143614202, 0.001066507847929, 0.000961981161863, 0.001022828108092
+,0.001029583690348, 0.001028408230370, 0.001028061153212};
+
+static const float T_MATRIX_BASIS[3][10] = {{0.026622243487176, 0.049829255513416, 0.022472323182679
+,-0.218672361639911, -0.257152035236515, 0.446328050245085, 0.773139025315071
+,0.194693454837374, 0.014052209797618, 0.007694959439953}
+,{-0.032634306981393, -0.061082125624102, -0.052542543561966, 0.206865964237760
+,0.573069404562732, 0.318155404219658, -0.021237861893104, -0.019407075831949
+,-0.001522861912771, -0.000836017640174}
+,{0.339815288504789, 0.636037411588811, 0.772293090179769, 0.113335976669048
+,-0.055306419763540, -0.048270849317998, -0.012979645985572, -0.001525339844067
+,-0.000094813762573, -0.000051656250992}};
+
+static const float RGB_BASIS_OFFSET = 0.001001001001001;
+
 
 float rand_gauss (RngDouble * rng)
 {
@@ -69,6 +115,20 @@ float rand_gauss (RngDouble * rng)
   return sum * 1.73205080757 - 3.46410161514;
 }
 
+uint64_t monotonic_time_ns (void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return (uint64_t)((double)t.QuadPart * 1e9 / (double)f.QuadPart);
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+#endif
+}
+
 // C fmodf function is not "arithmetic modulo"; it doesn't handle negative dividends as you might expect
 // if you expect 0 or a positive number when dealing with negatives, use
 // this function instead.
@@ -559,50 +619,160 @@ spectral_to_rgb (float *spectral, float *rgb_) {
 }
 
 
+// Log-domain spectral mixing
+//
+// A color is represented by the base-2 logarithm of its spectral
+// reflectance. The weighted geometric mean of two such colors is then a
+// weighted sum, followed by a single exp2 per band when converting back.
+// The *_fast variants and the mixers use the fastapprox approximations and
+// are meant for per-pixel use, the others are exact.
+
+void
+rgb_to_log_spectral (float r, float g, float b, float *log_spectral_) {
+  for (int i=0; i<10; i++) {
+    log_spectral_[i] = log2f(r * SPECTRAL_BASIS[0][i] + g * SPECTRAL_BASIS[1][i] +
+                             b * SPECTRAL_BASIS[2][i] + SPECTRAL_BASIS_OFFSET[i]);
+  }
+}
+
+void
+rgb_to_log_spectral_fast (float r, float g, float b, float *log_spectral_) {
+  for (int i=0; i<10; i++) {
+    log_spectral_[i] = fastlog2(r * SPECTRAL_BASIS[0][i] + g * SPECTRAL_BASIS[1][i] +
+                                b * SPECTRAL_BASIS[2][i] + SPECTRAL_BASIS_OFFSET[i]);
+  }
+}
+
+void
+log_spectral_to_rgb (const float *log_spectral, float *rgb_) {
+  float tmp[3] = {0};
+  for (int i=0; i<10; i++) {
+    const float spectral = exp2f(log_spectral[i]);
+    tmp[0] += T_MATRIX_BASIS[0][i] * spectral;
+    tmp[1] += T_MATRIX_BASIS[1][i] * spectral;
+    tmp[2] += T_MATRIX_BASIS[2][i] * spectral;
+  }
+  for (int i=0; i<3; i++) {
+    rgb_[i] = CLAMP(tmp[i] - RGB_BASIS_OFFSET, 0.0f, 1.0f);
+  }
+}
+
+// WGM of two log-spectral colors, weighted fac_a : (1 - fac_a), converted
+// straight back to rgb. The mixed log-spectral color replaces b.
+void
+log_spectral_mix_in_place (const float *log_spectral_a, float fac_a, float *log_spectral_b, float *rgb_) {
+  const float fac_b = 1.0f - fac_a;
+  float tmp[3] = {0};
+  for (int i=0; i<10; i++) {
+    log_spectral_b[i] = fac_a * log_spectral_a[i] + fac_b * log_spectral_b[i];
+    const float spectral = fastpow2(log_spectral_b[i]);
+    tmp[0] += T_MATRIX_BASIS[0][i] * spectral;
+    tmp[1] += T_MATRIX_BASIS[1][i] * spectral;
+    tmp[2] += T_MATRIX_BASIS[2][i] * spectral;
+  }
+  for (int i=0; i<3; i++) {
+    rgb_[i] = CLAMP(tmp[i] - RGB_BASIS_OFFSET, 0.0f, 1.0f);
+  }
+}
+
+// Fused rgb -> spectral -> WGM -> rgb: mixes the straight color (r, g, b)
+// into the log-spectral color a, weighted fac_a : (1 - fac_a), in a single
+// pass over the bands.
+void
+log_spectral_mix_rgb (const float *log_spectral_a, float fac_a, float r, float g, float b, float *rgb_) {
+  const float fac_b = 1.0f - fac_a;
+  float tmp[3] = {0};
+  for (int i=0; i<10; i++) {
+    const float log_spectral_b = fastlog2(r * SPECTRAL_BASIS[0][i] + g * SPECTRAL_BASIS[1][i] +
+                                          b * SPECTRAL_BASIS[2][i] + SPECTRAL_BASIS_OFFSET[i]);
+    const float spectral = fastpow2(fac_a * log_spectral_a[i] + fac_b * log_spectral_b);
+    tmp[0] += T_MATRIX_BASIS[0][i] * spectral;
+    tmp[1] += T_MATRIX_BASIS[1][i] * spectral;
+    tmp[2] += T_MATRIX_BASIS[2][i] * spectral;
+  }
+  for (int i=0; i<3; i++) {
+    rgb_[i] = CLAMP(tmp[i] - RGB_BASIS_OFFSET, 0.0f, 1.0f);
+  }
+}
+
+
+// Number of colors mix_colors_n() works on at a time
+#define MIX_COLORS_CHUNK 8
+
 //function to make it easy to blend two spectral colors via weighted geometric mean
 //a is the current smudge state, b is the get_color or brush color
-float * mix_colors(float *a, float *b, float fac, float paint_mode)
+//
+//Mixes n pairs of straight RGBA colors (4 floats each), with the weights
+//of the a colors given by fac. Each stage of the mix is a separate loop
+//over a chunk of colors, so the work can be vectorized across colors.
+//The result array may be the same as a or b.
+void
+mix_colors_n(const float *a, const float *b, const float *fac, float paint_mode, float *result, int n)
 {
-  static float result[4] = {0};  
-  
-  float opa_a = fac;
-  float opa_b = 1.0-opa_a;
-  result[3] = CLAMP(opa_a * a[3] + opa_b * b[3], 0.0f, 1.0f);
-  // Guard against NaN from division by zero
-  float sfac_a = a[3] == 0 ? 0.0 : opa_a * a[3] / (a[3] + b[3] * opa_b);
-  float sfac_b = 1 - sfac_a;
-
-  if (paint_mode > 0.0) { 
-    float spec_a[10] = {0};
-    float spec_b[10] = {0};
-
-    rgb_to_spectral(a[0], a[1], a[2], spec_a);
-    rgb_to_spectral(b[0], b[1], b[2], spec_b);
-    
-    //blend spectral primaries subtractive WGM
-    float spectralmix[10] = {0};
-    for (int i=0; i < 10; i++) {
+  for (int start = 0; start < n; start += MIX_COLORS_CHUNK) {
+    const int len = MIN(MIX_COLORS_CHUNK, n - start);
+    const float *chunk_a = a + 4 * start;
+    const float *chunk_b = b + 4 * start;
+    const float *chunk_fac = fac + start;
+    float mixed[MIX_COLORS_CHUNK][4];
+    float sfac_a[MIX_COLORS_CHUNK];
+
+    for (int j = 0; j < len; j++) {
+      const float *col_a = chunk_a + 4 * j;
+      const float *col_b = chunk_b + 4 * j;
+      const float opa_a = chunk_fac[j];
+      const float opa_b = 1.0f - opa_a;
+      mixed[j][3] = CLAMP(opa_a * col_a[3] + opa_b * col_b[3], 0.0f, 1.0f);
+      // Guard against NaN from division by zero
+      sfac_a[j] = col_a[3] == 0 ? 0.0f : opa_a * col_a[3] / (col_a[3] + col_b[3] * opa_b);
+      mixed[j][0] = mixed[j][1] = mixed[j][2] = 0.0f;
+    }
+
+    if (paint_mode > 0.0) {
+      //blend spectral primaries subtractive WGM, in the log domain
       // 'mix_colors' is called infrequently enough that we
       // can afford to not use the faster approximations here.
-      spectralmix[i] = powf(spec_a[i], sfac_a) * powf(spec_b[i], sfac_b);
+      float log_mix[MIX_COLORS_CHUNK][10];
+      for (int j = 0; j < len; j++) {
+        float log_spec_a[10];
+        float log_spec_b[10];
+        rgb_to_log_spectral(chunk_a[4*j], chunk_a[4*j+1], chunk_a[4*j+2], log_spec_a);
+        rgb_to_log_spectral(chunk_b[4*j], chunk_b[4*j+1], chunk_b[4*j+2], log_spec_b);
+        for (int i = 0; i < 10; i++) {
+          log_mix[j][i] = sfac_a[j] * log_spec_a[i] + (1.0f - sfac_a[j]) * log_spec_b[i];
+        }
+      }
+      //convert to RGB
+      for (int j = 0; j < len; j++) {
+        log_spectral_to_rgb(log_mix[j], mixed[j]);
+      }
     }
-    
-    //convert to RGB
-    float rgb_result[3] = {0};
-    spectral_to_rgb(spectralmix, rgb_result);
 
-    for (int i=0; i < 3; i++) {
-      result[i] = rgb_result[i];
+    if (paint_mode < 1.0) {
+      for (int j = 0; j < len; j++) {
+        const float opa_a = chunk_fac[j];
+        const float opa_b = 1.0f - opa_a;
+        for (int i = 0; i < 3; i++) {
+          mixed[j][i] = mixed[j][i] * paint_mode +
+                        (1 - paint_mode) * (chunk_a[4*j+i] * opa_a + chunk_b[4*j+i] * opa_b);
+        }
+      }
     }
-  }
-  
-  if (paint_mode < 1.0) {
-    for (int i=0; i<3; i++) {
-      result[i] = result[i] * paint_mode + (1-paint_mode) * (a[i] * opa_a + b[i] * opa_b);
+
+    float *chunk_result = result + 4 * start;
+    for (int j = 0; j < len; j++) {
+      for (int i = 0; i < 4; i++) {
+        chunk_result[4*j+i] = mixed[j][i];
+      }
     }
   }
+}
 
-  return result;
+//Mixes a single pair of colors, see mix_colors_n()
+void
+mix_colors(const float *a, const float *b, float fac, float paint_mode, float *result)
+{
+  mix_colors_n(a, b, &fac, paint_mode, result, 1);
 }
 
 #endif //HELPERS_C
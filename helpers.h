@@ -37,11 +37,18 @@ rgb_to_hcy_float (float *r_, float *g_, float *b_);
 
 float rand_gauss (RngDouble * rng);
 
+// Monotonic clock, in nanoseconds. Only differences between readings are meaningful.
+uint64_t monotonic_time_ns (void);
+
 float mod_arith(float a, float N);
 
 float smallest_angular_difference(float angleA, float angleB);
 
-float * mix_colors(float *a, float *b, float fac, float paint_mode);
+void
+mix_colors(const float *a, const float *b, float fac, float paint_mode, float *result);
+
+void
+mix_colors_n(const float *a, const float *b, const float *fac, float paint_mode, float *result, int n);
 
 void
 rgb_to_spectral (float r, float g, float b, float *spectral_);
@@ -49,4 +56,19 @@ rgb_to_spectral (float r, float g, float b, float *spectral_);
 void
 spectral_to_rgb (float *spectral, float *rgb_);
 
+void
+rgb_to_log_spectral (float r, float g, float b, float *log_spectral_);
+
+void
+rgb_to_log_spectral_fast (float r, float g, float b, float *log_spectral_);
+
+void
+log_spectral_to_rgb (const float *log_spectral, float *rgb_);
+
+void
+log_spectral_mix_in_place (const float *log_spectral_a, float fac_a, float *log_spectral_b, float *rgb_);
+
+void
+log_spectral_mix_rgb (const float *log_spectral_a, float fac_a, float r, float g, float b, float *rgb_);
+
 #endif // HELPERS_H
@@ -31,8 +31,10 @@
 
 #include "mypaint-brush-settings.h"
 #include "mypaint-mapping.h"
+#include "compiledmappings.h"
 #include "helpers.h"
 #include "rng-double.h"
+#include "tracing.h"
 
 #include <json.h>
 
@@ -109,6 +111,9 @@ struct MyPaintBrush {
     // Those mappings describe how to calculate the current value for each setting.
     // Most of settings will be constant (eg. only their base_value is used).
     MyPaintMapping * settings[MYPAINT_BRUSH_SETTINGS_COUNT];
+    // Flattened form of the mappings above, rebuilt when they have changed
+    CompiledMappings *compiled_settings;
+    gboolean settings_changed;
 
     // the current value of all settings (calculated using the current state)
     float settings_value[MYPAINT_BRUSH_SETTINGS_COUNT];
@@ -135,6 +140,8 @@ struct MyPaintBrush {
 #define SETTING(self, setting_name) ((self)->settings_value[MYPAINT_BRUSH_SETTING_##setting_name])
 #define BASEVAL(self, setting_name) (mypaint_mapping_get_base_value((self)->settings[MYPAINT_BRUSH_SETTING_##setting_name]))
 #define INPUT(input_name) (inputs[MYPAINT_BRUSH_INPUT_##input_name])
+// Relies on an 'inputs_used' bitmask in the same way
+#define INPUT_USED(input_name) (inputs_used & (1u << MYPAINT_BRUSH_INPUT_##input_name))
 
 void settings_base_values_have_changed (MyPaintBrush *self);
 
@@ -214,6 +221,8 @@ mypaint_brush_new_with_buckets(int num_smudge_buckets)
     for (int i = 0; i < MYPAINT_BRUSH_SETTINGS_COUNT; i++) {
       self->settings[i] = mypaint_mapping_new(MYPAINT_BRUSH_INPUTS_COUNT);
     }
+    self->compiled_settings = compiled_mappings_new(MYPAINT_BRUSH_SETTINGS_COUNT);
+    self->settings_changed = TRUE;
     self->rng = rng_double_new(1000);
     self->random_input = 0;
     self->print_inputs = FALSE;
@@ -236,6 +245,9 @@ brush_free(MyPaintBrush *self)
     for (int i = 0; i < MYPAINT_BRUSH_SETTINGS_COUNT; i++) {
         mypaint_mapping_free(self->settings[i]);
     }
+    if (self->compiled_settings) {
+        compiled_mappings_free(self->compiled_settings);
+    }
     rng_double_free (self->rng);
     self->rng = NULL;
 
@@ -328,6 +340,7 @@ mypaint_brush_set_base_value(MyPaintBrush *self, MyPaintBrushSetting id, float v
 {
     assert (id < MYPAINT_BRUSH_SETTINGS_COUNT);
     mypaint_mapping_set_base_value(self->settings[id], value);
+    self->settings_changed = TRUE;
 
     settings_base_values_have_changed (self);
 }
@@ -354,6 +367,7 @@ mypaint_brush_set_mapping_n(MyPaintBrush *self, MyPaintBrushSetting id, MyPaintB
 {
     assert (id < MYPAINT_BRUSH_SETTINGS_COUNT);
     mypaint_mapping_set_n(self->settings[id], input, n);
+    self->settings_changed = TRUE;
 }
 
 /**
@@ -402,6 +416,7 @@ mypaint_brush_set_mapping_point(MyPaintBrush *self, MyPaintBrushSetting id, MyPa
 {
     assert (id < MYPAINT_BRUSH_SETTINGS_COUNT);
     mypaint_mapping_set_point(self->settings[id], input, index, x, y);
+    self->settings_changed = TRUE;
 }
 
 /**
@@ -728,7 +743,21 @@ void print_inputs(MyPaintBrush *self, float* inputs)
     const float viewrotation = mod_arith(DEGREES(step_viewrotation) + 180.0, 360.0) - 180.0;
     STATE(self, VIEWROTATION) = viewrotation;
 
-    { // Gridmap state update
+    if (self->settings_changed && self->compiled_settings) {
+      if (compiled_mappings_compile(self->compiled_settings, self->settings, MYPAINT_BRUSH_INPUTS_COUNT)) {
+        self->settings_changed = FALSE;
+      }
+    }
+
+    // Inputs that no setting depends on are not calculated, and the filtered
+    // states that only feed those inputs are not updated. They resume from
+    // their old values if a mapping starts using them.
+    uint32_t inputs_used = (1u << MYPAINT_BRUSH_INPUTS_COUNT) - 1;
+    if (!self->settings_changed && !self->print_inputs) {
+      inputs_used = compiled_mappings_get_inputs_used(self->compiled_settings);
+    }
+
+    if (INPUT_USED(GRIDMAP_X) || INPUT_USED(GRIDMAP_Y)) { // Gridmap state update
         const float x = STATE(self, ACTUAL_X);
         const float y = STATE(self, ACTUAL_Y);
         const float scale = expf(SETTING(self, GRIDMAP_SCALE));
@@ -772,34 +801,45 @@ void print_inputs(MyPaintBrush *self, float* inputs)
     const float norm_dx = step_dx / step_dtime * STATE(self, VIEWZOOM);
     const float norm_dy = step_dy / step_dtime * STATE(self, VIEWZOOM);
 
-    const float norm_speed = hypotf(norm_dx, norm_dy);
     //norm_dist should relate to brush size, whereas norm_speed should not
     const float norm_dist = hypotf(step_dx / step_dtime / base_radius, step_dy / step_dtime / base_radius) * step_dtime;
 
-    float inputs[MYPAINT_BRUSH_INPUTS_COUNT];
+    float inputs[MYPAINT_BRUSH_INPUTS_COUNT] = {0};
 
     INPUT(PRESSURE) = pressure * expf(BASEVAL(self, PRESSURE_GAIN_LOG));
 
-    const float m0 = self->speed_mapping_m[0];
-    const float q0 = self->speed_mapping_q[0];
-    const float m1 = self->speed_mapping_m[1];
-    const float q1 = self->speed_mapping_q[1];
-    INPUT(SPEED1) = log(self->speed_mapping_gamma[0] + STATE(self, NORM_SPEED1_SLOW)) * m0 + q0;
-    INPUT(SPEED2) = log(self->speed_mapping_gamma[1] + STATE(self, NORM_SPEED2_SLOW)) * m1 + q1;
+    if (INPUT_USED(SPEED1)) {
+      const float m0 = self->speed_mapping_m[0];
+      const float q0 = self->speed_mapping_q[0];
+      INPUT(SPEED1) = log(self->speed_mapping_gamma[0] + STATE(self, NORM_SPEED1_SLOW)) * m0 + q0;
+    }
+    if (INPUT_USED(SPEED2)) {
+      const float m1 = self->speed_mapping_m[1];
+      const float q1 = self->speed_mapping_q[1];
+      INPUT(SPEED2) = log(self->speed_mapping_gamma[1] + STATE(self, NORM_SPEED2_SLOW)) * m1 + q1;
+    }
 
     INPUT(RANDOM) = self->random_input;
     INPUT(STROKE) = MIN(STATE(self, STROKE), 1.0);
 
     //correct direction for varying view rotation
-    const float dir_angle = atan2f(STATE(self, DIRECTION_DY), STATE(self, DIRECTION_DX));
-    INPUT(DIRECTION) = mod_arith(DEGREES(dir_angle) + viewrotation + 180.0, 180.0);
-    const float dir_angle_360 = atan2f(STATE(self, DIRECTION_ANGLE_DY), STATE(self, DIRECTION_ANGLE_DX));
-    INPUT(DIRECTION_ANGLE) = fmodf(DEGREES(dir_angle_360) + viewrotation + 360.0, 360.0) ;
+    if (INPUT_USED(DIRECTION)) {
+      const float dir_angle = atan2f(STATE(self, DIRECTION_DY), STATE(self, DIRECTION_DX));
+      INPUT(DIRECTION) = mod_arith(DEGREES(dir_angle) + viewrotation + 180.0, 180.0);
+    }
+    if (INPUT_USED(DIRECTION_ANGLE) || INPUT_USED(ATTACK_ANGLE)) {
+      const float dir_angle_360 = atan2f(STATE(self, DIRECTION_ANGLE_DY), STATE(self, DIRECTION_ANGLE_DX));
+      INPUT(DIRECTION_ANGLE) = fmodf(DEGREES(dir_angle_360) + viewrotation + 360.0, 360.0) ;
+      INPUT(ATTACK_ANGLE) = smallest_angular_difference(STATE(self, ASCENSION), mod_arith(DEGREES(dir_angle_360) + 90, 360));
+    }
     INPUT(TILT_DECLINATION) = STATE(self, DECLINATION);
     //correct ascension for varying view rotation, use custom mod
-    INPUT(TILT_ASCENSION) = mod_arith(STATE(self, ASCENSION) + viewrotation + 180.0, 360.0) - 180.0;
-    INPUT(VIEWZOOM) = BASEVAL(self, RADIUS_LOGARITHMIC) - logf(base_radius / STATE(self, VIEWZOOM));
-    INPUT(ATTACK_ANGLE) = smallest_angular_difference(STATE(self, ASCENSION), mod_arith(DEGREES(dir_angle_360) + 90, 360));
+    if (INPUT_USED(TILT_ASCENSION)) {
+      INPUT(TILT_ASCENSION) = mod_arith(STATE(self, ASCENSION) + viewrotation + 180.0, 360.0) - 180.0;
+    }
+    if (INPUT_USED(VIEWZOOM)) {
+      INPUT(VIEWZOOM) = BASEVAL(self, RADIUS_LOGARITHMIC) - logf(base_radius / STATE(self, VIEWZOOM));
+    }
     INPUT(BRUSH_RADIUS) = BASEVAL(self, RADIUS_LOGARITHMIC);
 
     INPUT(GRIDMAP_X) = CLAMP(STATE(self, GRIDMAP_X), 0.0, GRID_SIZE);
@@ -809,14 +849,21 @@ void print_inputs(MyPaintBrush *self, float* inputs)
     INPUT(TILT_DECLINATIONY) = STATE(self, DECLINATIONY);
 
     INPUT(CUSTOM) = STATE(self, CUSTOM_INPUT);
-    INPUT(BARREL_ROTATION) = mod_arith(STATE(self, BARREL_ROTATION), 360);
+    if (INPUT_USED(BARREL_ROTATION)) {
+      INPUT(BARREL_ROTATION) = mod_arith(STATE(self, BARREL_ROTATION), 360);
+    }
 
     if (self->print_inputs) {
         print_inputs(self, inputs);
     }
 
-    for (int i = 0; i < MYPAINT_BRUSH_SETTINGS_COUNT; i++) {
-      self->settings_value[i] = mypaint_mapping_calculate(self->settings[i], (inputs));
+    if (!self->settings_changed) {
+      compiled_mappings_evaluate(self->compiled_settings, inputs, self->settings_value);
+    } else {
+      // Out of memory, fall back to the mappings themselves
+      for (int i = 0; i < MYPAINT_BRUSH_SETTINGS_COUNT; i++) {
+        self->settings_value[i] = mypaint_mapping_calculate(self->settings[i], (inputs));
+      }
     }
 
     STATE(self, DABS_PER_BASIC_RADIUS) = SETTING(self, DABS_PER_BASIC_RADIUS);
@@ -829,11 +876,16 @@ void print_inputs(MyPaintBrush *self, float* inputs)
       STATE(self, ACTUAL_Y) += (STATE(self, Y) - STATE(self, ACTUAL_Y)) * fac;
     }
 
-    { // slow speed
-      const float fac1 = 1.0 - exp_decay(SETTING(self, SPEED1_SLOWNESS), step_dtime);
-      STATE(self, NORM_SPEED1_SLOW) += (norm_speed - STATE(self, NORM_SPEED1_SLOW)) * fac1;
-      const float fac2 = 1.0 - exp_decay (SETTING(self, SPEED2_SLOWNESS), step_dtime);
-      STATE(self, NORM_SPEED2_SLOW) += (norm_speed - STATE(self, NORM_SPEED2_SLOW)) * fac2;
+    if (INPUT_USED(SPEED1) || INPUT_USED(SPEED2)) { // slow speed
+      const float norm_speed = hypotf(norm_dx, norm_dy);
+      if (INPUT_USED(SPEED1)) {
+        const float fac1 = 1.0 - exp_decay(SETTING(self, SPEED1_SLOWNESS), step_dtime);
+        STATE(self, NORM_SPEED1_SLOW) += (norm_speed - STATE(self, NORM_SPEED1_SLOW)) * fac1;
+      }
+      if (INPUT_USED(SPEED2)) {
+        const float fac2 = 1.0 - exp_decay (SETTING(self, SPEED2_SLOWNESS), step_dtime);
+        STATE(self, NORM_SPEED2_SLOW) += (norm_speed - STATE(self, NORM_SPEED2_SLOW)) * fac2;
+      }
     }
 
     { // slow speed, but as vector this time
@@ -862,21 +914,23 @@ void print_inputs(MyPaintBrush *self, float* inputs)
       STATE(self, DIRECTION_ANGLE_DX) += (dx - STATE(self, DIRECTION_ANGLE_DX)) * fac;
       STATE(self, DIRECTION_ANGLE_DY) += (dy - STATE(self, DIRECTION_ANGLE_DY)) * fac;
 
-      // use the opposite speed vector if it is closer (we don't care about 180 degree turns)
-      if (SQR(dx_old-dx) + SQR(dy_old-dy) > SQR(dx_old-(-dx)) + SQR(dy_old-(-dy))) {
-        dx = -dx;
-        dy = -dy;
+      if (INPUT_USED(DIRECTION)) {
+        // use the opposite speed vector if it is closer (we don't care about 180 degree turns)
+        if (SQR(dx_old-dx) + SQR(dy_old-dy) > SQR(dx_old-(-dx)) + SQR(dy_old-(-dy))) {
+          dx = -dx;
+          dy = -dy;
+        }
+        STATE(self, DIRECTION_DX) += (dx - STATE(self, DIRECTION_DX)) * fac;
+        STATE(self, DIRECTION_DY) += (dy - STATE(self, DIRECTION_DY)) * fac;
       }
-      STATE(self, DIRECTION_DX) += (dx - STATE(self, DIRECTION_DX)) * fac;
-      STATE(self, DIRECTION_DY) += (dy - STATE(self, DIRECTION_DY)) * fac;
     }
 
-    { // custom input
+    if (INPUT_USED(CUSTOM)) { // custom input
       const float fac = 1.0 - exp_decay (SETTING(self, CUSTOM_INPUT_SLOWNESS), 0.1);
       STATE(self, CUSTOM_INPUT) += (SETTING(self, CUSTOM_INPUT) - STATE(self, CUSTOM_INPUT)) * fac;
     }
 
-    { // stroke length
+    if (INPUT_USED(STROKE)) { // stroke length
       const float frequency = expf(-SETTING(self, STROKE_DURATION_LOGARITHMIC));
       const float stroke = MAX(0, STATE(self, STROKE) + norm_dist * frequency);
       const float wrap = 1.0 + MAX(0, SETTING(self, STROKE_HOLDTIME));
@@ -983,7 +1037,8 @@ void print_inputs(MyPaintBrush *self, float* inputs)
                                         smudge_bucket[SMUDGE_A]};
           float sampled_color[4] = {r, g, b, a};
 
-          float* smudge_new = mix_colors(prev_smudge_color, sampled_color, update_factor, paint_factor);
+          float smudge_new[4];
+          mix_colors(prev_smudge_color, sampled_color, update_factor, paint_factor, smudge_new);
           smudge_bucket[SMUDGE_R] = smudge_new[SMUDGE_R];
           smudge_bucket[SMUDGE_G] = smudge_new[SMUDGE_G];
           smudge_bucket[SMUDGE_B] = smudge_new[SMUDGE_B];
@@ -1019,7 +1074,8 @@ void print_inputs(MyPaintBrush *self, float* inputs)
               float smudge_color[4] = {smudge_bucket[SMUDGE_R], smudge_bucket[SMUDGE_G], smudge_bucket[SMUDGE_B],
                                        smudge_bucket[SMUDGE_A]};
               float brush_color[4] = {*color_r, *color_g, *color_b, 1.0};
-              float* color_new = mix_colors(smudge_color, brush_color, smudge_factor, paint_factor);
+              float color_new[4];
+              mix_colors(smudge_color, brush_color, smudge_factor, paint_factor, color_new);
               *color_r = color_new[SMUDGE_R];
               *color_g = color_new[SMUDGE_G];
               *color_b = color_new[SMUDGE_B];
@@ -1286,23 +1342,26 @@ gboolean prepare_and_draw_dab (MyPaintBrush *self, MyPaintSurface * surface, gbo
     return res4;
   }
 
-  /**
-   * mypaint_brush_stroke_to:
-   * @dtime: Time since last motion event, in seconds.
-   * @viewzoom: Canvas zoom; 1.0 = 100% zoom. Zoom value v *must* be in range:
-   * 0.0 < v < FLOAT_MAX (reasonable max is probably always below 100).
-   *
-   * Should be called once for each motion event.
-   *
-   *
-   * Returns: non-0 if the stroke is finished or empty, else 0.
-   */
-  int mypaint_brush_stroke_to (MyPaintBrush *self, MyPaintSurface *surface,
-                                float x, float y, float pressure,
-                               float xtilt, float ytilt, double dtime, float viewzoom, float viewrotation, float barrel_rotation, gboolean linear)
+  // Motion event with the tilt converted to angles and insane values
+  // replaced, as consumed by stroke_to_input()
+  typedef struct {
+    float x;
+    float y;
+    float pressure;
+    float tilt_ascension;
+    float tilt_declination;
+    float tilt_declinationx;
+    float tilt_declinationy;
+    double dtime;
+    float viewzoom;
+    float viewrotation;
+    float barrel_rotation;
+  } StrokeInput;
+
+  static void
+  stroke_input_init(StrokeInput *input, float x, float y, float pressure,
+                    float xtilt, float ytilt, double dtime, float viewzoom, float viewrotation, float barrel_rotation)
   {
-    const float max_dtime = 5;
-
     float tilt_ascension = 0.0;
     float tilt_declination = 90.0;
     float tilt_declinationx = 90.0;
@@ -1343,6 +1402,36 @@ gboolean prepare_and_draw_dab (MyPaintBrush *self, MyPaintSurface * surface, gbo
     if (dtime < 0) printf("Time jumped backwards by dtime=%f seconds!\n", dtime);
     if (dtime <= 0) dtime = 0.0001; // protect against possible division by zero bugs
 
+    input->x = x;
+    input->y = y;
+    input->pressure = pressure;
+    input->tilt_ascension = tilt_ascension;
+    input->tilt_declination = tilt_declination;
+    input->tilt_declinationx = tilt_declinationx;
+    input->tilt_declinationy = tilt_declinationy;
+    input->dtime = dtime;
+    input->viewzoom = viewzoom;
+    input->viewrotation = viewrotation;
+    input->barrel_rotation = barrel_rotation;
+  }
+
+  static int
+  stroke_to_input(MyPaintBrush *self, MyPaintSurface *surface, const StrokeInput *input, gboolean linear)
+  {
+    const float max_dtime = 5;
+
+    float x = input->x;
+    float y = input->y;
+    const float pressure = input->pressure;
+    const float tilt_ascension = input->tilt_ascension;
+    const float tilt_declination = input->tilt_declination;
+    const float tilt_declinationx = input->tilt_declinationx;
+    const float tilt_declinationy = input->tilt_declinationy;
+    double dtime = input->dtime;
+    const float viewzoom = input->viewzoom;
+    const float viewrotation = input->viewrotation;
+    const float barrel_rotation = input->barrel_rotation;
+
     if (dtime > 0.100 && pressure && STATE(self, PRESSURE) == 0) {
       // Workaround for tablets that don't report motion events without pressure.
       // This is to avoid linear interpolation of the pressure between two events.
@@ -1459,7 +1548,10 @@ gboolean prepare_and_draw_dab (MyPaintBrush *self, MyPaintSurface * surface, gbo
 
       // Flips between 1 and -1, used for "mirrored" offsets.
       STATE(self, FLIP) *= -1;
+      TRACE_BEGIN(dab_span);
       gboolean painted_now = prepare_and_draw_dab (self, surface, linear);
+      TRACE_ARG(dab_span, 0, painted_now);
+      TRACE_END(dab_span, "prepare_and_draw_dab", "painted");
       if (painted_now) {
         painted = YES;
       } else if (painted == UNKNOWN) {
@@ -1546,6 +1638,73 @@ gboolean prepare_and_draw_dab (MyPaintBrush *self, MyPaintSurface * surface, gbo
     return FALSE;
   }
 
+  /**
+   * mypaint_brush_stroke_to:
+   * @dtime: Time since last motion event, in seconds.
+   * @viewzoom: Canvas zoom; 1.0 = 100% zoom. Zoom value v *must* be in range:
+   * 0.0 < v < FLOAT_MAX (reasonable max is probably always below 100).
+   *
+   * Should be called once for each motion event.
+   *
+   *
+   * Returns: non-0 if the stroke is finished or empty, else 0.
+   */
+  int mypaint_brush_stroke_to (MyPaintBrush *self, MyPaintSurface *surface,
+                                float x, float y, float pressure,
+                               float xtilt, float ytilt, double dtime, float viewzoom, float viewrotation, float barrel_rotation, gboolean linear)
+  {
+    StrokeInput input;
+    stroke_input_init(&input, x, y, pressure, xtilt, ytilt, dtime, viewzoom, viewrotation, barrel_rotation);
+    TRACE_BEGIN(span);
+    const int finished = stroke_to_input(self, surface, &input, linear);
+    TRACE_END(span, "mypaint_brush_stroke_to");
+    return finished;
+  }
+
+  // Number of events converted ahead of the dab loop
+  #define STROKE_EVENTS_CHUNK 64
+
+  /**
+   * mypaint_brush_stroke_to_events:
+   * @events: (array length=events_n): Motion events, in the order they happened.
+   * @finished: (out) (array length=events_n) (nullable): Location to return,
+   * for each event, whether mypaint_brush_stroke_to() would have returned non-0.
+   *
+   * Same as calling mypaint_brush_stroke_to() for each event in turn, but
+   * converts the tilt and sanitizes the events in batches, ahead of the dab
+   * loop. Call it between a single pair of mypaint_surface_begin_atomic() and
+   * mypaint_surface_end_atomic() calls to have the surface process the dabs of
+   * all the events together.
+   *
+   * Returns: the number of events after which the stroke was finished or empty.
+   */
+  int
+  mypaint_brush_stroke_to_events(MyPaintBrush *self, MyPaintSurface *surface,
+                                 const MyPaintMotionEvent *events, int events_n,
+                                 gboolean linear, gboolean *finished)
+  {
+    int finished_n = 0;
+    for (int start = 0; start < events_n; start += STROKE_EVENTS_CHUNK) {
+      const int len = MIN(STROKE_EVENTS_CHUNK, events_n - start);
+      StrokeInput inputs[STROKE_EVENTS_CHUNK];
+      for (int i = 0; i < len; i++) {
+        const MyPaintMotionEvent *e = &events[start + i];
+        stroke_input_init(&inputs[i], e->x, e->y, e->pressure, e->xtilt, e->ytilt, e->dtime,
+                          e->viewzoom, e->viewrotation, e->barrel_rotation);
+      }
+      for (int i = 0; i < len; i++) {
+        TRACE_BEGIN(span);
+        const gboolean stroke_finished = stroke_to_input(self, surface, &inputs[i], linear) != 0;
+        TRACE_END(span, "mypaint_brush_stroke_to");
+        if (finished) {
+          finished[start + i] = stroke_finished;
+        }
+        finished_n += stroke_finished;
+      }
+    }
+    return finished_n;
+  }
+
 // Compat wrapper, for supporting libjson
 static gboolean
 obj_get(json_object *self, const gchar *key, json_object **obj_out) {
@@ -26,6 +26,24 @@ G_BEGIN_DECLS
 
 typedef struct MyPaintBrush MyPaintBrush;
 
+/**
+ * MyPaintMotionEvent:
+ *
+ * One motion event, with the same meaning as the arguments of
+ * mypaint_brush_stroke_to().
+ */
+typedef struct {
+    float x;
+    float y;
+    float pressure;
+    float xtilt;
+    float ytilt;
+    double dtime;
+    float viewzoom;
+    float viewrotation;
+    float barrel_rotation;
+} MyPaintMotionEvent;
+
 MyPaintBrush *
 mypaint_brush_new(void);
 
@@ -48,6 +66,11 @@ mypaint_brush_stroke_to(MyPaintBrush *self, MyPaintSurface *surface, float x, fl
                         float pressure, float xtilt, float ytilt, double dtime, float viewzoom,
                         float viewrotation, float barrel_rotation, gboolean linear);
 
+int
+mypaint_brush_stroke_to_events(MyPaintBrush *self, MyPaintSurface *surface,
+                               const MyPaintMotionEvent *events, int events_n,
+                               gboolean linear, gboolean *finished);
+
 void
 mypaint_brush_set_base_value(MyPaintBrush *self, MyPaintBrushSetting id, float value);
 
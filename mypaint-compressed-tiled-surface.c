@@ -0,0 +1,489 @@
+/* libmypaint - The MyPaint Brush Library
+ * Copyright (C) 2019 The MyPaint Team
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mypaint-compressed-tiled-surface.h"
+
+#define TILE_PIXELS (MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE)
+#define TILE_WORDS (TILE_PIXELS * 4)
+
+// Longest run a single codec header can describe
+#define MAX_RUN 0x8000
+// Repeated deltas shorter than this are stored as literals
+#define MIN_RUN 3
+// Worst case size of an encoded tile: every value a literal, plus headers
+#define MAX_ENCODED_WORDS (TILE_WORDS + 4 * (TILE_PIXELS / MAX_RUN + 1))
+
+// Decompressed tile, in the LRU list of the cache
+typedef struct CacheEntry {
+    struct CacheEntry *prev; // more recently used
+    struct CacheEntry *next; // less recently used
+    int tile_index;
+    int requests; // requests in flight; pinned entries are not evicted
+    gboolean dirty; // written to since it was decompressed
+    uint16_t buffer[TILE_WORDS];
+} CacheEntry;
+
+typedef struct {
+    uint16_t *data; // compressed content, NULL if never written
+    int words; // length of data
+    gboolean raw; // data is stored uncompressed, as it did not shrink
+    CacheEntry *cached; // decompressed copy, or NULL
+} CompressedTile;
+
+struct MyPaintCompressedTiledSurface {
+    MyPaintTiledSurface parent;
+
+    CompressedTile *tiles; // Tiles in row-major order
+    CacheEntry *lru_first; // most recently used
+    CacheEntry *lru_last; // least recently used
+    int cached_n;
+    int cache_max;
+    MyPaintCompressedTiledSurfaceStats stats;
+    uint16_t *blank_tile; // Content of tiles that were never written
+    int tiles_width; // width in tiles
+    int tiles_height; // height in tiles
+    int width; // width in pixels
+    int height; // height in pixels
+};
+
+void free_compressed_tiledsurf(MyPaintSurface *surface);
+
+/* Codec
+ *
+ * Each of the four channel planes is delta coded against the previous
+ * pixel (in row-major order), and the deltas are run-length encoded.
+ * A header word with the high bit set is followed by one delta that
+ * repeats (header & 0x7fff) + 1 times; otherwise header + 1 literal
+ * deltas follow. Flat areas and smooth gradients compress to a few words.
+ */
+
+static inline uint16_t
+delta_at(const uint16_t *plane, int i)
+{
+    const uint16_t prev = i > 0 ? plane[(i - 1) * 4] : 0;
+    return (uint16_t)(plane[i * 4] - prev);
+}
+
+// Returns the number of words written to out
+static int
+encode_tile(const uint16_t *tile, uint16_t *out)
+{
+    int words = 0;
+    for (int c = 0; c < 4; c++) {
+        const uint16_t *plane = tile + c;
+        int i = 0;
+        while (i < TILE_PIXELS) {
+            const uint16_t d = delta_at(plane, i);
+            int run = 1;
+            while (i + run < TILE_PIXELS && run < MAX_RUN && delta_at(plane, i + run) == d) {
+                run++;
+            }
+            if (run >= MIN_RUN) {
+                out[words++] = 0x8000 | (run - 1);
+                out[words++] = d;
+                i += run;
+                continue;
+            }
+            // Literals up to the start of the next run
+            const int header = words++;
+            int literals = 0;
+            while (i < TILE_PIXELS && literals < MAX_RUN) {
+                if (i + MIN_RUN <= TILE_PIXELS &&
+                    delta_at(plane, i + 1) == delta_at(plane, i) &&
+                    delta_at(plane, i + 2) == delta_at(plane, i)) {
+                    break;
+                }
+                out[words++] = delta_at(plane, i);
+                literals++;
+                i++;
+            }
+            out[header] = literals - 1;
+        }
+    }
+    return words;
+}
+
+static void
+decode_tile(const uint16_t *in, uint16_t *tile)
+{
+    for (int c = 0; c < 4; c++) {
+        uint16_t *plane = tile + c;
+        uint16_t value = 0;
+        int i = 0;
+        while (i < TILE_PIXELS) {
+            const uint16_t header = *in++;
+            const int count = (header & 0x7fff) + 1;
+            if (header & 0x8000) {
+                const uint16_t d = *in++;
+                for (int k = 0; k < count; k++, i++) {
+                    value += d;
+                    plane[i * 4] = value;
+                }
+            } else {
+                for (int k = 0; k < count; k++, i++) {
+                    value += *in++;
+                    plane[i * 4] = value;
+                }
+            }
+        }
+    }
+}
+
+/* Cache
+ *
+ * All functions below must be called with the tile table locked.
+ */
+
+static void
+lru_unlink(MyPaintCompressedTiledSurface *self, CacheEntry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        self->lru_first = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        self->lru_last = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+}
+
+static void
+lru_push_front(MyPaintCompressedTiledSurface *self, CacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = self->lru_first;
+    if (self->lru_first) {
+        self->lru_first->prev = entry;
+    } else {
+        self->lru_last = entry;
+    }
+    self->lru_first = entry;
+}
+
+// Stores the content of a dirty entry in its tile. Returns FALSE if out of memory.
+static gboolean
+compress_entry(MyPaintCompressedTiledSurface *self, CacheEntry *entry)
+{
+    CompressedTile *tile = &self->tiles[entry->tile_index];
+    uint16_t scratch[MAX_ENCODED_WORDS];
+    int words = encode_tile(entry->buffer, scratch);
+    const gboolean raw = words >= TILE_WORDS;
+    if (raw) {
+        words = TILE_WORDS;
+    }
+    uint16_t *data = (uint16_t *)malloc(words * sizeof(uint16_t));
+    if (!data) {
+        return FALSE;
+    }
+    memcpy(data, raw ? entry->buffer : scratch, words * sizeof(uint16_t));
+
+    if (tile->data) {
+        self->stats.compressed_bytes -= tile->words * sizeof(uint16_t);
+    } else {
+        self->stats.tiles_stored++;
+    }
+    self->stats.compressed_bytes += words * sizeof(uint16_t);
+    free(tile->data);
+    tile->data = data;
+    tile->words = words;
+    tile->raw = raw;
+    entry->dirty = FALSE;
+    return TRUE;
+}
+
+// Drops least recently used entries that are not in use, until the cache fits
+static void
+cache_trim(MyPaintCompressedTiledSurface *self)
+{
+    CacheEntry *entry = self->lru_last;
+    while (entry && self->cached_n > self->cache_max) {
+        CacheEntry *prev = entry->prev;
+        if (entry->requests == 0 && (!entry->dirty || compress_entry(self, entry))) {
+            lru_unlink(self, entry);
+            self->tiles[entry->tile_index].cached = NULL;
+            self->cached_n--;
+            free(entry);
+        }
+        entry = prev;
+    }
+}
+
+// Returns the decompressed tile, pinned, or NULL if out of memory
+static CacheEntry *
+cache_get(MyPaintCompressedTiledSurface *self, int tile_index)
+{
+    CompressedTile *tile = &self->tiles[tile_index];
+    CacheEntry *entry = tile->cached;
+    if (entry) {
+        self->stats.cache_hits++;
+        lru_unlink(self, entry);
+    } else {
+        self->stats.cache_misses++;
+        entry = (CacheEntry *)malloc(sizeof(CacheEntry));
+        if (!entry) {
+            return NULL;
+        }
+        if (!tile->data) {
+            memset(entry->buffer, 0, sizeof(entry->buffer));
+        } else if (tile->raw) {
+            memcpy(entry->buffer, tile->data, sizeof(entry->buffer));
+        } else {
+            decode_tile(tile->data, entry->buffer);
+        }
+        entry->tile_index = tile_index;
+        entry->requests = 0;
+        entry->dirty = FALSE;
+        tile->cached = entry;
+        self->cached_n++;
+    }
+    lru_push_front(self, entry);
+    entry->requests++;
+    return entry;
+}
+
+static gboolean
+is_out_of_bounds(MyPaintCompressedTiledSurface *self, const MyPaintTileRequest *request)
+{
+    return request->tx >= self->tiles_width || request->ty >= self->tiles_height ||
+           request->tx < 0 || request->ty < 0;
+}
+
+// Must be called with the tile table locked
+static void
+start_request(MyPaintCompressedTiledSurface *self, MyPaintTileRequest *request)
+{
+    request->context = NULL;
+
+    if (is_out_of_bounds(self, request)) {
+        // Give it an empty tile which we will ignore writes to
+        request->context = calloc(1, TILE_WORDS * sizeof(uint16_t));
+        request->buffer = (uint16_t *)request->context;
+        return;
+    }
+
+    const int tile_index = request->ty * self->tiles_width + request->tx;
+    CompressedTile *tile = &self->tiles[tile_index];
+    CacheEntry *entry = NULL;
+    // Reading a tile that was never written needs no cache entry
+    if (!request->readonly || tile->data || tile->cached) {
+        entry = cache_get(self, tile_index);
+        if (entry && !request->readonly) {
+            entry->dirty = TRUE;
+        }
+    }
+    if (!entry) {
+        request->buffer = request->readonly ? self->blank_tile : NULL;
+        return;
+    }
+    request->context = entry;
+    request->buffer = entry->buffer;
+}
+
+// Must be called with the tile table locked
+static void
+end_request(MyPaintCompressedTiledSurface *self, MyPaintTileRequest *request)
+{
+    if (is_out_of_bounds(self, request)) {
+        // Drop any changes done to an out of bounds tile
+        free(request->context);
+        return;
+    }
+    CacheEntry *entry = (CacheEntry *)request->context;
+    if (entry) {
+        entry->requests--;
+    }
+}
+
+static void
+tile_request_start(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *request)
+{
+    MyPaintCompressedTiledSurface *self = (MyPaintCompressedTiledSurface *)tiled_surface;
+
+    #pragma omp critical (compressed_surface_tiles)
+    start_request(self, request);
+}
+
+static void
+tile_request_end(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *request)
+{
+    MyPaintCompressedTiledSurface *self = (MyPaintCompressedTiledSurface *)tiled_surface;
+
+    #pragma omp critical (compressed_surface_tiles)
+    {
+        end_request(self, request);
+        cache_trim(self);
+    }
+}
+
+// The tiles changed in a transaction are requested together, taking the lock once
+static void
+tile_requests_start(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *requests, int requests_n)
+{
+    MyPaintCompressedTiledSurface *self = (MyPaintCompressedTiledSurface *)tiled_surface;
+
+    #pragma omp critical (compressed_surface_tiles)
+    for (int i = 0; i < requests_n; i++) {
+        start_request(self, &requests[i]);
+    }
+}
+
+static void
+tile_requests_end(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *requests, int requests_n)
+{
+    MyPaintCompressedTiledSurface *self = (MyPaintCompressedTiledSurface *)tiled_surface;
+
+    #pragma omp critical (compressed_surface_tiles)
+    {
+        for (int i = 0; i < requests_n; i++) {
+            end_request(self, &requests[i]);
+        }
+        cache_trim(self);
+    }
+}
+
+MyPaintSurface *
+mypaint_compressed_tiled_surface_interface(MyPaintCompressedTiledSurface *self)
+{
+    return (MyPaintSurface *)self;
+}
+
+int
+mypaint_compressed_tiled_surface_get_width(MyPaintCompressedTiledSurface *self)
+{
+    return self->width;
+}
+
+int
+mypaint_compressed_tiled_surface_get_height(MyPaintCompressedTiledSurface *self)
+{
+    return self->height;
+}
+
+/**
+ * mypaint_compressed_tiled_surface_get_stats:
+ * @stats: (out): Location to store the statistics in
+ *
+ * Get the cache hit rate and compression ratio of the surface.
+ * Only tiles that have been evicted from the cache at least once
+ * count as stored.
+ */
+void
+mypaint_compressed_tiled_surface_get_stats(MyPaintCompressedTiledSurface *self,
+                                           MyPaintCompressedTiledSurfaceStats *stats)
+{
+    #pragma omp critical (compressed_surface_tiles)
+    {
+        *stats = self->stats;
+        stats->tiles_cached = self->cached_n;
+    }
+}
+
+/**
+ * mypaint_compressed_tiled_surface_new:
+ * @width: Width of the surface, in pixels
+ * @height: Height of the surface, in pixels
+ * @cache_tiles: Number of decompressed tiles to keep
+ *
+ * Create a fixed size surface that keeps its tiles compressed in memory.
+ * Tile requests are served from a cache of the @cache_tiles most recently
+ * used tiles; the least recently used ones are compressed and evicted
+ * as requests end. Tiles that were never written are transparent, and
+ * take up no memory.
+ *
+ * Returns: the new surface, or NULL if out of memory
+ */
+MyPaintCompressedTiledSurface *
+mypaint_compressed_tiled_surface_new(int width, int height, int cache_tiles)
+{
+    assert(width > 0);
+    assert(height > 0);
+    assert(cache_tiles > 0);
+
+    MyPaintCompressedTiledSurface *self =
+        (MyPaintCompressedTiledSurface *)malloc(sizeof(MyPaintCompressedTiledSurface));
+    if (!self) {
+        return NULL;
+    }
+
+    mypaint_tiled_surface_init(&self->parent, tile_request_start, tile_request_end);
+
+    // MyPaintSurface vfuncs
+    self->parent.parent.destroy = free_compressed_tiledsurf;
+
+    // MyPaintTiledSurface vfuncs
+    self->parent.tile_requests_start = tile_requests_start;
+    self->parent.tile_requests_end = tile_requests_end;
+
+    const int tiles_width = (width + MYPAINT_TILE_SIZE - 1) / MYPAINT_TILE_SIZE;
+    const int tiles_height = (height + MYPAINT_TILE_SIZE - 1) / MYPAINT_TILE_SIZE;
+
+    self->tiles = (CompressedTile *)calloc((size_t)tiles_width * tiles_height, sizeof(CompressedTile));
+    self->blank_tile = (uint16_t *)calloc(TILE_WORDS, sizeof(uint16_t));
+    if (!self->tiles || !self->blank_tile) {
+        fprintf(stderr, "CRITICAL: unable to allocate enough memory for %d tiles\n", tiles_width * tiles_height);
+        free(self->tiles);
+        free(self->blank_tile);
+        mypaint_tiled_surface_destroy(&self->parent);
+        free(self);
+        return NULL;
+    }
+
+    self->lru_first = NULL;
+    self->lru_last = NULL;
+    self->cached_n = 0;
+    self->cache_max = cache_tiles;
+    memset(&self->stats, 0, sizeof(self->stats));
+    self->tiles_width = tiles_width;
+    self->tiles_height = tiles_height;
+    self->width = width;
+    self->height = height;
+
+    // Requests only share the tile table and the cache, which are locked
+    self->parent.threadsafe_tile_requests = TRUE;
+
+    return self;
+}
+
+void free_compressed_tiledsurf(MyPaintSurface *surface)
+{
+    MyPaintCompressedTiledSurface *self = (MyPaintCompressedTiledSurface *)surface;
+
+    mypaint_tiled_surface_destroy(&self->parent);
+
+    CacheEntry *entry = self->lru_first;
+    while (entry) {
+        CacheEntry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+    for (int i = 0; i < self->tiles_width * self->tiles_height; i++) {
+        free(self->tiles[i].data);
+    }
+    free(self->tiles);
+    free(self->blank_tile);
+
+    free(self);
+}
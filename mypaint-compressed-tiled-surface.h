@@ -0,0 +1,59 @@
+#ifndef MYPAINTCOMPRESSEDTILEDSURFACE_H
+#define MYPAINTCOMPRESSEDTILEDSURFACE_H
+
+#include <stddef.h>
+
+#include "mypaint-config.h"
+#include "mypaint-glib-compat.h"
+#include "mypaint-tiled-surface.h"
+
+G_BEGIN_DECLS
+
+/**
+ * MyPaintCompressedTiledSurface:
+ *
+ * #MyPaintTiledSurface subclass that implements a fixed sized #MyPaintSurface
+ * which keeps its tiles compressed in memory, for documents with many tiles
+ * that are rarely touched. Recently used tiles are kept decompressed.
+ */
+typedef struct MyPaintCompressedTiledSurface MyPaintCompressedTiledSurface;
+
+/**
+ * MyPaintCompressedTiledSurfaceStats:
+ * @tiles_stored: Number of tiles with compressed content
+ * @tiles_cached: Number of decompressed tiles in the cache
+ * @compressed_bytes: Memory used by the compressed content of the stored tiles
+ * @cache_hits: Tile requests served from the cache
+ * @cache_misses: Tile requests that had to decompress a tile
+ *
+ * Statistics of a #MyPaintCompressedTiledSurface. Each stored tile
+ * decompresses to MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 8 bytes.
+ */
+typedef struct {
+    int tiles_stored;
+    int tiles_cached;
+    size_t compressed_bytes;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+} MyPaintCompressedTiledSurfaceStats;
+
+MyPaintCompressedTiledSurface *
+mypaint_compressed_tiled_surface_new(int width, int height, int cache_tiles);
+
+int
+mypaint_compressed_tiled_surface_get_width(MyPaintCompressedTiledSurface *self);
+
+int
+mypaint_compressed_tiled_surface_get_height(MyPaintCompressedTiledSurface *self);
+
+void
+mypaint_compressed_tiled_surface_get_stats(MyPaintCompressedTiledSurface *self,
+                                           MyPaintCompressedTiledSurfaceStats *stats);
+
+
+MyPaintSurface *
+mypaint_compressed_tiled_surface_interface(MyPaintCompressedTiledSurface *self);
+
+G_END_DECLS
+
+#endif // MYPAINTCOMPRESSEDTILEDSURFACE_H
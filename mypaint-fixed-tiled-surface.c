@@ -13,12 +13,31 @@
 #include "mypaint-fixed-tiled-surface.h"
 
 
+// Uniform tile shared by all tiles with the same content
+typedef struct {
+    uint64_t pixel; // the RGBA value of every pixel
+    uint16_t *buffer;
+    int refs;
+} UniformTile;
+
+// A tile that has never been written to uses the blank tile. Otherwise
+// it either owns its buffer, or refers to a shared uniform tile that is
+// copied on the next write.
+typedef struct {
+    uint16_t *buffer;
+    UniformTile *uniform;
+} FixedTile;
+
 struct MyPaintFixedTiledSurface {
     MyPaintTiledSurface parent;
 
     size_t tile_size; // Size (in bytes) of single tile
-    uint16_t *tile_buffer; // Stores tiles in a linear chunk of memory (16bpc RGBA)
-    uint16_t *null_tile; // Single tile that we hand out and ignore writes to
+    FixedTile *tiles; // Tiles in row-major order, allocated on first write
+    uint16_t *blank_tile; // Initial content of every tile
+    UniformTile **uniform_tiles;
+    int uniform_tiles_n;
+    int uniform_tiles_max;
+    int private_tiles_n;
     int tiles_width; // width in tiles
     int tiles_height; // height in tiles
     int width; // width in pixels
@@ -26,11 +45,80 @@ struct MyPaintFixedTiledSurface {
 
 };
 
+// Value of every channel of a new surface
+#define BLANK_CHANNEL 0xffff
+#define BLANK_PIXEL 0xffffffffffffffffULL
+
 void free_simple_tiledsurf(MyPaintSurface *surface);
 
-void reset_null_tile(MyPaintFixedTiledSurface *self)
+static gboolean
+is_uniform(const uint16_t *buffer, size_t tile_size, uint64_t *pixel_out)
+{
+    const size_t pixels_n = tile_size / sizeof(uint64_t);
+    uint64_t first;
+    memcpy(&first, buffer, sizeof(first));
+    for (size_t i = 1; i < pixels_n; i++) {
+        uint64_t pixel;
+        memcpy(&pixel, buffer + 4 * i, sizeof(pixel));
+        if (pixel != first) {
+            return FALSE;
+        }
+    }
+    *pixel_out = first;
+    return TRUE;
+}
+
+// Must be called with the tile table locked
+static void
+uniform_tile_unref(MyPaintFixedTiledSurface *self, UniformTile *uniform)
+{
+    uniform->refs--;
+    if (uniform->refs == 0) {
+        for (int i = 0; i < self->uniform_tiles_n; i++) {
+            if (self->uniform_tiles[i] == uniform) {
+                self->uniform_tiles[i] = self->uniform_tiles[--self->uniform_tiles_n];
+                break;
+            }
+        }
+        free(uniform->buffer);
+        free(uniform);
+    }
+}
+
+// Returns a reference to the shared tile with the content of the given
+// tile buffer, or NULL if out of memory. Must be called with the tile
+// table locked.
+static UniformTile *
+uniform_tile_ref(MyPaintFixedTiledSurface *self, uint64_t pixel, const uint16_t *content)
 {
-    memset(self->null_tile, 0, self->tile_size);
+    for (int i = 0; i < self->uniform_tiles_n; i++) {
+        if (self->uniform_tiles[i]->pixel == pixel) {
+            self->uniform_tiles[i]->refs++;
+            return self->uniform_tiles[i];
+        }
+    }
+    if (self->uniform_tiles_n == self->uniform_tiles_max) {
+        const int max = self->uniform_tiles_max ? self->uniform_tiles_max * 2 : 8;
+        UniformTile **tiles = (UniformTile **)realloc(self->uniform_tiles, max * sizeof(UniformTile *));
+        if (!tiles) {
+            return NULL;
+        }
+        self->uniform_tiles = tiles;
+        self->uniform_tiles_max = max;
+    }
+    UniformTile *uniform = (UniformTile *)malloc(sizeof(UniformTile));
+    uint16_t *buffer = (uint16_t *)malloc(self->tile_size);
+    if (!uniform || !buffer) {
+        free(uniform);
+        free(buffer);
+        return NULL;
+    }
+    memcpy(buffer, content, self->tile_size);
+    uniform->pixel = pixel;
+    uniform->buffer = buffer;
+    uniform->refs = 1;
+    self->uniform_tiles[self->uniform_tiles_n++] = uniform;
+    return uniform;
 }
 
 static void
@@ -44,16 +132,36 @@ tile_request_start(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *reque
     uint16_t *tile_pointer = NULL;
 
     if (tx >= self->tiles_width || ty >= self->tiles_height || tx < 0 || ty < 0) {
-        // Give it a tile which we will ignore writes to
-        tile_pointer = self->null_tile;
+        // Give it an empty tile which we will ignore writes to. Each request
+        // gets its own, so that requests can be made from several threads.
+        tile_pointer = (uint16_t *)calloc(1, self->tile_size);
+        if (!tile_pointer) {
+            fprintf(stderr, "CRITICAL: unable to allocate a tile outside of the surface\n");
+        }
+        request->context = tile_pointer;
 
     } else {
-        // Compute the offset for the tile into our linear memory buffer of tiles
-        size_t rowstride = self->tiles_width * self->tile_size;
-        size_t x_offset = tx * self->tile_size;
-        size_t tile_offset = (rowstride * ty) + x_offset;
-
-        tile_pointer = self->tile_buffer + tile_offset/sizeof(uint16_t);
+        FixedTile *tile = &self->tiles[ty * self->tiles_width + tx];
+        if (tile->buffer && !tile->uniform) {
+            tile_pointer = tile->buffer;
+        } else if (request->readonly) {
+            tile_pointer = tile->buffer ? tile->buffer : self->blank_tile;
+        } else {
+            // Copy on write
+            tile_pointer = (uint16_t *)malloc(self->tile_size);
+            if (tile_pointer) {
+                memcpy(tile_pointer, tile->buffer ? tile->buffer : self->blank_tile, self->tile_size);
+                #pragma omp critical (fixed_surface_tiles)
+                {
+                    if (tile->uniform) {
+                        uniform_tile_unref(self, tile->uniform);
+                    }
+                    tile->uniform = NULL;
+                    tile->buffer = tile_pointer;
+                    self->private_tiles_n++;
+                }
+            }
+        }
     }
 
     request->buffer = tile_pointer;
@@ -68,10 +176,32 @@ tile_request_end(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *request
     const int ty = request->ty;
 
     if (tx >= self->tiles_width || ty >= self->tiles_height || tx < 0 || ty < 0) {
-        // Wipe any changes done to the null tile
-        reset_null_tile(self);
-    } else {
-        // We hand out direct pointers to our buffer, so for the normal case nothing needs to be done
+        // Drop any changes done to an out of bounds tile
+        free(request->context);
+        return;
+    }
+    if (request->readonly || !request->buffer) {
+        return;
+    }
+
+    // Share the tile if it ended up uniform, like after erasing it
+    uint64_t pixel;
+    FixedTile *tile = &self->tiles[ty * self->tiles_width + tx];
+    if (!is_uniform(tile->buffer, self->tile_size, &pixel)) {
+        return;
+    }
+    #pragma omp critical (fixed_surface_tiles)
+    {
+        UniformTile *uniform = NULL;
+        if (pixel != BLANK_PIXEL) {
+            uniform = uniform_tile_ref(self, pixel, tile->buffer);
+        }
+        if (uniform || pixel == BLANK_PIXEL) {
+            free(tile->buffer);
+            self->private_tiles_n--;
+            tile->uniform = uniform;
+            tile->buffer = uniform ? uniform->buffer : NULL;
+        }
     }
 }
 
@@ -93,6 +223,45 @@ mypaint_fixed_tiled_surface_get_height(MyPaintFixedTiledSurface *self)
     return self->height;
 }
 
+/**
+ * mypaint_fixed_tiled_surface_get_tile_counts:
+ * @private_tiles: (out) (allow-none): Location to return the number of tiles with their own buffer
+ * @uniform_tiles: (out) (allow-none): Location to return the number of distinct uniform tile buffers
+ *
+ * Tiles are allocated on their first write. Tiles that are uniform
+ * (every pixel the same) after a write share one buffer per color.
+ *
+ * Returns: the number of tile buffers in memory, including the blank tile.
+ */
+int
+mypaint_fixed_tiled_surface_get_tile_counts(MyPaintFixedTiledSurface *self, int *private_tiles, int *uniform_tiles)
+{
+    if (private_tiles) {
+        *private_tiles = self->private_tiles_n;
+    }
+    if (uniform_tiles) {
+        *uniform_tiles = self->uniform_tiles_n;
+    }
+    return self->private_tiles_n + self->uniform_tiles_n + 1;
+}
+
+/**
+ * mypaint_fixed_tiled_surface_set_threaded:
+ *
+ * Let the surface request tiles from several threads. Requests for different
+ * tiles only share the tile table, which is locked.
+ * Off by default, since colors are then sampled in an order that differs
+ * between runs. Turn on mypaint_tiled_surface_set_deterministic() as well
+ * to get the same output for the same input.
+ *
+ * Must not be called between begin_atomic and end_atomic.
+ */
+void
+mypaint_fixed_tiled_surface_set_threaded(MyPaintFixedTiledSurface *self, gboolean threaded)
+{
+    self->parent.threadsafe_tile_requests = threaded;
+}
+
 MyPaintFixedTiledSurface *
 mypaint_fixed_tiled_surface_new(int width, int height)
 {
@@ -111,30 +280,36 @@ mypaint_fixed_tiled_surface_new(int width, int height)
     const int tiles_width = ceil((float)width / tile_size_pixels);
     const int tiles_height = ceil((float)height / tile_size_pixels);
     const size_t tile_size = tile_size_pixels * tile_size_pixels * 4 * sizeof(uint16_t);
-    const size_t buffer_size = tiles_width * tiles_height * tile_size;
 
     assert(tile_size_pixels*tiles_width >= width);
     assert(tile_size_pixels*tiles_height >= height);
-    assert(buffer_size >= width*height*4*sizeof(uint16_t));
 
-    uint16_t * buffer = (uint16_t *)malloc(buffer_size);
-    if (!buffer) {
-        fprintf(stderr, "CRITICAL: unable to allocate enough memory: %zu bytes", buffer_size);
+    FixedTile *tiles = (FixedTile *)calloc((size_t)tiles_width * tiles_height, sizeof(FixedTile));
+    uint16_t *blank_tile = (uint16_t *)malloc(tile_size);
+    if (!tiles || !blank_tile) {
+        fprintf(stderr, "CRITICAL: unable to allocate enough memory for %d tiles", tiles_width * tiles_height);
+        free(tiles);
+        free(blank_tile);
+        mypaint_tiled_surface_destroy(&self->parent);
         free(self);
         return NULL;
     }
-    memset(buffer, 255, buffer_size);
+    for (size_t i = 0; i < tile_size / sizeof(uint16_t); i++) {
+        blank_tile[i] = BLANK_CHANNEL;
+    }
 
-    self->tile_buffer = buffer;
+    self->tiles = tiles;
+    self->blank_tile = blank_tile;
+    self->uniform_tiles = NULL;
+    self->uniform_tiles_n = 0;
+    self->uniform_tiles_max = 0;
+    self->private_tiles_n = 0;
     self->tile_size = tile_size;
-    self->null_tile = (uint16_t *)malloc(tile_size);
     self->tiles_width = tiles_width;
     self->tiles_height = tiles_height;
     self->height = height;
     self->width = width;
 
-    reset_null_tile(self);
-
     return self;
 }
 
@@ -144,9 +319,18 @@ void free_simple_tiledsurf(MyPaintSurface *surface)
 
     mypaint_tiled_surface_destroy(&self->parent);
 
-    free(self->tile_buffer);
-    free(self->null_tile);
+    for (int i = 0; i < self->tiles_width * self->tiles_height; i++) {
+        if (!self->tiles[i].uniform) {
+            free(self->tiles[i].buffer);
+        }
+    }
+    for (int i = 0; i < self->uniform_tiles_n; i++) {
+        free(self->uniform_tiles[i]->buffer);
+        free(self->uniform_tiles[i]);
+    }
+    free(self->uniform_tiles);
+    free(self->tiles);
+    free(self->blank_tile);
 
     free(self);
 }
-
@@ -11,6 +11,7 @@ G_BEGIN_DECLS
  * MyPaintFixedTiledSurface:
  *
  * Simple #MyPaintTiledSurface subclass that implements a fixed sized #MyPaintSurface.
+ * Tiles are only allocated once they are written to, and uniform tiles share memory.
  * Only intended for testing and trivial use-cases, and to serve as an example of
  * how to implement a tiled surface subclass.
  */
@@ -25,6 +26,11 @@ mypaint_fixed_tiled_surface_get_width(MyPaintFixedTiledSurface *self);
 int
 mypaint_fixed_tiled_surface_get_height(MyPaintFixedTiledSurface *self);
 
+int
+mypaint_fixed_tiled_surface_get_tile_counts(MyPaintFixedTiledSurface *self, int *private_tiles, int *uniform_tiles);
+
+void
+mypaint_fixed_tiled_surface_set_threaded(MyPaintFixedTiledSurface *self, gboolean threaded);
 
 MyPaintSurface *
 mypaint_fixed_tiled_surface_interface(MyPaintFixedTiledSurface *self);
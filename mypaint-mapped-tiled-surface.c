@@ -0,0 +1,307 @@
+/* libmypaint - The MyPaint Brush Library
+ * Copyright (C) 2019 The MyPaint Team
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "mypaint-mapped-tiled-surface.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Number of tiles the backing file grows by when it is full
+#define FILE_GROW_TILES 256
+
+struct MyPaintMappedTiledSurface {
+    MyPaintTiledSurface parent;
+
+    int fd; // Backing file, already unlinked
+    size_t tile_size; // Size (in bytes) of single tile
+    size_t page_size;
+    uint32_t *directory; // File slot of each tile plus one, 0 if never written
+    uint32_t slots_n; // Tiles stored in the file
+    uint32_t slots_max; // Tiles the file has room for
+    uint16_t *blank_tile; // Content of tiles that were never written
+    int tiles_width; // width in tiles
+    int tiles_height; // height in tiles
+    int width; // width in pixels
+    int height; // height in pixels
+};
+
+void free_mapped_tiledsurf(MyPaintSurface *surface);
+
+// Returns the new slot plus one, or 0 if the file could not grow.
+// Must be called with the directory locked.
+static uint32_t
+allocate_slot(MyPaintMappedTiledSurface *self)
+{
+    if (self->slots_n == self->slots_max) {
+        const uint32_t slots_max = self->slots_max + FILE_GROW_TILES;
+        // The grown part of the file is a hole, reading back as transparent
+        if (ftruncate(self->fd, (off_t)slots_max * self->tile_size) != 0) {
+            return 0;
+        }
+        self->slots_max = slots_max;
+    }
+    return ++self->slots_n;
+}
+
+static void
+tile_request_start(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *request)
+{
+    MyPaintMappedTiledSurface *self = (MyPaintMappedTiledSurface *)tiled_surface;
+
+    const int tx = request->tx;
+    const int ty = request->ty;
+
+    request->context = NULL;
+
+    if (tx >= self->tiles_width || ty >= self->tiles_height || tx < 0 || ty < 0) {
+        // Give it an empty tile which we will ignore writes to
+        request->context = calloc(1, self->tile_size);
+        request->buffer = (uint16_t *)request->context;
+        return;
+    }
+
+    uint32_t *entry = &self->directory[(size_t)ty * self->tiles_width + tx];
+    uint32_t slot;
+    #pragma omp critical (mapped_surface_directory)
+    {
+        slot = *entry;
+        if (!slot && !request->readonly) {
+            slot = allocate_slot(self);
+            *entry = slot;
+        }
+    }
+    if (!slot) {
+        // Never written, or the file could not grow
+        request->buffer = request->readonly ? self->blank_tile : NULL;
+        return;
+    }
+
+    // Mappings must start at a page boundary, which tiles need not be on
+    const off_t offset = (off_t)(slot - 1) * self->tile_size;
+    const off_t map_offset = offset - offset % self->page_size;
+    const size_t map_size = self->tile_size + (size_t)(offset - map_offset);
+    const int prot = request->readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *map = mmap(NULL, map_size, prot, MAP_SHARED, self->fd, map_offset);
+    if (map == MAP_FAILED) {
+        request->buffer = NULL;
+        return;
+    }
+    request->context = map;
+    request->buffer = (uint16_t *)((char *)map + (offset - map_offset));
+}
+
+static void
+tile_request_end(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *request)
+{
+    MyPaintMappedTiledSurface *self = (MyPaintMappedTiledSurface *)tiled_surface;
+
+    const int tx = request->tx;
+    const int ty = request->ty;
+
+    if (tx >= self->tiles_width || ty >= self->tiles_height || tx < 0 || ty < 0) {
+        // Drop any changes done to an out of bounds tile
+        free(request->context);
+        return;
+    }
+    if (request->context) {
+        const size_t map_size = (char *)request->buffer - (char *)request->context + self->tile_size;
+        munmap(request->context, map_size);
+    }
+}
+
+MyPaintSurface *
+mypaint_mapped_tiled_surface_interface(MyPaintMappedTiledSurface *self)
+{
+    return (MyPaintSurface *)self;
+}
+
+int
+mypaint_mapped_tiled_surface_get_width(MyPaintMappedTiledSurface *self)
+{
+    return self->width;
+}
+
+int
+mypaint_mapped_tiled_surface_get_height(MyPaintMappedTiledSurface *self)
+{
+    return self->height;
+}
+
+/**
+ * mypaint_mapped_tiled_surface_get_tiles_stored:
+ *
+ * Returns: the number of tiles that were written to, and so occupy
+ * space in the backing file.
+ */
+int
+mypaint_mapped_tiled_surface_get_tiles_stored(MyPaintMappedTiledSurface *self)
+{
+    int tiles_n;
+    #pragma omp critical (mapped_surface_directory)
+    tiles_n = self->slots_n;
+    return tiles_n;
+}
+
+static int
+create_backing_file(const char *directory)
+{
+    if (!directory) {
+        directory = getenv("TMPDIR");
+    }
+    if (!directory || !directory[0]) {
+        directory = "/tmp";
+    }
+    char *path = malloc(strlen(directory) + sizeof("/mypaint-tiles-XXXXXX"));
+    if (!path) {
+        return -1;
+    }
+    sprintf(path, "%s/mypaint-tiles-XXXXXX", directory);
+    const int fd = mkstemp(path);
+    if (fd >= 0) {
+        // The file only lives as long as the surface keeps it open
+        unlink(path);
+    }
+    free(path);
+    return fd;
+}
+
+/**
+ * mypaint_mapped_tiled_surface_new:
+ * @width: Width of the surface, in pixels
+ * @height: Height of the surface, in pixels
+ * @directory: (allow-none): Directory to create the backing file in,
+ * or NULL for $TMPDIR
+ *
+ * Create a fixed size surface whose tiles live in a memory-mapped file
+ * instead of in memory, so that its size is not limited by the available
+ * RAM. Tiles take up space in the file once they are first written to,
+ * tiles that were never written read back as transparent.
+ *
+ * The backing file is removed from the directory right away, and is freed
+ * along with the surface.
+ *
+ * Returns: the new surface, or NULL if the backing file could not be created
+ */
+MyPaintMappedTiledSurface *
+mypaint_mapped_tiled_surface_new(int width, int height, const char *directory)
+{
+    assert(width > 0);
+    assert(height > 0);
+
+    MyPaintMappedTiledSurface *self = (MyPaintMappedTiledSurface *)malloc(sizeof(MyPaintMappedTiledSurface));
+    if (!self) {
+        return NULL;
+    }
+
+    mypaint_tiled_surface_init(&self->parent, tile_request_start, tile_request_end);
+
+    const int tile_size_pixels = self->parent.tile_size;
+
+    // MyPaintSurface vfuncs
+    self->parent.parent.destroy = free_mapped_tiledsurf;
+
+    const int tiles_width = (width + tile_size_pixels - 1) / tile_size_pixels;
+    const int tiles_height = (height + tile_size_pixels - 1) / tile_size_pixels;
+    const size_t tile_size = tile_size_pixels * tile_size_pixels * 4 * sizeof(uint16_t);
+
+    self->fd = create_backing_file(directory);
+    self->directory = (uint32_t *)calloc((size_t)tiles_width * tiles_height, sizeof(uint32_t));
+    self->blank_tile = (uint16_t *)calloc(1, tile_size);
+    if (self->fd < 0 || !self->directory || !self->blank_tile) {
+        fprintf(stderr, "CRITICAL: unable to create a backing file for %d tiles\n", tiles_width * tiles_height);
+        if (self->fd >= 0) {
+            close(self->fd);
+        }
+        free(self->directory);
+        free(self->blank_tile);
+        mypaint_tiled_surface_destroy(&self->parent);
+        free(self);
+        return NULL;
+    }
+
+    self->tile_size = tile_size;
+    self->page_size = (size_t)sysconf(_SC_PAGESIZE);
+    self->slots_n = 0;
+    self->slots_max = 0;
+    self->tiles_width = tiles_width;
+    self->tiles_height = tiles_height;
+    self->width = width;
+    self->height = height;
+
+    // Every request maps its own view of the file
+    self->parent.threadsafe_tile_requests = TRUE;
+
+    return self;
+}
+
+void free_mapped_tiledsurf(MyPaintSurface *surface)
+{
+    MyPaintMappedTiledSurface *self = (MyPaintMappedTiledSurface *)surface;
+
+    mypaint_tiled_surface_destroy(&self->parent);
+
+    close(self->fd);
+    free(self->directory);
+    free(self->blank_tile);
+
+    free(self);
+}
+
+#else // HAVE_MMAP
+
+MyPaintMappedTiledSurface *
+mypaint_mapped_tiled_surface_new(int width, int height, const char *directory)
+{
+    fprintf(stderr, "CRITICAL: memory-mapped surfaces are not supported on this platform\n");
+    return NULL;
+}
+
+MyPaintSurface *
+mypaint_mapped_tiled_surface_interface(MyPaintMappedTiledSurface *self)
+{
+    return (MyPaintSurface *)self;
+}
+
+int
+mypaint_mapped_tiled_surface_get_width(MyPaintMappedTiledSurface *self)
+{
+    return 0;
+}
+
+int
+mypaint_mapped_tiled_surface_get_height(MyPaintMappedTiledSurface *self)
+{
+    return 0;
+}
+
+int
+mypaint_mapped_tiled_surface_get_tiles_stored(MyPaintMappedTiledSurface *self)
+{
+    return 0;
+}
+
+#endif // HAVE_MMAP
@@ -0,0 +1,39 @@
+#ifndef MYPAINTMAPPEDTILEDSURFACE_H
+#define MYPAINTMAPPEDTILEDSURFACE_H
+
+#include "mypaint-config.h"
+#include "mypaint-glib-compat.h"
+#include "mypaint-tiled-surface.h"
+
+G_BEGIN_DECLS
+
+/**
+ * MyPaintMappedTiledSurface:
+ *
+ * #MyPaintTiledSurface subclass that implements a fixed sized #MyPaintSurface
+ * backed by a memory-mapped file, for canvases larger than the available memory.
+ * Tiles are mapped from the file for the duration of a tile request, and only
+ * take up space in the file once they are written to.
+ * Only available on platforms with mmap().
+ */
+typedef struct MyPaintMappedTiledSurface MyPaintMappedTiledSurface;
+
+MyPaintMappedTiledSurface *
+mypaint_mapped_tiled_surface_new(int width, int height, const char *directory);
+
+int
+mypaint_mapped_tiled_surface_get_width(MyPaintMappedTiledSurface *self);
+
+int
+mypaint_mapped_tiled_surface_get_height(MyPaintMappedTiledSurface *self);
+
+int
+mypaint_mapped_tiled_surface_get_tiles_stored(MyPaintMappedTiledSurface *self);
+
+
+MyPaintSurface *
+mypaint_mapped_tiled_surface_interface(MyPaintMappedTiledSurface *self);
+
+G_END_DECLS
+
+#endif // MYPAINTMAPPEDTILEDSURFACE_H
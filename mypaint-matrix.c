@@ -90,3 +90,14 @@ mypaint_transform_point(const MyPaintTransform* const t, float x, float y, float
     *xout = t->rows[0][0] * x + t->rows[0][1] * y + t->rows[0][2];
     *yout = t->rows[1][0] * x + t->rows[1][1] * y + t->rows[1][2];
 }
+
+/* Apply each of n transforms to the same point, writing n results. Used for
+ * the copies of a symmetric dab; the results equal mypaint_transform_point(). */
+void
+mypaint_transform_points(const MyPaintTransform* const t, int n, float x, float y, float* xout, float* yout)
+{
+    for (int i = 0; i < n; i++) {
+        xout[i] = t[i].rows[0][0] * x + t[i].rows[0][1] * y + t[i].rows[0][2];
+        yout[i] = t[i].rows[1][0] * x + t[i].rows[1][1] * y + t[i].rows[1][2];
+    }
+}
@@ -28,5 +28,6 @@ MyPaintTransform mypaint_transform_reflect(const MyPaintTransform transform, con
 MyPaintTransform mypaint_transform_translate(const MyPaintTransform transform, const float x, const float y);
 
 void mypaint_transform_point(const MyPaintTransform* const t, float x, float y, float* x_out, float* y_out);
+void mypaint_transform_points(const MyPaintTransform* const t, int n, float x, float y, float* x_out, float* y_out);
 
 #endif
@@ -18,6 +18,7 @@
 #include "config.h"
 
 #include <assert.h>
+#include <stddef.h>
 
 #include "mypaint-surface.h"
 
@@ -61,13 +62,16 @@ mypaint_surface_get_color(MyPaintSurface *self,
 /**
  * mypaint_surface_init: (skip)
  *
- * Initialize the surface. The reference count will be set to 1.
+ * Initialize the surface. The reference count will be set to 1, and the
+ * optional vfuncs (currently get_alpha) are unset. Subclasses set the vfuncs
+ * they implement after calling this.
  * Note: Only intended to be called from subclasses of #MyPaintSurface
  **/
 void
 mypaint_surface_init(MyPaintSurface *self)
 {
     self->refcount = 1;
+    self->get_alpha = NULL;
 }
 
 /**
@@ -96,8 +100,18 @@ mypaint_surface_unref(MyPaintSurface *self)
     }
 }
 
+/**
+ * mypaint_surface_get_alpha:
+ *
+ * Get the mask-weighted average alpha of the area under a dab.
+ * Uses the #MyPaintSurface::get_alpha vfunc if the surface implements it,
+ * else falls back to mypaint_surface_get_color().
+ */
 float mypaint_surface_get_alpha (MyPaintSurface *self, float x, float y, float radius)
 {
+    if (self->get_alpha) {
+        return self->get_alpha(self, x, y, radius);
+    }
     float color_r, color_g, color_b, color_a;
     mypaint_surface_get_color (self, x, y, radius, &color_r, &color_g, &color_b, &color_a, 1.0);
     return color_a;
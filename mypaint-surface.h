@@ -32,6 +32,8 @@ typedef void (*MyPaintSurfaceGetColorFunction) (MyPaintSurface *self,
                                                 float paint
                                                 );
 
+typedef float (*MyPaintSurfaceGetAlphaFunction) (MyPaintSurface *self, float x, float y, float radius);
+
 typedef int (*MyPaintSurfaceDrawDabFunction) (MyPaintSurface *self,
                        float x, float y,
                        float radius,
@@ -58,6 +60,11 @@ typedef void (*MyPaintSurfaceEndAtomicFunction) (MyPaintSurface *self, MyPaintRe
   *
   * Abstract surface type for the MyPaint brush engine. The surface interface
   * lets the brush engine specify dabs to render, and to pick color.
+  *
+  * get_alpha was appended in libmypaint 2.0, which changes the size of the
+  * struct: surfaces built against older headers must be rebuilt. Surfaces must
+  * be set up with mypaint_surface_init(), which leaves get_alpha unset, so
+  * that mypaint_surface_get_alpha() falls back to get_color.
   */
 struct MyPaintSurface {
     MyPaintSurfaceDrawDabFunction draw_dab;
@@ -67,6 +74,7 @@ struct MyPaintSurface {
     MyPaintSurfaceDestroyFunction destroy;
     MyPaintSurfaceSavePngFunction save_png;
     int refcount;
+    MyPaintSurfaceGetAlphaFunction get_alpha;
 };
 
 /**
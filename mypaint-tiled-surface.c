@@ -32,8 +32,150 @@
 #include "helpers.h"
 #include "brushmodes.h"
 #include "operationqueue.h"
+#include "spectralcache.h"
+#include "tracing.h"
 
 void process_tile(MyPaintTiledSurface *self, int tx, int ty);
+static void process_tile_group(MyPaintTiledSurface *self, int n, uint16_t **rgba, const TileIndex *tiles);
+static void process_tiles(MyPaintTiledSurface *self, int n, const TileIndex *tiles);
+
+// Add counters collected by one thread to the totals of the surface
+static void
+stats_merge(MyPaintTiledSurfaceStats *total, const MyPaintTiledSurfaceStats *part)
+{
+    const uint64_t *src = (const uint64_t *)part;
+    uint64_t *dst = (uint64_t *)total;
+    for (size_t i = 0; i < sizeof(MyPaintTiledSurfaceStats) / sizeof(uint64_t); i++) {
+        if (src[i]) {
+            #pragma omp atomic
+            dst[i] += src[i];
+        }
+    }
+}
+
+// Largest number of tiles that are reflections of each other, see symmetry_mirror()
+#define TILE_GROUP_MAX 4
+
+// Tiles acquired at once through tile_requests_start, which the backend keeps
+// in memory until tile_requests_end. Mirror groups may add a few more.
+#define TILE_REQUESTS_BATCH 64
+
+// The reflections that the symmetry copies of dabs are drawn with, as
+// DabMirror flags, if enabled by mypaint_tiled_surface_set_mirrored_symmetry().
+// Only reflections across axes that map whole tiles onto tiles are used: axes
+// along tile boundaries or through the middle of tiles.
+// Sets the sums of mirrored tile columns and rows, see OperationDataDrawDab.
+static int
+symmetry_mirror(const MyPaintTiledSurface *self, int *mirror_tiles_x, int *mirror_tiles_y)
+{
+    const MyPaintSymmetryData *data = &self->symmetry_data;
+    const MyPaintSymmetryState symm = data->state_current;
+    if (!self->mirrored_symmetry || !data->active || !data->num_symmetry_matrices || symm.angle != 0) {
+        return DAB_MIRROR_NONE;
+    }
+
+    const float half_tile = MYPAINT_TILE_SIZE / 2;
+    const gboolean aligned_x = fmodf(symm.center_x, half_tile) == 0;
+    const gboolean aligned_y = fmodf(symm.center_y, half_tile) == 0;
+    *mirror_tiles_x = symm.center_x / half_tile;
+    *mirror_tiles_y = symm.center_y / half_tile;
+
+    switch (symm.type) {
+    case MYPAINT_SYMMETRY_TYPE_VERTICAL:
+        return aligned_x ? DAB_MIRROR_X : DAB_MIRROR_NONE;
+    case MYPAINT_SYMMETRY_TYPE_HORIZONTAL:
+        return aligned_y ? DAB_MIRROR_Y : DAB_MIRROR_NONE;
+    case MYPAINT_SYMMETRY_TYPE_VERTHORZ:
+        return aligned_x && aligned_y ? DAB_MIRROR_X | DAB_MIRROR_Y : DAB_MIRROR_NONE;
+    default:
+        return DAB_MIRROR_NONE;
+    }
+}
+
+// The first of the tiles that are reflections of the tile
+static TileIndex
+mirror_group_first(TileIndex tile, int mirror, int mirror_tiles_x, int mirror_tiles_y)
+{
+    if (mirror & DAB_MIRROR_X) {
+        tile.x = MIN(tile.x, mirror_tiles_x - 1 - tile.x);
+    }
+    if (mirror & DAB_MIRROR_Y) {
+        tile.y = MIN(tile.y, mirror_tiles_y - 1 - tile.y);
+    }
+    return tile;
+}
+
+typedef struct {
+    TileIndex first;
+    TileIndex tile;
+} MirrorGroupEntry;
+
+static int
+compare_mirror_group_entry(const void *a, const void *b)
+{
+    const MirrorGroupEntry *ea = (const MirrorGroupEntry *)a;
+    const MirrorGroupEntry *eb = (const MirrorGroupEntry *)b;
+    if (ea->first.y != eb->first.y) return ea->first.y < eb->first.y ? -1 : 1;
+    if (ea->first.x != eb->first.x) return ea->first.x < eb->first.x ? -1 : 1;
+    if (ea->tile.y != eb->tile.y) return ea->tile.y < eb->tile.y ? -1 : 1;
+    if (ea->tile.x != eb->tile.x) return ea->tile.x < eb->tile.x ? -1 : 1;
+    return 0;
+}
+
+// Reorders the tiles so that the ones that are reflections of each other
+// with the current symmetry are next to each other
+static void
+sort_mirror_groups(const MyPaintTiledSurface *self, TileIndex *tiles, int tiles_n)
+{
+    int mirror_tiles_x, mirror_tiles_y;
+    const int mirror = symmetry_mirror(self, &mirror_tiles_x, &mirror_tiles_y);
+    if (!mirror || tiles_n < 2) {
+        return;
+    }
+    MirrorGroupEntry *entries = (MirrorGroupEntry *)malloc(tiles_n * sizeof(MirrorGroupEntry));
+    if (!entries) {
+        // Still correct, only without groups
+        return;
+    }
+    for (int i = 0; i < tiles_n; i++) {
+        entries[i].first = mirror_group_first(tiles[i], mirror, mirror_tiles_x, mirror_tiles_y);
+        entries[i].tile = tiles[i];
+    }
+    qsort(entries, tiles_n, sizeof(MirrorGroupEntry), compare_mirror_group_entry);
+    for (int i = 0; i < tiles_n; i++) {
+        tiles[i] = entries[i].tile;
+    }
+    free(entries);
+}
+
+// The number of tiles in the group of reflected tiles starting at tiles[i],
+// or 0 if tiles[i] is not the first of its group. See sort_mirror_groups()
+static int
+mirror_group_size(const MyPaintTiledSurface *self, const TileIndex *tiles, int tiles_n, int i)
+{
+    int mirror_tiles_x, mirror_tiles_y;
+    const int mirror = symmetry_mirror(self, &mirror_tiles_x, &mirror_tiles_y);
+    if (!mirror) {
+        return 1;
+    }
+    const TileIndex first = mirror_group_first(tiles[i], mirror, mirror_tiles_x, mirror_tiles_y);
+    if (i > 0) {
+        const TileIndex previous = mirror_group_first(tiles[i - 1], mirror, mirror_tiles_x, mirror_tiles_y);
+        if (previous.x == first.x && previous.y == first.y) {
+            return 0;
+        }
+    }
+    int n = 1;
+    while (i + n < tiles_n && n < TILE_GROUP_MAX) {
+        const TileIndex next = mirror_group_first(tiles[i + n], mirror, mirror_tiles_x, mirror_tiles_y);
+        if (next.x != first.x || next.y != first.y) {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
 
 static void
 begin_atomic_default(MyPaintSurface *surface)
@@ -112,10 +254,71 @@ mypaint_tiled_surface_end_atomic(MyPaintTiledSurface *self, MyPaintRectangles *r
     // Process tiles
     TileIndex *tiles;
     int tiles_n = operation_queue_get_dirty_tiles(self->operation_queue, &tiles);
+    // Mirrored tiles are processed together, see process_tile_group()
+    sort_mirror_groups(self, tiles, tiles_n);
+    TRACE_BEGIN(span);
+    TRACE_ARG(span, 0, tiles_n);
+
+    MyPaintTileRequest *requests = NULL;
+    if (self->tile_requests_start && self->tile_requests_end && tiles_n > 0) {
+        requests = (MyPaintTileRequest *)malloc(MIN(tiles_n, TILE_REQUESTS_BATCH + TILE_GROUP_MAX) *
+                                                sizeof(MyPaintTileRequest));
+    }
 
-    #pragma omp parallel for schedule(static) if(self->threadsafe_tile_requests && tiles_n > 3)
-    for (int i = 0; i < tiles_n; i++) {
-        process_tile(self, tiles[i].x, tiles[i].y);
+    if (requests) {
+        // Acquire the tiles a batch at a time, so that the tiles of a batch can
+        // be processed in parallel without calling into the backend
+        for (int batch_start = 0; batch_start < tiles_n; ) {
+            int batch_n = MIN(tiles_n - batch_start, TILE_REQUESTS_BATCH);
+            // Mirror groups are not split between batches
+            while (batch_start + batch_n < tiles_n &&
+                   mirror_group_size(self, tiles, tiles_n, batch_start + batch_n) == 0) {
+                batch_n++;
+            }
+            TileIndex *batch = &tiles[batch_start];
+
+            for (int i = 0; i < batch_n; i++) {
+                mypaint_tile_request_init(&requests[i], 0, batch[i].x, batch[i].y, FALSE);
+            }
+            const uint64_t start = self->stats ? monotonic_time_ns() : 0;
+            self->tile_requests_start(self, requests, batch_n);
+            if (self->stats) {
+                self->stats->tile_requests += batch_n;
+                self->stats->tile_io_ns += monotonic_time_ns() - start;
+            }
+
+            #pragma omp parallel for schedule(static) if(self->threadsafe_tile_requests && batch_n > 3)
+            for (int i = 0; i < batch_n; i++) {
+                const int group_n = mirror_group_size(self, batch, batch_n, i);
+                uint16_t *rgba[TILE_GROUP_MAX];
+                TileIndex group[TILE_GROUP_MAX];
+                int n = 0;
+                for (int j = i; j < i + group_n; j++) {
+                    if (!requests[j].buffer) {
+                        printf("Warning: Unable to get tile!\n");
+                        operation_queue_discard(self->operation_queue, batch[j]);
+                        continue;
+                    }
+                    rgba[n] = requests[j].buffer;
+                    group[n] = batch[j];
+                    n++;
+                }
+                process_tile_group(self, n, rgba, group);
+            }
+
+            const uint64_t end_start = self->stats ? monotonic_time_ns() : 0;
+            self->tile_requests_end(self, requests, batch_n);
+            if (self->stats) {
+                self->stats->tile_io_ns += monotonic_time_ns() - end_start;
+            }
+            batch_start += batch_n;
+        }
+        free(requests);
+    } else {
+        #pragma omp parallel for schedule(static) if(self->threadsafe_tile_requests && tiles_n > 3)
+        for (int i = 0; i < tiles_n; i++) {
+            process_tiles(self, mirror_group_size(self, tiles, tiles_n, i), &tiles[i]);
+        }
     }
 
     operation_queue_clear_dirty_tiles(self->operation_queue);
@@ -146,6 +349,7 @@ mypaint_tiled_surface_end_atomic(MyPaintTiledSurface *self, MyPaintRectangles *r
         // Set the number of rectangles written to, so the caller knows which ones to act on.
         roi->num_rectangles = MIN(roi_rects, num_dirty);
     }
+    TRACE_END(span, "mypaint_tiled_surface_end_atomic", "tiles");
 }
 
 /**
@@ -159,7 +363,16 @@ mypaint_tiled_surface_end_atomic(MyPaintTiledSurface *self, MyPaintRectangles *r
 void mypaint_tiled_surface_tile_request_start(MyPaintTiledSurface *self, MyPaintTileRequest *request)
 {
     assert(self->tile_request_start);
-    self->tile_request_start(self, request);
+    if (self->stats) {
+        const uint64_t start = monotonic_time_ns();
+        self->tile_request_start(self, request);
+        MyPaintTiledSurfaceStats part = {0};
+        part.tile_requests = 1;
+        part.tile_io_ns = monotonic_time_ns() - start;
+        stats_merge(self->stats, &part);
+    } else {
+        self->tile_request_start(self, request);
+    }
 }
 
 /**
@@ -173,7 +386,15 @@ void mypaint_tiled_surface_tile_request_start(MyPaintTiledSurface *self, MyPaint
 void mypaint_tiled_surface_tile_request_end(MyPaintTiledSurface *self, MyPaintTileRequest *request)
 {
     assert(self->tile_request_end);
-    self->tile_request_end(self, request);
+    if (self->stats) {
+        const uint64_t start = monotonic_time_ns();
+        self->tile_request_end(self, request);
+        MyPaintTiledSurfaceStats part = {0};
+        part.tile_io_ns = monotonic_time_ns() - start;
+        stats_merge(self->stats, &part);
+    } else {
+        self->tile_request_end(self, request);
+    }
 }
 
 /* FIXME: either expose this through MyPaintSurface, or move it into the brush engine */
@@ -200,6 +421,142 @@ mypaint_tiled_surface_set_symmetry_state(MyPaintTiledSurface *self, gboolean act
         &self->symmetry_data, active, center_x, center_y, symmetry_angle, symmetry_type, rot_symmetry_lines);
 }
 
+/**
+ * mypaint_tiled_surface_set_spectral_cache_budget:
+ * @budget: Maximum number of bytes to use, 0 to disable the cache.
+ *
+ * Keep the log-spectral representation of recently painted tiles in
+ * side buffers, so that pigment (paint mode) dabs do not have to convert
+ * every destination pixel to spectral again. Each cached tile takes
+ * 192 KiB; the least recently used tiles are dropped when the budget is
+ * exhausted. The cache is disabled by default.
+ *
+ * Cached pixels keep the unquantized result of the previous mix, so
+ * results can differ very slightly from those of an uncached surface.
+ * Pixels modified by other means are detected and converted again.
+ *
+ * Must not be called between begin_atomic and end_atomic.
+ */
+void
+mypaint_tiled_surface_set_spectral_cache_budget(MyPaintTiledSurface *self, size_t budget)
+{
+    if (self->spectral_cache) {
+        spectral_cache_free(self->spectral_cache);
+        self->spectral_cache = NULL;
+    }
+    if (budget > 0) {
+        self->spectral_cache = spectral_cache_new(budget);
+    }
+}
+
+/**
+ * mypaint_tiled_surface_set_deterministic:
+ *
+ * Guarantee that identical input gives identical tile contents, whatever
+ * the number of threads. Color sampling is then done one tile after the
+ * other, and the spectral cache is not used (its contents depend on the
+ * order tiles are processed in). Drawing dabs stays parallel.
+ * Off by default.
+ *
+ * Must not be called between begin_atomic and end_atomic.
+ */
+void
+mypaint_tiled_surface_set_deterministic(MyPaintTiledSurface *self, gboolean deterministic)
+{
+    self->deterministic = deterministic;
+}
+
+/**
+ * mypaint_tiled_surface_set_queue_budget:
+ * @max_bytes: Memory the queued dab operations may use, or 0 for no limit
+ * @max_ops: Number of queued dab operations (one per dab and tile it touches), or 0 for no limit
+ *
+ * Bound the dab operations queued between begin_atomic and end_atomic.
+ * When a dab takes the queue over budget, the tiles with the most queued
+ * operations are processed right away, until the queue is back under half
+ * of the budget. The result is the same, since the operations of each tile
+ * are still applied in order. Forced flushes are counted in
+ * #MyPaintTiledSurfaceStats. No limit by default.
+ */
+void
+mypaint_tiled_surface_set_queue_budget(MyPaintTiledSurface *self, size_t max_bytes, size_t max_ops)
+{
+    self->queue_budget_bytes = max_bytes;
+    self->queue_budget_ops = max_ops;
+}
+
+/**
+ * mypaint_tiled_surface_set_mirrored_symmetry:
+ *
+ * Draw the reflected copies of dabs with vertical, horizontal and
+ * vertical+horizontal symmetry as flipped masks of the original dab, when
+ * the symmetry angle is 0 and the axes lie on tile boundaries or through the
+ * middle of tiles. Masks are then rendered once for all reflections.
+ *
+ * The copies become exact mirror images of the original, which differs from
+ * rendering each copy from its own transformed position and angle by up to
+ * a few 1/32768 per channel. Off by default, which renders every copy.
+ *
+ * Must not be called between begin_atomic and end_atomic.
+ */
+void
+mypaint_tiled_surface_set_mirrored_symmetry(MyPaintTiledSurface *self, gboolean mirrored)
+{
+    self->mirrored_symmetry = mirrored;
+}
+
+/**
+ * mypaint_tiled_surface_set_stats_enabled:
+ *
+ * Start or stop collecting #MyPaintTiledSurfaceStats. Collection is off by
+ * default, and costs a few clock readings per dab and tile when on.
+ * Disabling drops the collected statistics.
+ *
+ * Must not be called between begin_atomic and end_atomic.
+ */
+void
+mypaint_tiled_surface_set_stats_enabled(MyPaintTiledSurface *self, gboolean enabled)
+{
+    if (enabled && !self->stats) {
+        self->stats = (MyPaintTiledSurfaceStats *)calloc(1, sizeof(MyPaintTiledSurfaceStats));
+    } else if (!enabled && self->stats) {
+        free(self->stats);
+        self->stats = NULL;
+    }
+}
+
+/**
+ * mypaint_tiled_surface_get_stats:
+ * @stats: (out): Location to copy the statistics to
+ *
+ * Get the statistics collected since they were enabled or last reset.
+ * All counters are zero if collection is disabled.
+ */
+void
+mypaint_tiled_surface_get_stats(MyPaintTiledSurface *self, MyPaintTiledSurfaceStats *stats)
+{
+    if (self->stats) {
+        *stats = *self->stats;
+    } else {
+        memset(stats, 0, sizeof(MyPaintTiledSurfaceStats));
+    }
+}
+
+/**
+ * mypaint_tiled_surface_reset_stats:
+ *
+ * Set all collected statistics back to zero.
+ *
+ * Must not be called between begin_atomic and end_atomic.
+ */
+void
+mypaint_tiled_surface_reset_stats(MyPaintTiledSurface *self)
+{
+    if (self->stats) {
+        memset(self->stats, 0, sizeof(MyPaintTiledSurfaceStats));
+    }
+}
+
 /**
  * mypaint_tile_request_init:
  *
@@ -372,9 +729,9 @@ calculate_opa(float rr, float hardness,
     return opa;
 }
 
+// Computes the constants of a dab mask that do not depend on the tile.
 // Must be threadsafe
-void render_dab_mask (uint16_t * mask,
-                        float x, float y,
+void dab_geometry_init (DabGeometry *geometry,
                         float radius,
                         float hardness,
                         float softness,
@@ -405,15 +762,65 @@ void render_dab_mask (uint16_t * mask,
     // 0           1
     //
 
-    float segment1_offset = (1.f)*(1.f-softness);
-    float segment1_slope  = -(1.0f/hardness - 1.0f)*(1.f-softness);
-    float segment2_offset = hardness/(1.0f-hardness)*(1.f-softness);
-    float segment2_slope  = -hardness/(1.0f-hardness)*(1.f-softness);
+    geometry->segment1_offset = (1.f)*(1.f-softness);
+    geometry->segment1_slope  = -(1.0f/hardness - 1.0f)*(1.f-softness);
+    geometry->segment2_offset = hardness/(1.0f-hardness)*(1.f-softness);
+    geometry->segment2_slope  = -hardness/(1.0f-hardness)*(1.f-softness);
     // for hardness == 1.0, segment2 will never be used
 
+    dab_geometry_set_angle(geometry, angle);
+
+    geometry->one_over_radius2 = 1.0f/(radius*radius);
+
+    const float aa_border = 1.0f;
+    float r_aa_start = ((radius>aa_border) ? (radius-aa_border) : 0);
+    r_aa_start *= r_aa_start / aspect_ratio;
+    geometry->r_aa_start = r_aa_start;
+
+    geometry->radius = radius;
+    geometry->hardness = hardness;
+    geometry->aspect_ratio = aspect_ratio;
+}
+
+// Sets the rotation of the dab mask, the only part of the geometry
+// that differs between the symmetric copies of a dab.
+// Must be threadsafe
+void dab_geometry_set_angle (DabGeometry *geometry, float angle)
+{
     float angle_rad=angle/360*2*M_PI;
-    float cs=cos(angle_rad);
-    float sn=sin(angle_rad);
+    geometry->cs=cos(angle_rad);
+    geometry->sn=sin(angle_rad);
+}
+
+// Must be threadsafe
+void render_dab_mask (uint16_t * mask,
+                        float x, float y,
+                        float radius,
+                        float hardness,
+                        float softness,
+                        float aspect_ratio, float angle
+                        )
+{
+    DabGeometry geometry;
+    dab_geometry_init(&geometry, radius, hardness, softness, aspect_ratio, angle);
+    render_dab_mask_geometry(mask, x, y, &geometry);
+}
+
+// Computes rr for the pixels of the tile that the dab may cover, and sets
+// the bounds of those pixels.
+// Must be threadsafe
+static inline void
+render_dab_rr (float *rr_mask,
+               float x, float y,
+               const DabGeometry *geometry,
+               int *x0_out, int *y0_out, int *x1_out, int *y1_out
+               )
+{
+    const float radius = geometry->radius;
+    const float aspect_ratio = geometry->aspect_ratio;
+    const float cs = geometry->cs;
+    const float sn = geometry->sn;
+    const float one_over_radius2 = geometry->one_over_radius2;
 
     const float r_fringe = radius + 1.0f; // +1.0 should not be required, only to be sure
     int x0 = floor (x - r_fringe);
@@ -424,18 +831,17 @@ void render_dab_mask (uint16_t * mask,
     if (y0 < 0) y0 = 0;
     if (x1 > MYPAINT_TILE_SIZE-1) x1 = MYPAINT_TILE_SIZE-1;
     if (y1 > MYPAINT_TILE_SIZE-1) y1 = MYPAINT_TILE_SIZE-1;
-    const float one_over_radius2 = 1.0f/(radius*radius);
+    *x0_out = x0;
+    *y0_out = y0;
+    *x1_out = x1;
+    *y1_out = y1;
 
     // Pre-calculate rr and put it in the mask.
     // This an optimization that makes use of auto-vectorization
     // OPTIMIZE: if using floats for the brush engine, store these directly in the mask
-    float rr_mask[MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE+2*MYPAINT_TILE_SIZE];
-
     if (radius < 3.0f)
     {
-      const float aa_border = 1.0f;
-      float r_aa_start = ((radius>aa_border) ? (radius-aa_border) : 0);
-      r_aa_start *= r_aa_start / aspect_ratio;
+      const float r_aa_start = geometry->r_aa_start;
 
       for (int yp = y0; yp <= y1; yp++) {
         for (int xp = x0; xp <= x1; xp++) {
@@ -458,6 +864,23 @@ void render_dab_mask (uint16_t * mask,
         }
       }
     }
+}
+
+// Must be threadsafe
+void render_dab_mask_geometry (uint16_t * mask,
+                               float x, float y,
+                               const DabGeometry *geometry
+                               )
+{
+    const float hardness = geometry->hardness;
+    const float segment1_offset = geometry->segment1_offset;
+    const float segment1_slope = geometry->segment1_slope;
+    const float segment2_offset = geometry->segment2_offset;
+    const float segment2_slope = geometry->segment2_slope;
+
+    float rr_mask[MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE+2*MYPAINT_TILE_SIZE];
+    int x0, y0, x1, y1;
+    render_dab_rr(rr_mask, x, y, geometry, &x0, &y0, &x1, &y1);
 
     // we do run length encoding: if opacity is zero, the next
     // value in the mask is the number of pixels that can be skipped.
@@ -490,107 +913,556 @@ void render_dab_mask (uint16_t * mask,
     }
     *mask_p++ = 0;
     *mask_p++ = 0;
-  }
+}
 
+// Like render_dab_mask_geometry(), but without the run length encoding,
+// so that the opacities can be encoded flipped, see dab_mask_window_encode().
 // Must be threadsafe
-void
-process_op(uint16_t *rgba_p, uint16_t *mask,
-           int tx, int ty, OperationDataDrawDab *op)
+void render_dab_mask_window (DabMaskWindow *window,
+                             float x, float y,
+                             const DabGeometry *geometry
+                             )
 {
+    const float hardness = geometry->hardness;
+    const float segment1_offset = geometry->segment1_offset;
+    const float segment1_slope = geometry->segment1_slope;
+    const float segment2_offset = geometry->segment2_offset;
+    const float segment2_slope = geometry->segment2_slope;
 
-    // first, we calculate the mask (opacity for each pixel)
-    render_dab_mask(mask,
-                    op->x - tx*MYPAINT_TILE_SIZE,
-                    op->y - ty*MYPAINT_TILE_SIZE,
-                    op->radius,
-                    op->hardness,
-                    op->softness,
-                    op->aspect_ratio, op->angle
-                    );
-
-    // second, we use the mask to stamp a dab for each activated blend mode
-    if (op->paint < 1.0) {
-      if (op->normal) {
-        if (op->color_a == 1.0) {
-          draw_dab_pixels_BlendMode_Normal(mask, rgba_p,
-                                           op->color_r, op->color_g, op->color_b, op->normal*op->opaque*(1 - op->paint)*(1<<15));
-        } else {
-          // normal case for brushes that use smudging (eg. watercolor)
-          draw_dab_pixels_BlendMode_Normal_and_Eraser(mask, rgba_p,
-                                                      op->color_r, op->color_g, op->color_b, op->color_a*(1<<15),
-                                                      op->normal*op->opaque*(1 - op->paint)*(1<<15));
-        }
-      }
+    float rr_mask[MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE+2*MYPAINT_TILE_SIZE];
+    render_dab_rr(rr_mask, x, y, geometry, &window->x0, &window->y0, &window->x1, &window->y1);
 
-      if (op->lock_alpha && op->color_a != 0) {
-        draw_dab_pixels_BlendMode_LockAlpha(mask, rgba_p,
-                                            op->color_r, op->color_g, op->color_b,
-                                            op->lock_alpha*op->opaque*(1 - op->colorize)*(1 - op->posterize)*(1 - op->paint)*(1<<15));
+    for (int yp = window->y0; yp <= window->y1; yp++) {
+      for (int xp = window->x0; xp <= window->x1; xp++) {
+        const float rr = rr_mask[(yp*MYPAINT_TILE_SIZE)+xp];
+        const float opa = calculate_opa(rr, hardness,
+                                  segment1_offset, segment1_slope,
+                                  segment2_offset, segment2_slope);
+        window->opa[(yp*MYPAINT_TILE_SIZE)+xp] = opa * (1<<15);
       }
     }
-    
-    if (op->paint > 0.0) {
-      if (op->normal) {
-        if (op->color_a == 1.0) {
-          draw_dab_pixels_BlendMode_Normal_Paint(mask, rgba_p,
-                                           op->color_r, op->color_g, op->color_b, op->normal*op->opaque*op->paint*(1<<15));
+}
+
+// Run length encodes the window into a dab mask, flipped as given by the
+// DabMirror flags.
+// Must be threadsafe
+void dab_mask_window_encode (const DabMaskWindow *window,
+                             uint16_t *mask,
+                             int mirror
+                             )
+{
+    const int flip_x = mirror & DAB_MIRROR_X;
+    const int flip_y = mirror & DAB_MIRROR_Y;
+    const int x0 = flip_x ? MYPAINT_TILE_SIZE-1 - window->x1 : window->x0;
+    const int x1 = flip_x ? MYPAINT_TILE_SIZE-1 - window->x0 : window->x1;
+    const int y0 = flip_y ? MYPAINT_TILE_SIZE-1 - window->y1 : window->y0;
+    const int y1 = flip_y ? MYPAINT_TILE_SIZE-1 - window->y0 : window->y1;
+
+    // we do run length encoding: if opacity is zero, the next
+    // value in the mask is the number of pixels that can be skipped.
+    uint16_t * mask_p = mask;
+    int skip=0;
+
+    skip += y0*MYPAINT_TILE_SIZE;
+    for (int yp = y0; yp <= y1; yp++) {
+      skip += x0;
+
+      const int row = flip_y ? MYPAINT_TILE_SIZE-1 - yp : yp;
+      const uint16_t *opa_p = window->opa + row*MYPAINT_TILE_SIZE + (flip_x ? MYPAINT_TILE_SIZE-1 - x0 : x0);
+      const int step = flip_x ? -1 : 1;
+      int xp;
+      for (xp = x0; xp <= x1; xp++, opa_p += step) {
+        const uint16_t opa_ = *opa_p;
+        if (!opa_) {
+          skip++;
         } else {
-          // normal case for brushes that use smudging (eg. watercolor)
-          draw_dab_pixels_BlendMode_Normal_and_Eraser_Paint(mask, rgba_p,
-                                                      op->color_r, op->color_g, op->color_b, op->color_a*(1<<15),
-                                                      op->normal*op->opaque*op->paint*(1<<15));
+          if (skip) {
+            *mask_p++ = 0;
+            *mask_p++ = skip*4;
+            skip = 0;
+          }
+          *mask_p++ = opa_;
         }
       }
+      skip += MYPAINT_TILE_SIZE-xp;
+    }
+    *mask_p++ = 0;
+    *mask_p++ = 0;
+}
 
-      if (op->lock_alpha && op->color_a != 0) {
-        draw_dab_pixels_BlendMode_LockAlpha_Paint(mask, rgba_p,
-                                            op->color_r, op->color_g, op->color_b,
-                                            op->lock_alpha*op->opaque*(1 - op->colorize)*(1 - op->posterize)*op->paint*(1<<15));
-      }
+// Number of mask windows kept by a MaskCache. Enough for the copies of a dab
+// on a group of mirrored tiles to find the window of the original.
+#define MASK_CACHE_SIZE 8
+
+// The inputs that a mask window is rendered from
+typedef struct {
+    float x;
+    float y;
+    DabGeometry geometry;
+} MaskCacheKey;
+
+struct MaskCache {
+    int used;
+    int next;
+    MaskCacheKey keys[MASK_CACHE_SIZE];
+    DabMaskWindow windows[MASK_CACHE_SIZE];
+};
+
+MaskCache *
+mask_cache_new(void)
+{
+    MaskCache *cache = (MaskCache *)malloc(sizeof(MaskCache));
+    if (cache) {
+        cache->used = 0;
+        cache->next = 0;
     }
-    
-    if (op->colorize) {
-      draw_dab_pixels_BlendMode_Color(mask, rgba_p,
-                                      op->color_r, op->color_g, op->color_b,
-                                      op->colorize*op->opaque*(1<<15));
+    return cache;
+}
+
+void
+mask_cache_free(MaskCache *cache)
+{
+    free(cache);
+}
+
+// Returns the window of the dab at x, y, rendering it if it is not cached.
+// *rendered tells which one happened.
+static const DabMaskWindow *
+mask_cache_get(MaskCache *cache, float x, float y, const DabGeometry *geometry, gboolean *rendered)
+{
+    MaskCacheKey key;
+    memset(&key, 0, sizeof(key));
+    key.x = x;
+    key.y = y;
+    key.geometry = *geometry;
+
+    for (int i = 0; i < cache->used; i++) {
+        if (memcmp(&cache->keys[i], &key, sizeof(key)) == 0) {
+            *rendered = FALSE;
+            return &cache->windows[i];
+        }
     }
-    if (op->posterize) {
-      draw_dab_pixels_BlendMode_Posterize(mask, rgba_p,
-                                      op->posterize*op->opaque*(1<<15),
-                                      op->posterize_num);
+
+    const int i = cache->next;
+    cache->next = (i + 1) % MASK_CACHE_SIZE;
+    cache->used = MAX(cache->used, i + 1);
+    cache->keys[i] = key;
+    render_dab_mask_window(&cache->windows[i], x, y, geometry);
+    *rendered = TRUE;
+    return &cache->windows[i];
+}
+
+static inline void
+count_blend(MyPaintTiledSurfaceStats *stats, MyPaintBlendMode mode)
+{
+    if (stats) {
+        stats->blend_calls[mode]++;
     }
 }
 
-// Must be threadsafe
+#define BLEND_MODE_BIT(mode) (1u << (mode))
+
+// The modes that can add alpha, if the dab is not erasing
+#define NORMAL_BLEND_MODES (BLEND_MODE_BIT(MYPAINT_BLEND_MODE_NORMAL) \
+                            | BLEND_MODE_BIT(MYPAINT_BLEND_MODE_NORMAL_AND_ERASER) \
+                            | BLEND_MODE_BIT(MYPAINT_BLEND_MODE_NORMAL_PAINT) \
+                            | BLEND_MODE_BIT(MYPAINT_BLEND_MODE_NORMAL_AND_ERASER_PAINT))
+
+// The modes that mix pigments, and use the spectral cache
+#define PAINT_BLEND_MODES (BLEND_MODE_BIT(MYPAINT_BLEND_MODE_NORMAL_PAINT) \
+                           | BLEND_MODE_BIT(MYPAINT_BLEND_MODE_NORMAL_AND_ERASER_PAINT) \
+                           | BLEND_MODE_BIT(MYPAINT_BLEND_MODE_LOCK_ALPHA_PAINT))
+
+// The blend kernels to run for a dab with the given clamped parameters,
+// see OperationDataDrawDab
+static uint16_t
+select_blend_modes(float normal, float color_a, float lock_alpha,
+                   float colorize, float posterize, float paint)
+{
+    uint16_t modes = 0;
+    if (paint < 1.0) {
+        if (normal) {
+            // Brushes that use smudging (eg. watercolor) also erase
+            modes |= BLEND_MODE_BIT(color_a == 1.0 ? MYPAINT_BLEND_MODE_NORMAL
+                                                   : MYPAINT_BLEND_MODE_NORMAL_AND_ERASER);
+        }
+        if (lock_alpha && color_a != 0) {
+            modes |= BLEND_MODE_BIT(MYPAINT_BLEND_MODE_LOCK_ALPHA);
+        }
+    }
+    if (paint > 0.0) {
+        if (normal) {
+            modes |= BLEND_MODE_BIT(color_a == 1.0 ? MYPAINT_BLEND_MODE_NORMAL_PAINT
+                                                   : MYPAINT_BLEND_MODE_NORMAL_AND_ERASER_PAINT);
+        }
+        if (lock_alpha && color_a != 0) {
+            modes |= BLEND_MODE_BIT(MYPAINT_BLEND_MODE_LOCK_ALPHA_PAINT);
+        }
+    }
+    if (colorize) {
+        modes |= BLEND_MODE_BIT(MYPAINT_BLEND_MODE_COLOR);
+    }
+    if (posterize) {
+        modes |= BLEND_MODE_BIT(MYPAINT_BLEND_MODE_POSTERIZE);
+    }
+    return modes;
+}
+
+// Number of blend kernels process_op() runs for the operation
+static int
+count_op_blends(const OperationDataDrawDab *op)
+{
+    int n = 0;
+    for (uint32_t modes = op->blend_modes; modes; modes &= modes - 1) {
+        n++;
+    }
+    return n;
+}
+
+// TRUE if every channel of every pixel of the tile is 0
+static gboolean
+tile_is_empty(const uint16_t *rgba_p)
+{
+    for (int y = 0; y < MYPAINT_TILE_SIZE; y++) {
+        const uint16_t *row = rgba_p + y*MYPAINT_TILE_SIZE*4;
+        uint16_t any = 0;
+        for (int i = 0; i < MYPAINT_TILE_SIZE*4; i++) {
+            any |= row[i];
+        }
+        if (any) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Must be threadsafe. Counters are added to stats, if not NULL.
+//
+// Mask windows are looked up in and added to mask_cache, if not NULL.
+//
+// If state is not NULL, it describes the tile before the operation and is
+// updated for the next one. Operations that cannot change an empty tile are
+// then skipped on one: locked alpha, colorize and posterize keep transparent
+// pixels transparent, and erasing them does nothing. The state is only
+// inspected when it could save work, and a NULL state skips nothing.
+// Operations without any blend mode are skipped on every tile.
 void
-process_tile(MyPaintTiledSurface *self, int tx, int ty)
+process_op(uint16_t *rgba_p, uint16_t *mask,
+           int tx, int ty, OperationDataDrawDab *op,
+           SpectralCachePixel *spectral_cache,
+           MaskCache *mask_cache,
+           TileState *state,
+           MyPaintTiledSurfaceStats *stats)
 {
-    TileIndex tile_index = {tx, ty};
-    OperationDataDrawDab *op = operation_queue_pop(self->operation_queue, tile_index);
-    if (!op) {
+    if (!op->blend_modes) {
+        if (stats) {
+            stats->ops_processed++;
+            stats->ops_elided++;
+        }
         return;
     }
 
-    MyPaintTileRequest request_data;
-    const int mipmap_level = 0;
-    mypaint_tile_request_init(&request_data, mipmap_level, tx, ty, FALSE);
+    // Only the normal modes can add alpha, and only if not erasing
+    const gboolean adds_alpha = (op->blend_modes & NORMAL_BLEND_MODES) && op->color_a_fix15 > 0;
+
+    if (state && adds_alpha) {
+        *state = TILE_STATE_PAINTED;
+    } else if (state) {
+        if (*state == TILE_STATE_UNKNOWN) {
+            *state = tile_is_empty(rgba_p) ? TILE_STATE_EMPTY : TILE_STATE_PAINTED;
+            if (stats) {
+                stats->tile_scans++;
+            }
+        }
+        if (*state == TILE_STATE_EMPTY) {
+            if (stats) {
+                stats->ops_processed++;
+                stats->ops_elided++;
+                stats->blends_elided += count_op_blends(op);
+            }
+            return;
+        }
+    }
+
+    const uint64_t mask_start = stats ? monotonic_time_ns() : 0;
 
-    mypaint_tiled_surface_tile_request_start(self, &request_data);
-    uint16_t * rgba_p = request_data.buffer;
-    if (!rgba_p) {
-        printf("Warning: Unable to get tile!\n");
+    // first, we calculate the mask (opacity for each pixel)
+    // Reflected copies use the window of the original on the mirrored tile
+    const int source_tx = (op->mirror & DAB_MIRROR_X) ? op->mirror_tiles_x - 1 - tx : tx;
+    const int source_ty = (op->mirror & DAB_MIRROR_Y) ? op->mirror_tiles_y - 1 - ty : ty;
+    const float x = op->x - source_tx*MYPAINT_TILE_SIZE;
+    const float y = op->y - source_ty*MYPAINT_TILE_SIZE;
+    gboolean rendered = TRUE;
+    if (mask_cache) {
+        const DabMaskWindow *window = mask_cache_get(mask_cache, x, y, &op->geometry, &rendered);
+        dab_mask_window_encode(window, mask, op->mirror);
+    } else if (op->mirror) {
+        DabMaskWindow window;
+        render_dab_mask_window(&window, x, y, &op->geometry);
+        dab_mask_window_encode(&window, mask, op->mirror);
+    } else {
+        render_dab_mask_geometry(mask, x, y, &op->geometry);
+    }
+
+    const uint64_t blend_start = stats ? monotonic_time_ns() : 0;
+    if (stats) {
+        if (rendered) {
+            stats->mask_renders++;
+        } else {
+            stats->masks_reused++;
+        }
+        stats->mask_ns += blend_start - mask_start;
+    }
+
+    // second, we use the mask to stamp a dab for each activated blend mode,
+    // as selected once per dab by draw_dab_operation_init()
+    for (int mode = 0; mode < MYPAINT_BLEND_MODES_COUNT; mode++) {
+        if (!(op->blend_modes & BLEND_MODE_BIT(mode))) {
+            continue;
+        }
+        count_blend(stats, mode);
+        switch (mode) {
+        case MYPAINT_BLEND_MODE_NORMAL:
+            draw_dab_pixels_BlendMode_Normal(mask, rgba_p,
+                                             op->color_r, op->color_g, op->color_b, op->opa_normal);
+            break;
+        case MYPAINT_BLEND_MODE_NORMAL_AND_ERASER:
+            draw_dab_pixels_BlendMode_Normal_and_Eraser(mask, rgba_p,
+                                                        op->color_r, op->color_g, op->color_b, op->color_a_fix15,
+                                                        op->opa_normal);
+            break;
+        case MYPAINT_BLEND_MODE_LOCK_ALPHA:
+            draw_dab_pixels_BlendMode_LockAlpha(mask, rgba_p,
+                                                op->color_r, op->color_g, op->color_b,
+                                                op->opa_lock_alpha);
+            break;
+        case MYPAINT_BLEND_MODE_NORMAL_PAINT:
+            draw_dab_pixels_BlendMode_Normal_Paint(mask, rgba_p,
+                                                   op->color_r, op->color_g, op->color_b, op->opa_normal_paint,
+                                                   spectral_cache);
+            break;
+        case MYPAINT_BLEND_MODE_NORMAL_AND_ERASER_PAINT:
+            draw_dab_pixels_BlendMode_Normal_and_Eraser_Paint(mask, rgba_p,
+                                                              op->color_r, op->color_g, op->color_b, op->color_a_fix15,
+                                                              op->opa_normal_paint, spectral_cache);
+            break;
+        case MYPAINT_BLEND_MODE_LOCK_ALPHA_PAINT:
+            draw_dab_pixels_BlendMode_LockAlpha_Paint(mask, rgba_p,
+                                                      op->color_r, op->color_g, op->color_b,
+                                                      op->opa_lock_alpha_paint,
+                                                      spectral_cache);
+            break;
+        case MYPAINT_BLEND_MODE_COLOR:
+            draw_dab_pixels_BlendMode_Color(mask, rgba_p,
+                                            op->color_r, op->color_g, op->color_b,
+                                            op->opa_colorize);
+            break;
+        case MYPAINT_BLEND_MODE_POSTERIZE:
+            draw_dab_pixels_BlendMode_Posterize(mask, rgba_p,
+                                                op->opa_posterize,
+                                                op->posterize_num);
+            break;
+        }
+    }
+
+    if (stats) {
+        stats->ops_processed++;
+        stats->blend_ns += monotonic_time_ns() - blend_start;
+    }
+}
+
+// Applies the queued operations of a group of up to TILE_GROUP_MAX tiles to
+// their buffers. The operations of the tiles are applied in turns, so that
+// the reflected copies of a dab on mirrored tiles are processed close together
+// and can reuse the mask window of the original. Must be threadsafe.
+static void
+process_tile_group(MyPaintTiledSurface *self, int n, uint16_t **rgba, const TileIndex *tiles)
+{
+    OperationDataDrawDab *ops[TILE_GROUP_MAX];
+    int pending = 0;
+    for (int i = 0; i < n; i++) {
+        ops[i] = operation_queue_pop(self->operation_queue, tiles[i]);
+        if (ops[i]) {
+            pending++;
+        }
+    }
+    if (!pending) {
         return;
     }
 
+    TRACE_BEGIN(span);
+    TRACE_ARG(span, 0, tiles[0].x);
+    TRACE_ARG(span, 1, tiles[0].y);
+
     uint16_t mask[MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE+2*MYPAINT_TILE_SIZE];
 
-    while (op) {
-        process_op(rgba_p, mask, tile_index.x, tile_index.y, op);
-        free(op);
-        op = operation_queue_pop(self->operation_queue, tile_index);
+    // The spectral cache is only fetched once a pigment dab needs it
+    SpectralCachePixel *spectral[TILE_GROUP_MAX];
+    gboolean spectral_requested[TILE_GROUP_MAX];
+
+    // Lets operations that cannot change an empty tile be skipped
+    TileState states[TILE_GROUP_MAX];
+
+    for (int i = 0; i < n; i++) {
+        spectral[i] = NULL;
+        spectral_requested[i] = FALSE;
+        states[i] = TILE_STATE_UNKNOWN;
+    }
+
+    // Only reflected copies of dabs can reuse mask windows
+    int mirror_tiles_x, mirror_tiles_y;
+    MaskCache *mask_cache = NULL;
+    if (symmetry_mirror(self, &mirror_tiles_x, &mirror_tiles_y)) {
+        mask_cache = mask_cache_new();
+    }
+
+    // Counted locally, and added to the surface totals once per group
+    MyPaintTiledSurfaceStats tile_stats = {0};
+    MyPaintTiledSurfaceStats *stats = self->stats ? &tile_stats : NULL;
+    tile_stats.tiles_processed = pending;
+
+    while (pending) {
+        for (int i = 0; i < n; i++) {
+            OperationDataDrawDab *op = ops[i];
+            if (!op) {
+                continue;
+            }
+            if ((op->blend_modes & PAINT_BLEND_MODES) && self->spectral_cache && !self->deterministic && !spectral_requested[i]) {
+                spectral[i] = spectral_cache_acquire(self->spectral_cache, tiles[i].x, tiles[i].y);
+                spectral_requested[i] = TRUE;
+            }
+            process_op(rgba[i], mask, tiles[i].x, tiles[i].y, op, spectral[i], mask_cache, &states[i], stats);
+            TRACE_ADD(span, 2, 1);
+            ops[i] = operation_queue_pop(self->operation_queue, tiles[i]);
+            if (!ops[i]) {
+                pending--;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (spectral[i]) {
+            spectral_cache_release(self->spectral_cache, spectral[i]);
+        }
+    }
+    mask_cache_free(mask_cache);
+
+    if (stats) {
+        stats_merge(self->stats, &tile_stats);
+    }
+    TRACE_END(span, "process_tile", "tx", "ty", "ops");
+}
+
+// Requests the tiles with queued operations of a group and processes them,
+// see process_tile_group(). Must be threadsafe
+static void
+process_tiles(MyPaintTiledSurface *self, int n, const TileIndex *tiles)
+{
+    MyPaintTileRequest requests[TILE_GROUP_MAX];
+    uint16_t *rgba[TILE_GROUP_MAX];
+    TileIndex requested[TILE_GROUP_MAX];
+    int requested_n = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (!operation_queue_peek_first(self->operation_queue, tiles[i])) {
+            continue;
+        }
+
+        MyPaintTileRequest *request = &requests[requested_n];
+        const int mipmap_level = 0;
+        mypaint_tile_request_init(request, mipmap_level, tiles[i].x, tiles[i].y, FALSE);
+
+        mypaint_tiled_surface_tile_request_start(self, request);
+        if (!request->buffer) {
+            printf("Warning: Unable to get tile!\n");
+            operation_queue_discard(self->operation_queue, tiles[i]);
+            continue;
+        }
+        rgba[requested_n] = request->buffer;
+        requested[requested_n] = tiles[i];
+        requested_n++;
+    }
+
+    if (requested_n == 0) {
+        return;
     }
+    process_tile_group(self, requested_n, rgba, requested);
 
-    mypaint_tiled_surface_tile_request_end(self, &request_data);
+    for (int i = 0; i < requested_n; i++) {
+        mypaint_tiled_surface_tile_request_end(self, &requests[i]);
+    }
+}
+
+// Must be threadsafe
+void
+process_tile(MyPaintTiledSurface *self, int tx, int ty)
+{
+    const TileIndex tile_index = {tx, ty};
+    process_tiles(self, 1, &tile_index);
+}
+
+// TRUE if the queued operations take up more than budget / divisor
+static gboolean
+queue_over_budget(MyPaintTiledSurface *self, int divisor)
+{
+    OperationQueue *queue = self->operation_queue;
+    return (self->queue_budget_bytes && operation_queue_get_queued_bytes(queue) > self->queue_budget_bytes / divisor)
+        || (self->queue_budget_ops && (size_t)operation_queue_get_queued_ops(queue) > self->queue_budget_ops / divisor);
+}
+
+typedef struct {
+    TileIndex index;
+    int ops;
+} TileLoad;
+
+static int
+compare_tile_load(const void *a, const void *b)
+{
+    return ((const TileLoad *)b)->ops - ((const TileLoad *)a)->ops;
+}
+
+// Processes the tiles with the most queued operations, a quarter of the
+// dirty tiles at a time, until the queue is back under half of its budget.
+static void
+flush_queue_budget(MyPaintTiledSurface *self)
+{
+    OperationQueue *queue = self->operation_queue;
+    uint64_t tiles_flushed = 0;
+
+    while (queue_over_budget(self, 2)) {
+        TileIndex *tiles;
+        const int tiles_n = operation_queue_get_dirty_tiles(queue, &tiles);
+        if (tiles_n == 0) {
+            break;
+        }
+
+        TileLoad *loads = (TileLoad *)malloc(tiles_n * sizeof(TileLoad));
+        for (int i = 0; i < tiles_n; i++) {
+            loads[i].index = tiles[i];
+            loads[i].ops = operation_queue_get_tile_ops(queue, tiles[i]);
+        }
+        qsort(loads, tiles_n, sizeof(TileLoad), compare_tile_load);
+
+        const int64_t ops_before = operation_queue_get_queued_ops(queue);
+        const int batch_n = MAX(1, tiles_n / 4);
+        #pragma omp parallel for schedule(static) if(self->threadsafe_tile_requests && batch_n > 3)
+        for (int i = 0; i < batch_n; i++) {
+            process_tile(self, loads[i].index.x, loads[i].index.y);
+        }
+        free(loads);
+        tiles_flushed += batch_n;
+
+        operation_queue_compact(queue);
+        if (operation_queue_get_queued_ops(queue) == ops_before) {
+            // None of the tiles could be processed
+            break;
+        }
+    }
+
+    if (self->stats) {
+        self->stats->forced_flushes++;
+        self->stats->forced_flush_tiles += tiles_flushed;
+    }
 }
 
 void
@@ -607,42 +1479,39 @@ update_dirty_bbox(MyPaintRectangle *bbox, OperationDataDrawDab *op)
     mypaint_rectangle_expand_to_include_point(bbox, bb_x+bb_w-1, bb_y+bb_h-1);
 }
 
-// returns TRUE if the surface was modified
-gboolean draw_dab_internal (MyPaintTiledSurface *self, float x, float y,
-               float radius,
-               float color_r, float color_g, float color_b,
-               float opaque, float hardness, float softness,
-               float color_a,
-               float aspect_ratio, float angle,
-               float lock_alpha,
-               float colorize,
-               float posterize,
-               float posterize_num,
-               float paint,
-               int bbox_index
-               )
-
+// Fills in the operation for a dab.
+// Returns FALSE if the dab would not change the surface.
+gboolean
+draw_dab_operation_init (OperationDataDrawDab *op,
+                         float x, float y,
+                         float radius,
+                         float color_r, float color_g, float color_b,
+                         float opaque, float hardness, float softness,
+                         float color_a,
+                         float aspect_ratio, float angle,
+                         float lock_alpha,
+                         float colorize,
+                         float posterize,
+                         float posterize_num,
+                         float paint)
 {
-    OperationDataDrawDab op_struct;
-    OperationDataDrawDab *op = &op_struct;
-
     op->x = x;
     op->y = y;
+    op->mirror = DAB_MIRROR_NONE;
     op->radius = radius;
-    op->aspect_ratio = aspect_ratio;
     op->angle = angle;
-    op->opaque = CLAMP(opaque, 0.0f, 1.0f);
-    op->hardness = CLAMP(hardness, 0.0f, 1.0f);
-    op->softness = CLAMP(softness, 0.0f, 1.0f);
-    op->lock_alpha = CLAMP(lock_alpha, 0.0f, 1.0f);
-    op->colorize = CLAMP(colorize, 0.0f, 1.0f);
-    op->posterize = CLAMP(posterize, 0.0f, 1.0f);
+    opaque = CLAMP(opaque, 0.0f, 1.0f);
+    hardness = CLAMP(hardness, 0.0f, 1.0f);
+    softness = CLAMP(softness, 0.0f, 1.0f);
+    lock_alpha = CLAMP(lock_alpha, 0.0f, 1.0f);
+    colorize = CLAMP(colorize, 0.0f, 1.0f);
+    posterize = CLAMP(posterize, 0.0f, 1.0f);
     op->posterize_num= CLAMP(ROUND(posterize_num * 100.0), 1, 128);
-    op->paint = CLAMP(paint, 0.0f, 1.0f);
-    if (op->radius < 0.1f) return FALSE; // don't bother with dabs smaller than 0.1 pixel
-    if (op->hardness == 0.0f) return FALSE; // infintly small center point, fully transparent outside
-    if (op->softness == 1.0f) return FALSE;
-    if (op->opaque == 0.0f) return FALSE;
+    paint = CLAMP(paint, 0.0f, 1.0f);
+    if (radius < 0.1f) return FALSE; // don't bother with dabs smaller than 0.1 pixel
+    if (hardness == 0.0f) return FALSE; // infintly small center point, fully transparent outside
+    if (softness == 1.0f) return FALSE;
+    if (opaque == 0.0f) return FALSE;
 
     color_r = CLAMP(color_r, 0.0f, 1.0f);
     color_g = CLAMP(color_g, 0.0f, 1.0f);
@@ -652,40 +1521,112 @@ gboolean draw_dab_internal (MyPaintTiledSurface *self, float x, float y,
     op->color_r = color_r * (1<<15);
     op->color_g = color_g * (1<<15);
     op->color_b = color_b * (1<<15);
-    op->color_a = color_a;
 
     // blending mode preparation
-    op->normal = 1.0f;
+    float normal = 1.0f;
 
-    op->normal *= 1.0f-op->lock_alpha;
-    op->normal *= 1.0f-op->colorize;
-    op->normal *= 1.0f-op->posterize;
+    normal *= 1.0f-lock_alpha;
+    normal *= 1.0f-colorize;
+    normal *= 1.0f-posterize;
 
-    if (op->aspect_ratio<1.0f) op->aspect_ratio=1.0f;
+    if (aspect_ratio<1.0f) aspect_ratio=1.0f;
 
-    // Determine the tiles influenced by operation, and queue it for processing for each tile
-    float r_fringe = radius + 1.0f; // +1.0 should not be required, only to be sure
-      
-    int tx1 = floor(floor(x - r_fringe) / MYPAINT_TILE_SIZE);
-    int tx2 = floor(floor(x + r_fringe) / MYPAINT_TILE_SIZE);
-    int ty1 = floor(floor(y - r_fringe) / MYPAINT_TILE_SIZE);
-    int ty2 = floor(floor(y + r_fringe) / MYPAINT_TILE_SIZE);
+    // Constants for rendering the dab on each tile
+    dab_geometry_init(&op->geometry, radius, hardness, softness, aspect_ratio, angle);
+    op->opa_normal = normal*opaque*(1 - paint)*(1<<15);
+    op->opa_normal_paint = normal*opaque*paint*(1<<15);
+    op->opa_lock_alpha = lock_alpha*opaque*(1 - colorize)*(1 - posterize)*(1 - paint)*(1<<15);
+    op->opa_lock_alpha_paint = lock_alpha*opaque*(1 - colorize)*(1 - posterize)*paint*(1<<15);
+    op->opa_colorize = colorize*opaque*(1<<15);
+    op->opa_posterize = posterize*opaque*(1<<15);
+    op->color_a_fix15 = color_a*(1<<15);
 
-    for (int ty = ty1; ty <= ty2; ty++) {
-        for (int tx = tx1; tx <= tx2; tx++) {
-            const TileIndex tile_index = {tx, ty};
-            OperationDataDrawDab *op_copy = (OperationDataDrawDab *)malloc(sizeof(OperationDataDrawDab));
-            *op_copy = *op;
-            operation_queue_add(self->operation_queue, tile_index, op_copy);
+    // May be empty, eg. locking alpha without any colour. Such dabs are still
+    // queued, and invalidate their area, but are skipped by process_op().
+    op->blend_modes = select_blend_modes(normal, color_a, lock_alpha, colorize, posterize, paint);
+
+    return TRUE;
+}
+
+// Largest number of dab copies queued at once by queue_dab_copies()
+#define DAB_COPIES_MAX 64
+
+// Queues n copies of the dab at the given positions and angles, each
+// expanding the bounding box with the given index. The copies share
+// everything else with op, which must have been filled in by
+// draw_dab_operation_init().
+// If mirror is not NULL, it gives the DabMirror flags of copies that are
+// reflections of op, see symmetry_mirror().
+static void
+queue_dab_copies(MyPaintTiledSurface *self, const OperationDataDrawDab *op, int n,
+                 const float *x, const float *y, const float *angle, const int *bbox_index,
+                 const int *mirror)
+{
+    int mirror_tiles_x = 0;
+    int mirror_tiles_y = 0;
+    if (mirror) {
+        symmetry_mirror(self, &mirror_tiles_x, &mirror_tiles_y);
+    }
+
+    const uint64_t queue_start = self->stats ? monotonic_time_ns() : 0;
+    uint64_t ops_n = 0;
+
+    uint32_t first;
+    OperationDataDrawDab *copies = operation_queue_add_dabs(self->operation_queue, n, &first);
+
+    for (int i = 0; i < n; i++) {
+        OperationDataDrawDab *copy = &copies[i];
+        *copy = *op;
+        copy->x = x[i];
+        copy->y = y[i];
+        if (memcmp(&angle[i], &op->angle, sizeof(float)) != 0) {
+            copy->angle = angle[i];
+            // The rotation of op is kept for the same angle, down to the sign
+            // of zero, and for reflections, whose masks are flipped ones of op
+            if (!(mirror && mirror[i])) {
+                dab_geometry_set_angle(&copy->geometry, angle[i]);
+            }
+        }
+
+        // Determine the tiles influenced by operation, and queue it for processing for each tile
+        float r_fringe = op->radius + 1.0f; // +1.0 should not be required, only to be sure
+
+        int tx1 = floor(floor(x[i] - r_fringe) / MYPAINT_TILE_SIZE);
+        int tx2 = floor(floor(x[i] + r_fringe) / MYPAINT_TILE_SIZE);
+        int ty1 = floor(floor(y[i] - r_fringe) / MYPAINT_TILE_SIZE);
+        int ty2 = floor(floor(y[i] + r_fringe) / MYPAINT_TILE_SIZE);
+
+        for (int ty = ty1; ty <= ty2; ty++) {
+            for (int tx = tx1; tx <= tx2; tx++) {
+                const TileIndex tile_index = {tx, ty};
+                operation_queue_add(self->operation_queue, tile_index, first + i);
+            }
+        }
+        ops_n += (uint64_t)(tx2 - tx1 + 1) * (ty2 - ty1 + 1);
+
+        update_dirty_bbox(&self->bboxes[bbox_index[i]], copy);
+
+        if (mirror && mirror[i]) {
+            // Rendered from the position of op, see process_op()
+            copy->x = op->x;
+            copy->y = op->y;
+            copy->mirror = mirror[i];
+            copy->mirror_tiles_x = mirror_tiles_x;
+            copy->mirror_tiles_y = mirror_tiles_y;
         }
     }
 
-    update_dirty_bbox(&self->bboxes[bbox_index], op);
+    if (self->stats) {
+        self->stats->dabs_queued += n;
+        self->stats->ops_queued += ops_n;
+        self->stats->queue_ns += monotonic_time_ns() - queue_start;
+    }
 
-    return TRUE;
+    if (queue_over_budget(self, 1)) {
+        flush_queue_budget(self);
+    }
 }
 
-
 // returns TRUE if the surface was modified
 int draw_dab (MyPaintSurface *surface, float x, float y,
                float radius,
@@ -701,14 +1642,17 @@ int draw_dab (MyPaintSurface *surface, float x, float y,
 {
     MyPaintTiledSurface* self = (MyPaintTiledSurface*)surface;
 
-    // These calls are repeated enough to warrant a local macro, for both readability and correctness.
-#define DDI(x, y, angle, bb_idx) (draw_dab_internal(\
-        self, (x), (y), radius, color_r, color_g, color_b, opaque, \
-        hardness, softness, color_a, aspect_ratio, (angle), \
-        lock_alpha, colorize, posterize, posterize_num, paint, (bb_idx)))
+    // Clamped, validated and quantized once, and shared by all symmetric copies
+    OperationDataDrawDab op;
+    gboolean surface_modified = draw_dab_operation_init(
+        &op, x, y, radius, color_r, color_g, color_b, opaque, hardness, softness, color_a,
+        aspect_ratio, angle, lock_alpha, colorize, posterize, posterize_num, paint);
 
     // Normal pass
-    gboolean surface_modified = DDI(x, y, angle, 0);
+    if (surface_modified) {
+        const int bbox_index = 0;
+        queue_dab_copies(self, &op, 1, &x, &y, &angle, &bbox_index, NULL);
+    }
 
     int num_bboxes_used = surface_modified ? 1 : 0;
 
@@ -717,38 +1661,59 @@ int draw_dab (MyPaintSurface *surface, float x, float y,
     // OPTIMIZATION: skip the symmetry pass if surface was not modified by the initial dab;
     // at current if the initial dab does not modify the surface, none of the symmetry dabs
     // will either. If/when selection masks are added, this optimization _must_ be removed,
-    // and `surface_modified` must be or'ed with the result of each call to draw_dab_internal.
+    // and the validity of each copy must be checked separately.
     MyPaintSymmetryData *symm_data = &self->symmetry_data;
     if (surface_modified && symm_data->active && symm_data->num_symmetry_matrices) {
         const MyPaintSymmetryState symm = symm_data->state_current;
         const int num_bboxes = self->num_bboxes;
         const float rot_angle = 360.0 / symm.num_lines;
         const MyPaintTransform* const matrices = symm_data->symmetry_matrices;
-        float x_out, y_out;
+
+        // Reflections across tile aligned axes reuse the mask of the dab
+        int mirror_tiles_x, mirror_tiles_y;
+        const int mirror = symmetry_mirror(self, &mirror_tiles_x, &mirror_tiles_y);
+        int mirrors[DAB_COPIES_MAX];
+
+        // The copies are transformed and queued in batches
+        float x_out[DAB_COPIES_MAX];
+        float y_out[DAB_COPIES_MAX];
+        float angles[DAB_COPIES_MAX];
+        int bbox_indices[DAB_COPIES_MAX];
 
         switch (symm.type) {
         case MYPAINT_SYMMETRY_TYPE_VERTICAL: {
-            mypaint_transform_point(&matrices[0], x, y, &x_out, &y_out);
-            DDI(x_out, y_out, -2.0 * (90 + symm.angle) - angle, 1);
+            mypaint_transform_points(&matrices[0], 1, x, y, x_out, y_out);
+            angles[0] = -2.0 * (90 + symm.angle) - angle;
+            bbox_indices[0] = 1;
+            mirrors[0] = mirror;
+            queue_dab_copies(self, &op, 1, x_out, y_out, angles, bbox_indices, mirrors);
             num_bboxes_used = 2;
             break;
         }
         case MYPAINT_SYMMETRY_TYPE_HORIZONTAL: {
-            mypaint_transform_point(&matrices[0], x, y, &x_out, &y_out);
-            DDI(x_out, y_out, -2.0 * symm.angle - angle, 1);
+            mypaint_transform_points(&matrices[0], 1, x, y, x_out, y_out);
+            angles[0] = -2.0 * symm.angle - angle;
+            bbox_indices[0] = 1;
+            mirrors[0] = mirror;
+            queue_dab_copies(self, &op, 1, x_out, y_out, angles, bbox_indices, mirrors);
             num_bboxes_used = 2;
             break;
         }
         case MYPAINT_SYMMETRY_TYPE_VERTHORZ: {
+            mypaint_transform_points(&matrices[0], 3, x, y, x_out, y_out);
             // Reflect across horizontal line
-            mypaint_transform_point(&matrices[0], x, y, &x_out, &y_out);
-            DDI(x_out, y_out, -2.0 * symm.angle - angle, 1);
+            angles[0] = -2.0 * symm.angle - angle;
             // Then across the vertical line (diagonal)
-            mypaint_transform_point(&matrices[1], x, y, &x_out, &y_out);
-            DDI(x_out, y_out, angle, 2);
+            angles[1] = angle;
             // Then back across the horizontal line
-            mypaint_transform_point(&matrices[2], x, y, &x_out, &y_out);
-            DDI(x_out, y_out, -2.0 * symm.angle - angle, 3);
+            angles[2] = -2.0 * symm.angle - angle;
+            for (int i = 0; i < 3; i++) {
+                bbox_indices[i] = i + 1;
+            }
+            mirrors[0] = mirror & DAB_MIRROR_Y;
+            mirrors[1] = mirror;
+            mirrors[2] = mirror & DAB_MIRROR_X;
+            queue_dab_copies(self, &op, 3, x_out, y_out, angles, bbox_indices, mirrors);
             num_bboxes_used = 4;
             break;
         }
@@ -760,12 +1725,17 @@ int draw_dab (MyPaintSurface *surface, float x, float y,
             const int base_idx = symm.num_lines - 1;
             const float base_angle = -2 * symm.angle - angle;
             // draw snowflake dabs for _all_ symmetry lines as we need to reflect the initial dab.
-            for (int dab_count = 0; dab_count < symm.num_lines; dab_count++) {
-                // If the number of bboxes cannot fit all snowflake dabs, use half for the rotational dabs
-                // and the other half for the reflected dabs. This is not always optimal, but seldom bad.
-                const int bbox_idx = offset + MIN(roundf(dab_count / dabs_per_bbox), num_bboxes - 1);
-                mypaint_transform_point(&matrices[base_idx + dab_count], x, y, &x_out, &y_out);
-                DDI(x_out, y_out, base_angle - dab_count * rot_angle, bbox_idx);
+            for (int first = 0; first < symm.num_lines; first += DAB_COPIES_MAX) {
+                const int n = MIN(DAB_COPIES_MAX, symm.num_lines - first);
+                mypaint_transform_points(&matrices[base_idx + first], n, x, y, x_out, y_out);
+                for (int i = 0; i < n; i++) {
+                    const int dab_count = first + i;
+                    // If the number of bboxes cannot fit all snowflake dabs, use half for the rotational dabs
+                    // and the other half for the reflected dabs. This is not always optimal, but seldom bad.
+                    bbox_indices[i] = offset + MIN(roundf(dab_count / dabs_per_bbox), num_bboxes - 1);
+                    angles[i] = base_angle - dab_count * rot_angle;
+                }
+                queue_dab_copies(self, &op, n, x_out, y_out, angles, bbox_indices, NULL);
             }
             num_bboxes_used = MIN(self->num_bboxes, symm.num_lines * 2);
             // fall through to rotational to finish the process
@@ -779,10 +1749,15 @@ int draw_dab (MyPaintSurface *surface, float x, float y,
             float dabs_per_bbox = MAX(1, (float)(symm.num_lines * (snowflake ? 2 : 1)) / num_bboxes);
 
             // draw self->rot_symmetry_lines - 1 rotational dabs since initial pass handles the first dab
-            for (int dab_count = 1; dab_count < symm.num_lines; dab_count++) {
-                const int bbox_index = MIN(roundf(dab_count / dabs_per_bbox), num_bboxes - 1);
-                mypaint_transform_point(&matrices[dab_count - 1], x, y, &x_out, &y_out);
-                DDI(x_out, y_out, angle - dab_count * rot_angle, bbox_index);
+            for (int first = 1; first < symm.num_lines; first += DAB_COPIES_MAX) {
+                const int n = MIN(DAB_COPIES_MAX, symm.num_lines - first);
+                mypaint_transform_points(&matrices[first - 1], n, x, y, x_out, y_out);
+                for (int i = 0; i < n; i++) {
+                    const int dab_count = first + i;
+                    bbox_indices[i] = MIN(roundf(dab_count / dabs_per_bbox), num_bboxes - 1);
+                    angles[i] = angle - dab_count * rot_angle;
+                }
+                queue_dab_copies(self, &op, n, x_out, y_out, angles, bbox_indices, NULL);
             }
 
             // Use existing (larger) number of bboxes if it was set (in a snowflake pass)
@@ -796,10 +1771,30 @@ int draw_dab (MyPaintSurface *surface, float x, float y,
     }
     self->num_bboxes_dirtied = MIN(self->num_bboxes, num_bboxes_used);
     return surface_modified;
-#undef DDI
 }
 
 
+// Seed for the random pixel sampling of one tile, so that the sampled
+// pixels only depend on the dab and the tile
+static uint32_t
+sample_seed(float x, float y, float radius, int tx, int ty)
+{
+    uint32_t bits[3];
+    const float values[3] = {x, y, radius};
+    memcpy(bits, values, sizeof(bits));
+
+    uint32_t h = 2166136261u;
+    const uint32_t words[5] = {bits[0], bits[1], bits[2], (uint32_t)tx, (uint32_t)ty};
+    for (int i = 0; i < 5; i++) {
+        h = (h ^ words[i]) * 16777619u;
+    }
+    // Final avalanche, since the LCG low bits are weak
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
 void get_color (MyPaintSurface *surface, float x, float y,
                   float radius,
                   float * color_r, float * color_g, float * color_b, float * color_a,
@@ -807,6 +1802,7 @@ void get_color (MyPaintSurface *surface, float x, float y,
                   )
 {
     MyPaintTiledSurface *self = (MyPaintTiledSurface *)surface;
+    TRACE_BEGIN(span);
 
     if (radius < 1.0f) radius = 1.0f;
     const float hardness = 0.5f;
@@ -855,7 +1851,9 @@ void get_color (MyPaintSurface *surface, float x, float y,
     const int sample_interval = radius <= 2.0f ? 1 : (int)(radius * 7);
     const float random_sample_rate = 1.0f / (7 * radius);
 
-    #pragma omp parallel for schedule(static) if(self->threadsafe_tile_requests && tiles_n > 3)
+    // The accumulation order matters, so only sample in parallel when
+    // results may differ between runs
+    #pragma omp parallel for schedule(static) if(self->threadsafe_tile_requests && !self->deterministic && tiles_n > 3)
     for (int ty = ty1; ty <= ty2; ty++) {
       for (int tx = tx1; tx <= tx2; tx++) {
 
@@ -890,7 +1888,7 @@ void get_color (MyPaintSurface *surface, float x, float y,
         {
         get_color_pixels_accumulate (
           mask, rgba_p, &sum_weight, &sum_r, &sum_g, &sum_b, &sum_a, paint,
-          sample_interval, random_sample_rate);
+          sample_interval, random_sample_rate, sample_seed(x, y, radius, tx, ty));
         }
 
         mypaint_tiled_surface_tile_request_end(self, &request_data);
@@ -923,6 +1921,92 @@ void get_color (MyPaintSurface *surface, float x, float y,
       *color_g = 1.0f;
       *color_b = 0.0f;
     }
+    TRACE_ARG(span, 0, (tx2 - tx1 + 1) * (ty2 - ty1 + 1));
+    TRACE_END(span, "get_color", "tiles");
+}
+
+/**
+ * mypaint_tiled_surface_get_alpha: (skip)
+ *
+ * Implementation of #MyPaintSurface::get_alpha vfunc.
+ * Only accumulates the mask-weighted alpha, in integers, so the result
+ * does not depend on the thread count. Only the pending operations of the
+ * covered tiles are processed.
+ * Application code should only use mypaint_surface_get_alpha().
+ */
+float
+mypaint_tiled_surface_get_alpha (MyPaintTiledSurface *self, float x, float y, float radius)
+{
+    TRACE_BEGIN(span);
+
+    if (radius < 1.0f) radius = 1.0f;
+    const float hardness = 0.5f;
+    const float softness = 0.5f;
+    const float aspect_ratio = 1.0f;
+    const float angle = 0.0f;
+
+    // Same area as get_color
+    float r_fringe = radius + 1.0f;
+
+    int tx1 = floor(floor(x - r_fringe) / MYPAINT_TILE_SIZE);
+    int tx2 = floor(floor(x + r_fringe) / MYPAINT_TILE_SIZE);
+    int ty1 = floor(floor(y - r_fringe) / MYPAINT_TILE_SIZE);
+    int ty2 = floor(floor(y + r_fringe) / MYPAINT_TILE_SIZE);
+    #ifdef _OPENMP
+    int tiles_n = (tx2 - tx1 + 1) * (ty2 - ty1 + 1);
+    #endif
+
+    uint64_t sum_weight = 0;
+    uint64_t sum_alpha = 0;
+
+    #pragma omp parallel for schedule(static) reduction(+:sum_weight,sum_alpha) if(self->threadsafe_tile_requests && tiles_n > 3)
+    for (int ty = ty1; ty <= ty2; ty++) {
+      for (int tx = tx1; tx <= tx2; tx++) {
+
+        // Flush queued draw_dab operations
+        process_tile(self, tx, ty);
+
+        MyPaintTileRequest request_data;
+        const int mipmap_level = 0;
+        mypaint_tile_request_init(&request_data, mipmap_level, tx, ty, TRUE);
+
+        mypaint_tiled_surface_tile_request_start(self, &request_data);
+        uint16_t * rgba_p = request_data.buffer;
+        if (!rgba_p) {
+          printf("Warning: Unable to get tile!\n");
+          break;
+        }
+
+        uint16_t mask[MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE+2*MYPAINT_TILE_SIZE];
+
+        render_dab_mask(mask,
+                        x - tx*MYPAINT_TILE_SIZE,
+                        y - ty*MYPAINT_TILE_SIZE,
+                        radius,
+                        hardness,
+                        softness,
+                        aspect_ratio, angle
+                        );
+
+        get_alpha_pixels_accumulate(mask, rgba_p, &sum_weight, &sum_alpha);
+
+        mypaint_tiled_surface_tile_request_end(self, &request_data);
+      }
+    }
+
+    float alpha = 0.0f;
+    if (sum_weight > 0) {
+      alpha = CLAMP((double)sum_alpha / sum_weight / (1 << 15), 0.0f, 1.0f);
+    }
+    TRACE_ARG(span, 0, (tx2 - tx1 + 1) * (ty2 - ty1 + 1));
+    TRACE_END(span, "get_alpha", "tiles");
+    return alpha;
+}
+
+static float
+get_alpha(MyPaintSurface *surface, float x, float y, float radius)
+{
+    return mypaint_tiled_surface_get_alpha((MyPaintTiledSurface *)surface, x, y, radius);
 }
 
 /**
@@ -939,14 +2023,23 @@ mypaint_tiled_surface_init(MyPaintTiledSurface *self,
     mypaint_surface_init(&self->parent);
     self->parent.draw_dab = draw_dab;
     self->parent.get_color = get_color;
+    self->parent.get_alpha = get_alpha;
     self->parent.begin_atomic = begin_atomic_default;
     self->parent.end_atomic = end_atomic_default;
 
     self->tile_request_end = tile_request_end;
     self->tile_request_start = tile_request_start;
+    self->tile_requests_start = NULL;
+    self->tile_requests_end = NULL;
+    self->stats = NULL;
+    self->queue_budget_bytes = 0;
+    self->queue_budget_ops = 0;
 
     self->tile_size = MYPAINT_TILE_SIZE;
     self->threadsafe_tile_requests = FALSE;
+    self->spectral_cache = NULL;
+    self->deterministic = FALSE;
+    self->mirrored_symmetry = FALSE;
 
     self->num_bboxes = NUM_BBOXES_DEFAULT;
     self->bboxes = self->default_bboxes;
@@ -967,6 +2060,10 @@ void
 mypaint_tiled_surface_destroy(MyPaintTiledSurface *self)
 {
     operation_queue_free(self->operation_queue);
+    free(self->stats);
+    if (self->spectral_cache) {
+        spectral_cache_free(self->spectral_cache);
+    }
     if (self->bboxes != self->default_bboxes) {
       free(self->bboxes);
     }
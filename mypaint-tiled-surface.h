@@ -2,6 +2,7 @@
 #define MYPAINTTILEDSURFACE_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include "mypaint-surface.h"
 #include "mypaint-symmetry.h"
 #include "mypaint-config.h"
@@ -28,15 +29,88 @@ mypaint_tile_request_init(MyPaintTileRequest *data, int level,
 
 typedef void (*MyPaintTileRequestStartFunction) (MyPaintTiledSurface *self, MyPaintTileRequest *request);
 typedef void (*MyPaintTileRequestEndFunction) (MyPaintTiledSurface *self, MyPaintTileRequest *request);
+typedef void (*MyPaintTileRequestsStartFunction) (MyPaintTiledSurface *self, MyPaintTileRequest *requests, int requests_n);
+typedef void (*MyPaintTileRequestsEndFunction) (MyPaintTiledSurface *self, MyPaintTileRequest *requests, int requests_n);
 typedef void (*MyPaintTiledSurfaceAreaChanged) (MyPaintTiledSurface *self, int bb_x, int bb_y, int bb_w, int bb_h);
 
 
+/**
+ * MyPaintBlendMode:
+ *
+ * The blend kernels a dab can be drawn with, as counted in #MyPaintTiledSurfaceStats.
+ */
+typedef enum {
+    MYPAINT_BLEND_MODE_NORMAL,
+    MYPAINT_BLEND_MODE_NORMAL_AND_ERASER,
+    MYPAINT_BLEND_MODE_LOCK_ALPHA,
+    MYPAINT_BLEND_MODE_NORMAL_PAINT,
+    MYPAINT_BLEND_MODE_NORMAL_AND_ERASER_PAINT,
+    MYPAINT_BLEND_MODE_LOCK_ALPHA_PAINT,
+    MYPAINT_BLEND_MODE_COLOR,
+    MYPAINT_BLEND_MODE_POSTERIZE,
+    MYPAINT_BLEND_MODES_COUNT
+} MyPaintBlendMode;
+
+/**
+ * MyPaintTiledSurfaceStats:
+ * @dabs_queued: Dabs that changed the surface, symmetry dabs included
+ * @ops_queued: Dab operations queued, one per dab and tile it touches
+ * @ops_processed: Dab operations applied to tiles
+ * @tiles_processed: Tiles that dab operations were applied to
+ * @mask_renders: Dab masks rendered
+ * @blend_calls: Blend kernel invocations, indexed by #MyPaintBlendMode
+ * @tile_requests: Tile requests started, including bulk requests
+ * @queue_ns: Time spent queueing dab operations
+ * @mask_ns: Time spent rendering dab masks, summed over all threads
+ * @blend_ns: Time spent in blend kernels, summed over all threads
+ * @tile_io_ns: Time spent starting and ending tile requests, summed over all threads
+ * @forced_flushes: Times the operation queue exceeded its budget during a transaction
+ * @forced_flush_tiles: Tiles processed early because the queue exceeded its budget
+ * @ops_elided: Processed dab operations that were skipped, mask included, because
+ *   they cannot change an empty tile, or have no blend mode to apply
+ * @blends_elided: Blend kernel invocations skipped on empty tiles, not counted in @blend_calls
+ * @tile_scans: Tiles inspected for emptiness before applying their operations
+ * @masks_reused: Dab masks flipped or copied from an already rendered one instead of
+ *   being rendered, not counted in @mask_renders
+ *
+ * Counters collected by a #MyPaintTiledSurface while statistics are enabled,
+ * see mypaint_tiled_surface_set_stats_enabled().
+ */
+typedef struct {
+    uint64_t dabs_queued;
+    uint64_t ops_queued;
+    uint64_t ops_processed;
+    uint64_t tiles_processed;
+    uint64_t mask_renders;
+    uint64_t blend_calls[MYPAINT_BLEND_MODES_COUNT];
+    uint64_t tile_requests;
+    uint64_t queue_ns;
+    uint64_t mask_ns;
+    uint64_t blend_ns;
+    uint64_t tile_io_ns;
+    uint64_t forced_flushes;
+    uint64_t forced_flush_tiles;
+    uint64_t ops_elided;
+    uint64_t blends_elided;
+    uint64_t tile_scans;
+    uint64_t masks_reused;
+} MyPaintTiledSurfaceStats;
+
 /**
   * MyPaintTiledSurface:
   *
   * Interface and convenience class for implementing a #MyPaintSurface backed by a tile store.
   *
   * The size of the surface is infinite, and consumers need just implement two vfuncs.
+  *
+  * Subclasses may also set tile_requests_start and tile_requests_end, to start and end
+  * the requests for the tiles changed in a transaction in batches of up to a few dozen
+  * tiles. end_atomic then processes the tiles of a batch without any other calls into
+  * the subclass, in parallel if threadsafe_tile_requests is set. Both are NULL by default.
+  *
+  * The fields after tile_size were appended in libmypaint 2.0, which changes the size of
+  * the struct: subclasses built against older headers must be rebuilt. They are set up
+  * by mypaint_tiled_surface_init().
   */
 struct MyPaintTiledSurface {
     MyPaintSurface parent;
@@ -51,6 +125,14 @@ struct MyPaintTiledSurface {
     MyPaintRectangle default_bboxes[NUM_BBOXES_DEFAULT];
     gboolean threadsafe_tile_requests;
     int tile_size;
+    struct SpectralCache *spectral_cache;
+    gboolean deterministic;
+    MyPaintTileRequestsStartFunction tile_requests_start;
+    MyPaintTileRequestsEndFunction tile_requests_end;
+    MyPaintTiledSurfaceStats *stats; // NULL unless statistics are enabled
+    size_t queue_budget_bytes; // 0 for no limit
+    size_t queue_budget_ops; // 0 for no limit
+    gboolean mirrored_symmetry;
 };
 
 void
@@ -67,6 +149,27 @@ mypaint_tiled_surface_set_symmetry_state(MyPaintTiledSurface *self, gboolean act
                                          float symmetry_angle,
                                          MyPaintSymmetryType symmetry_type,
                                          int rot_symmetry_lines);
+void
+mypaint_tiled_surface_set_spectral_cache_budget(MyPaintTiledSurface *self, size_t budget);
+
+void
+mypaint_tiled_surface_set_deterministic(MyPaintTiledSurface *self, gboolean deterministic);
+
+void
+mypaint_tiled_surface_set_queue_budget(MyPaintTiledSurface *self, size_t max_bytes, size_t max_ops);
+
+void
+mypaint_tiled_surface_set_mirrored_symmetry(MyPaintTiledSurface *self, gboolean mirrored);
+
+void
+mypaint_tiled_surface_set_stats_enabled(MyPaintTiledSurface *self, gboolean enabled);
+
+void
+mypaint_tiled_surface_get_stats(MyPaintTiledSurface *self, MyPaintTiledSurfaceStats *stats);
+
+void
+mypaint_tiled_surface_reset_stats(MyPaintTiledSurface *self);
+
 float
 mypaint_tiled_surface_get_alpha (MyPaintTiledSurface *self, float x, float y, float radius);
 
@@ -0,0 +1,218 @@
+/* libmypaint - The MyPaint Brush Library
+ * Copyright (C) 2019 The MyPaint Team
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include "mypaint-tracing.h"
+#include "tracing.h"
+#include "helpers.h"
+
+#ifdef HAVE_TRACING
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+typedef struct {
+    const char *name;
+    const char *arg_names[TRACE_ARGS_MAX];
+    int args[TRACE_ARGS_MAX];
+    int thread;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+} TraceRecord;
+
+static TraceRecord *records = NULL;
+static uint64_t records_capacity = 0;
+// Total number of spans recorded since the start, including overwritten ones
+static uint64_t records_written = 0;
+static int tracing_active = FALSE;
+
+TraceSpan
+tracing_span_begin(void)
+{
+    TraceSpan span = {0};
+    if (tracing_active) {
+        span.start_ns = monotonic_time_ns();
+    }
+    return span;
+}
+
+// The variadic arguments are the argument names, terminated by NULL
+void
+tracing_span_end(const TraceSpan *span, const char *name, ...)
+{
+    if (!span->start_ns || !tracing_active) {
+        return;
+    }
+    const uint64_t end_ns = monotonic_time_ns();
+
+    uint64_t index;
+    #pragma omp atomic capture
+    index = records_written++;
+
+    TraceRecord *record = &records[index % records_capacity];
+    record->name = name;
+    record->start_ns = span->start_ns;
+    record->duration_ns = end_ns - span->start_ns;
+#ifdef _OPENMP
+    record->thread = omp_get_thread_num();
+#else
+    record->thread = 0;
+#endif
+
+    va_list names;
+    va_start(names, name);
+    int i = 0;
+    for (const char *arg_name = va_arg(names, const char *); arg_name && i < TRACE_ARGS_MAX;
+         arg_name = va_arg(names, const char *), i++) {
+        record->arg_names[i] = arg_name;
+        record->args[i] = span->args[i];
+    }
+    for (; i < TRACE_ARGS_MAX; i++) {
+        record->arg_names[i] = NULL;
+    }
+    va_end(names);
+}
+
+/**
+ * mypaint_tracing_start:
+ * @capacity: Number of spans to keep. Once full, the oldest spans are overwritten.
+ *
+ * Start recording timed spans of the stroke and tile processing phases into
+ * an in-memory ring buffer. Any spans recorded earlier are discarded.
+ * Spans are recorded without locking, so this must not be called while
+ * painting: the ring buffer is replaced, and a span ending at the same
+ * time could be written to the freed one. Call it between strokes, before
+ * begin_atomic or after end_atomic.
+ * Tracing is only available when libmypaint is configured with --enable-tracing,
+ * otherwise the instrumentation is compiled out and nothing is recorded.
+ *
+ * Returns: TRUE if tracing was started, FALSE if not built with tracing support.
+ */
+gboolean
+mypaint_tracing_start(int capacity)
+{
+    tracing_active = FALSE;
+    free(records);
+    records = (TraceRecord *)malloc(MAX(1, capacity) * sizeof(TraceRecord));
+    if (!records) {
+        records_capacity = 0;
+        return FALSE;
+    }
+    records_capacity = MAX(1, capacity);
+    records_written = 0;
+    tracing_active = TRUE;
+    return TRUE;
+}
+
+/**
+ * mypaint_tracing_stop:
+ *
+ * Stop recording spans. The recorded spans are kept until the next
+ * mypaint_tracing_start() call.
+ */
+void
+mypaint_tracing_stop(void)
+{
+    tracing_active = FALSE;
+}
+
+/**
+ * mypaint_tracing_get_span_count:
+ *
+ * Returns: the number of spans currently held in the ring buffer.
+ */
+int
+mypaint_tracing_get_span_count(void)
+{
+    return (int)MIN(records_written, records_capacity);
+}
+
+/**
+ * mypaint_tracing_write:
+ * @filename: File to write to
+ *
+ * Write the recorded spans in the Chrome trace event format, which can be
+ * loaded in chrome://tracing or Perfetto. Must not be called while painting.
+ *
+ * Returns: TRUE on success, FALSE if the file could not be written or tracing
+ * is not supported.
+ */
+gboolean
+mypaint_tracing_write(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        return FALSE;
+    }
+
+    const uint64_t count = MIN(records_written, records_capacity);
+    const uint64_t first = records_written - count;
+    // Timestamps are relative to the oldest span, in microseconds
+    uint64_t origin_ns = UINT64_MAX;
+    for (uint64_t i = first; i < records_written; i++) {
+        origin_ns = MIN(origin_ns, records[i % records_capacity].start_ns);
+    }
+
+    fprintf(file, "{\"traceEvents\":[");
+    for (uint64_t i = first; i < records_written; i++) {
+        const TraceRecord *record = &records[i % records_capacity];
+        fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"mypaint\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                i == first ? "" : ",", record->name, record->thread,
+                (record->start_ns - origin_ns) / 1000.0, record->duration_ns / 1000.0);
+        for (int a = 0; a < TRACE_ARGS_MAX && record->arg_names[a]; a++) {
+            fprintf(file, "%s\"%s\":%d", a == 0 ? "" : ",", record->arg_names[a], record->args[a]);
+        }
+        fprintf(file, "}}");
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    const int failed = ferror(file);
+    return fclose(file) == 0 && !failed;
+}
+
+#else // not HAVE_TRACING
+
+gboolean
+mypaint_tracing_start(int capacity)
+{
+    return FALSE;
+}
+
+void
+mypaint_tracing_stop(void)
+{
+}
+
+int
+mypaint_tracing_get_span_count(void)
+{
+    return 0;
+}
+
+gboolean
+mypaint_tracing_write(const char *filename)
+{
+    return FALSE;
+}
+
+#endif // HAVE_TRACING
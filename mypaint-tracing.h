@@ -0,0 +1,29 @@
+#ifndef MYPAINTTRACING_H
+#define MYPAINTTRACING_H
+
+#include "mypaint-config.h"
+#include "mypaint-glib-compat.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Recording of timed spans of the stroke and tile processing phases, for
+ * diagnosing frame time spikes. Only available when configured with
+ * --enable-tracing; otherwise the functions do nothing.
+ */
+
+gboolean
+mypaint_tracing_start(int capacity);
+
+void
+mypaint_tracing_stop(void);
+
+int
+mypaint_tracing_get_span_count(void);
+
+gboolean
+mypaint_tracing_write(const char *filename);
+
+G_END_DECLS
+
+#endif // MYPAINTTRACING_H
@@ -26,29 +26,42 @@
 #endif
 
 #include "operationqueue.h"
-#include "fifo.h"
+
+// Smallest number of dabs allocated for the dab table
+#define DAB_TABLE_MIN 64
+// Larger dab tables are released once they are emptied
+#define DAB_TABLE_KEEP 4096
+
+// Indices into the dab table of the operations queued for one tile,
+// in the order they were added. Entries before @first are already popped.
+typedef struct {
+    uint32_t *dabs;
+    int first;
+    int n;
+    int capacity;
+} TileQueue;
 
 struct OperationQueue {
     TileMap *tile_map;
 
     TileIndex *dirty_tiles;
     int dirty_tiles_n;
-};
-
-/* For use with queue_delete */
-void
-operation_delete_func(void *user_data) {
-    if (user_data) {
-        free(user_data);
-    }
-}
 
+    // Every dab is stored once, and referenced from the queues of all the
+    // tiles it touches. The table is emptied when no queue references it.
+    OperationDataDrawDab *dabs;
+    uint32_t *dab_refs; // number of tile queues referencing each dab
+    uint32_t dabs_n;
+    uint32_t dabs_capacity;
+    int64_t refs_pending;
+};
 
 void
-free_fifo(void *item) {
-    Fifo *op_queue = item;
-    if (op_queue) {
-        fifo_free(op_queue, operation_delete_func);
+free_tile_queue(void *item) {
+    TileQueue *queue = item;
+    if (queue) {
+        free(queue->dabs);
+        free(queue);
     }
 }
 
@@ -67,7 +80,7 @@ operation_queue_resize(OperationQueue *self, int new_size)
         }
         return TRUE;
     } else {
-        TileMap *new_tile_map = tile_map_new(new_size, sizeof(Fifo *), free_fifo);
+        TileMap *new_tile_map = tile_map_new(new_size, sizeof(TileQueue *), free_tile_queue);
         const int new_map_size = new_size*2*new_size*2;
         TileIndex *new_dirty_tiles = (TileIndex *)malloc(new_map_size*sizeof(TileIndex));
 
@@ -96,6 +109,11 @@ operation_queue_new(void)
     self->tile_map = NULL;
     self->dirty_tiles_n = 0;
     self->dirty_tiles = NULL;
+    self->dabs = NULL;
+    self->dab_refs = NULL;
+    self->dabs_n = 0;
+    self->dabs_capacity = 0;
+    self->refs_pending = 0;
 
 #ifdef HEAVY_DEBUG
     operation_queue_resize(self, 1);
@@ -111,6 +129,8 @@ operation_queue_free(OperationQueue *self)
 {
     operation_queue_resize(self, 0); // free the tile map data
 
+    free(self->dabs);
+    free(self->dab_refs);
     free(self);
 }
 
@@ -167,15 +187,55 @@ operation_queue_clear_dirty_tiles(OperationQueue *self)
 {
     // operation_queue_add will overwrite the invalid tiles as new dirty tiles comes in
     self->dirty_tiles_n = 0;
+
+    if (self->refs_pending == 0) {
+        self->dabs_n = 0;
+        if (self->dabs_capacity > DAB_TABLE_KEEP) {
+            free(self->dabs);
+            free(self->dab_refs);
+            self->dabs = NULL;
+            self->dab_refs = NULL;
+            self->dabs_capacity = 0;
+        }
+    }
+}
+
+/* Reserve @n consecutive entries in the dab table, for the caller to fill
+ * in. Each of them is referenced by operation_queue_add() for every tile
+ * that the dab touches.
+ * Returns: the first of the entries, and its index in the table in @first_out
+ *
+ * Concurrency: This function is not thread-safe on the same @self instance. */
+OperationDataDrawDab *
+operation_queue_add_dabs(OperationQueue *self, uint32_t n, uint32_t *first_out)
+{
+    if (self->dabs_n + n > self->dabs_capacity) {
+        uint32_t new_capacity = self->dabs_capacity ? self->dabs_capacity * 2 : DAB_TABLE_MIN;
+        while (new_capacity < self->dabs_n + n) {
+            new_capacity *= 2;
+        }
+        self->dabs = (OperationDataDrawDab *)realloc(self->dabs, new_capacity * sizeof(OperationDataDrawDab));
+        self->dab_refs = (uint32_t *)realloc(self->dab_refs, new_capacity * sizeof(uint32_t));
+        assert(self->dabs && self->dab_refs);
+        self->dabs_capacity = new_capacity;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        self->dab_refs[self->dabs_n + i] = 0;
+    }
+    *first_out = self->dabs_n;
+    self->dabs_n += n;
+    return &self->dabs[*first_out];
 }
 
-/* Add an operation to the queue for tile @index
+/* Queue the dab with index @dab in the dab table for tile @index
  * Note: if an operation affects more than one tile, it must be added once per tile.
  *
  * Concurrency: This function is not thread-safe on the same @self instance. */
 void
-operation_queue_add(OperationQueue *self, TileIndex index, OperationDataDrawDab *op)
+operation_queue_add(OperationQueue *self, TileIndex index, uint32_t dab)
 {
+    assert(dab < self->dabs_n);
+
     while (!tile_map_contains(self->tile_map, index)) {
 #ifdef HEAVY_DEBUG
         operation_queue_resize(self, self->tile_map->size+1);
@@ -184,16 +244,19 @@ operation_queue_add(OperationQueue *self, TileIndex index, OperationDataDrawDab
 #endif
     }
 
-    Fifo **queue_pointer = (Fifo **)tile_map_get(self->tile_map, index);
-    Fifo *op_queue = *queue_pointer;
+    TileQueue **queue_pointer = (TileQueue **)tile_map_get(self->tile_map, index);
+    TileQueue *op_queue = *queue_pointer;
 
     if (op_queue == NULL) {
         // Lazy initialization
-        op_queue = fifo_new();
+        op_queue = (TileQueue *)calloc(1, sizeof(TileQueue));
         *queue_pointer = op_queue;
     }
 
-    if (fifo_peek_first(op_queue) == NULL) {
+    if (op_queue->first == op_queue->n) {
+        // Reuse the entries of the popped operations
+        op_queue->first = op_queue->n = 0;
+
         // Critical section, not thread-safe
        if (!(self->dirty_tiles_n < self->tile_map->size*2*self->tile_map->size*2)) {
            // Prune duplicate tiles that cause us to almost exceed max
@@ -202,36 +265,61 @@ operation_queue_add(OperationQueue *self, TileIndex index, OperationDataDrawDab
        assert(self->dirty_tiles_n < self->tile_map->size*2*self->tile_map->size*2);
        self->dirty_tiles[self->dirty_tiles_n++] = index;
     }
-    fifo_push(op_queue, (void *)op);
+
+    if (op_queue->n == op_queue->capacity) {
+        op_queue->capacity = op_queue->capacity ? op_queue->capacity * 2 : 4;
+        op_queue->dabs = (uint32_t *)realloc(op_queue->dabs, op_queue->capacity * sizeof(uint32_t));
+        assert(op_queue->dabs);
+    }
+    op_queue->dabs[op_queue->n++] = dab;
+    self->dab_refs[dab]++;
+    self->refs_pending++;
 }
 
 /* Pop an operation off the queue for tile @index
- * The user of this function is responsible for freeing the result using free()
+ * The result is owned by the queue, and stays valid until the next call
+ * to operation_queue_add_dabs().
  *
  * Concurrency: This function is reentrant (and lock-free) on different @index */
 OperationDataDrawDab *
 operation_queue_pop(OperationQueue *self, TileIndex index)
 {
-    OperationDataDrawDab *op = NULL;
-
     if (!tile_map_contains(self->tile_map, index)) {
         return NULL;
     }
 
-    Fifo **queue_pointer = (Fifo **)tile_map_get(self->tile_map, index);
-    Fifo *op_queue = *queue_pointer;
+    TileQueue **queue_pointer = (TileQueue **)tile_map_get(self->tile_map, index);
+    TileQueue *op_queue = *queue_pointer;
 
     if (!op_queue) {
         return NULL;
     }
 
-    op = (OperationDataDrawDab *)fifo_pop(op_queue);
-    if (!op) {
+    if (op_queue->first == op_queue->n) {
         // Queue empty
-        fifo_free(op_queue, operation_delete_func);
+        free_tile_queue(op_queue);
         *queue_pointer = NULL;
+        return NULL;
+    }
+
+    const uint32_t dab = op_queue->dabs[op_queue->first++];
+    #pragma omp atomic
+    self->dab_refs[dab]--;
+    #pragma omp atomic
+    self->refs_pending--;
+    return &self->dabs[dab];
+}
+
+/* Drop the operations queued for tile @index without applying them, for
+ * tiles that could not be requested. Releases their references to the dab
+ * table, which can then be emptied at the end of the transaction.
+ *
+ * Concurrency: This function is reentrant (and lock-free) on different @index */
+void
+operation_queue_discard(OperationQueue *self, TileIndex index)
+{
+    while (operation_queue_pop(self, index)) {
     }
-    return op;
 }
 
 OperationDataDrawDab *
@@ -240,8 +328,8 @@ operation_queue_peek_first(OperationQueue *self, TileIndex index) {
         return NULL;
     }
 
-    Fifo *op_queue = (Fifo *)*tile_map_get(self->tile_map, index);
-    return (!op_queue) ? NULL : (OperationDataDrawDab *)fifo_peek_first(op_queue);
+    TileQueue *op_queue = (TileQueue *)*tile_map_get(self->tile_map, index);
+    return (!op_queue || op_queue->first == op_queue->n) ? NULL : &self->dabs[op_queue->dabs[op_queue->first]];
 }
 
 OperationDataDrawDab *
@@ -250,6 +338,86 @@ operation_queue_peek_last(OperationQueue *self, TileIndex index) {
         return NULL;
     }
 
-    Fifo *op_queue = (Fifo *)*tile_map_get(self->tile_map, index);
-    return (!op_queue) ? NULL : (OperationDataDrawDab *)fifo_peek_last(op_queue);
+    TileQueue *op_queue = (TileQueue *)*tile_map_get(self->tile_map, index);
+    return (!op_queue || op_queue->first == op_queue->n) ? NULL : &self->dabs[op_queue->dabs[op_queue->n - 1]];
+}
+
+/* Number of operations queued, counting a dab once for each tile it touches */
+int64_t
+operation_queue_get_queued_ops(OperationQueue *self)
+{
+    return self->refs_pending;
+}
+
+/* Memory held by the queued operations: the dab table, and one
+ * index per queued operation */
+size_t
+operation_queue_get_queued_bytes(OperationQueue *self)
+{
+    return (size_t)self->dabs_n * sizeof(OperationDataDrawDab) + (size_t)self->refs_pending * sizeof(uint32_t);
+}
+
+/* Number of operations queued for tile @index */
+int
+operation_queue_get_tile_ops(OperationQueue *self, TileIndex index)
+{
+    if (!tile_map_contains(self->tile_map, index)) {
+        return 0;
+    }
+
+    TileQueue *op_queue = (TileQueue *)*tile_map_get(self->tile_map, index);
+    return op_queue ? op_queue->n - op_queue->first : 0;
+}
+
+/* Drop the dabs that no tile references any more from the dab table, and
+ * the tiles without queued operations from the dirty tiles. For use after
+ * processing some of the dirty tiles before the end of a transaction.
+ *
+ * Concurrency: This function is not thread-safe on the same @self instance. */
+void
+operation_queue_compact(OperationQueue *self)
+{
+    if (self->refs_pending == 0) {
+        self->dabs_n = 0;
+        self->dirty_tiles_n = 0;
+        return;
+    }
+
+    // Move the referenced dabs to the front, keeping their order
+    uint32_t *new_index = (uint32_t *)malloc(self->dabs_n * sizeof(uint32_t));
+    uint32_t live_n = 0;
+    for (uint32_t i = 0; i < self->dabs_n; i++) {
+        if (self->dab_refs[i]) {
+            new_index[i] = live_n;
+            self->dabs[live_n] = self->dabs[i];
+            self->dab_refs[live_n] = self->dab_refs[i];
+            live_n++;
+        }
+    }
+    self->dabs_n = live_n;
+
+    // Every queue is remapped, not only those of the dirty tiles, since
+    // tiles left out of a forced flush keep their operations
+    const int map_size = 2*self->tile_map->size*2*self->tile_map->size;
+    for (int i = 0; i < map_size; i++) {
+        TileQueue *op_queue = (TileQueue *)self->tile_map->map[i];
+        if (!op_queue) {
+            continue;
+        }
+        const int n = op_queue->n - op_queue->first;
+        for (int j = 0; j < n; j++) {
+            op_queue->dabs[j] = new_index[op_queue->dabs[op_queue->first + j]];
+        }
+        op_queue->first = 0;
+        op_queue->n = n;
+    }
+    free(new_index);
+
+    int dirty_n = 0;
+    for (int i = 0; i < self->dirty_tiles_n; i++) {
+        if (operation_queue_get_tile_ops(self, self->dirty_tiles[i]) > 0) {
+            self->dirty_tiles[dirty_n++] = self->dirty_tiles[i];
+        }
+    }
+    self->dirty_tiles_n = remove_duplicate_tiles(self->dirty_tiles, dirty_n);
 }
@@ -2,27 +2,62 @@
 #define OPERATIONQUEUE_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include "tilemap.h"
 
+// Tile independent constants of a dab mask, see dab_geometry_init()
+typedef struct {
+    float radius;
+    float hardness;
+    float aspect_ratio;
+    float cs;
+    float sn;
+    float one_over_radius2;
+    float r_aa_start;
+    float segment1_offset;
+    float segment1_slope;
+    float segment2_offset;
+    float segment2_slope;
+} DabGeometry;
+
+// Reflections of a dab mask, see OperationDataDrawDab
+typedef enum {
+    DAB_MIRROR_NONE = 0,
+    DAB_MIRROR_X = 1 << 0, // across a vertical axis
+    DAB_MIRROR_Y = 1 << 1, // across a horizontal axis
+} DabMirror;
+
 typedef struct {
     float x;
     float y;
     float radius;
+    float angle;
+    // Everything else is computed once per dab by draw_dab_operation_init,
+    // instead of once per tile. Only what the mask and the blend kernels read
+    // is kept, since the dab table holds one of these per queued dab.
+    DabGeometry geometry;
     uint16_t color_r;
     uint16_t color_g;
     uint16_t color_b;
-    float color_a;
-    float opaque;
-    float hardness;
-    float softness;
-    float aspect_ratio;
-    float angle;
-    float normal;
-    float lock_alpha;
-    float colorize;
-    float posterize;
-    float posterize_num;
-    float paint;
+    uint16_t color_a_fix15;
+    uint16_t opa_normal;
+    uint16_t opa_normal_paint;
+    uint16_t opa_lock_alpha;
+    uint16_t opa_lock_alpha_paint;
+    uint16_t opa_colorize;
+    uint16_t opa_posterize;
+    uint16_t posterize_num;
+    // The blend kernels that process_op() runs, as bits 1 << MyPaintBlendMode.
+    // They are applied in the order of the enum.
+    uint16_t blend_modes;
+    // DabMirror flags, set for symmetry copies that are reflections of another
+    // dab across tile aligned axes. x, y and the geometry are then those of the
+    // original, and the mask on a tile is the original's mask on the mirrored
+    // tile, flipped. Mirroring across X maps tile column tx to
+    // mirror_tiles_x - 1 - tx, and likewise for Y.
+    uint16_t mirror;
+    int mirror_tiles_x;
+    int mirror_tiles_y;
 } OperationDataDrawDab;
 
 typedef struct OperationQueue OperationQueue;
@@ -33,8 +68,15 @@ void operation_queue_free(OperationQueue *self);
 int operation_queue_get_dirty_tiles(OperationQueue *self, TileIndex** tiles_out);
 void operation_queue_clear_dirty_tiles(OperationQueue *self);
 
-void operation_queue_add(OperationQueue *self, TileIndex index, OperationDataDrawDab *op);
+OperationDataDrawDab *operation_queue_add_dabs(OperationQueue *self, uint32_t n, uint32_t *first_out);
+void operation_queue_add(OperationQueue *self, TileIndex index, uint32_t dab);
 OperationDataDrawDab *operation_queue_pop(OperationQueue *self, TileIndex index);
+void operation_queue_discard(OperationQueue *self, TileIndex index);
+
+int64_t operation_queue_get_queued_ops(OperationQueue *self);
+size_t operation_queue_get_queued_bytes(OperationQueue *self);
+int operation_queue_get_tile_ops(OperationQueue *self, TileIndex index);
+void operation_queue_compact(OperationQueue *self);
 
 OperationDataDrawDab *operation_queue_peek_first(OperationQueue *self, TileIndex index);
 OperationDataDrawDab *operation_queue_peek_last(OperationQueue *self, TileIndex index);
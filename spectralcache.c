@@ -0,0 +1,160 @@
+/* libmypaint - The MyPaint Brush Library
+ * Copyright (C) 2019 The MyPaint Team
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "spectralcache.h"
+
+// Per-tile side buffers holding the log-spectral representation of the
+// canvas, for the pigment blend modes. Tiles are handed out to one user at
+// a time, and the least recently used ones are recycled once the memory
+// budget is exhausted.
+
+#define SPECTRAL_CACHE_TILE_BYTES (MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * sizeof(SpectralCachePixel))
+
+typedef struct {
+    int tx;
+    int ty;
+    unsigned long last_used;
+    gboolean in_use;
+    SpectralCachePixel *pixels;
+} SpectralCacheEntry;
+
+struct SpectralCache {
+    SpectralCacheEntry *entries;
+    int entries_n;
+    int max_entries;
+    unsigned long clock;
+};
+
+SpectralCache *
+spectral_cache_new(size_t budget)
+{
+    SpectralCache *self = (SpectralCache *)malloc(sizeof(SpectralCache));
+    if (!self) {
+        return NULL;
+    }
+    self->entries = NULL;
+    self->entries_n = 0;
+    self->max_entries = 0;
+    self->clock = 0;
+    spectral_cache_set_budget(self, budget);
+    return self;
+}
+
+static void
+free_entries(SpectralCache *self)
+{
+    for (int i = 0; i < self->entries_n; i++) {
+        assert(!self->entries[i].in_use);
+        free(self->entries[i].pixels);
+    }
+    free(self->entries);
+    self->entries = NULL;
+    self->entries_n = 0;
+}
+
+void
+spectral_cache_free(SpectralCache *self)
+{
+    free_entries(self);
+    free(self);
+}
+
+// Drops all cached tiles. Must not be called while any tile is acquired.
+void
+spectral_cache_set_budget(SpectralCache *self, size_t budget)
+{
+    free_entries(self);
+    self->max_entries = budget / SPECTRAL_CACHE_TILE_BYTES;
+    if (self->max_entries > 0) {
+        self->entries = (SpectralCacheEntry *)malloc(self->max_entries * sizeof(SpectralCacheEntry));
+        if (!self->entries) {
+            self->max_entries = 0;
+        }
+    }
+}
+
+// Returns the cached pixels of tile (tx, ty), or NULL if the tile cannot
+// be cached right now. Newly cached tiles hold no valid pixels.
+// Threadsafe, as long as the same tile is not acquired twice.
+SpectralCachePixel *
+spectral_cache_acquire(SpectralCache *self, int tx, int ty)
+{
+    SpectralCachePixel *pixels = NULL;
+
+    #pragma omp critical (spectral_cache)
+    {
+        SpectralCacheEntry *entry = NULL;
+        SpectralCacheEntry *victim = NULL;
+        gboolean found = FALSE;
+
+        for (int i = 0; i < self->entries_n; i++) {
+            SpectralCacheEntry *e = &self->entries[i];
+            if (e->tx == tx && e->ty == ty) {
+                found = TRUE;
+                entry = e->in_use ? NULL : e;
+                break;
+            }
+            if (!e->in_use && (!victim || e->last_used < victim->last_used)) {
+                victim = e;
+            }
+        }
+
+        if (!found) {
+            if (self->entries_n < self->max_entries) {
+                SpectralCachePixel *new_pixels = (SpectralCachePixel *)malloc(SPECTRAL_CACHE_TILE_BYTES);
+                if (new_pixels) {
+                    entry = &self->entries[self->entries_n++];
+                    entry->pixels = new_pixels;
+                }
+            }
+            if (!entry) {
+                entry = victim;
+            }
+            if (entry) {
+                entry->tx = tx;
+                entry->ty = ty;
+                memset(entry->pixels, 0, SPECTRAL_CACHE_TILE_BYTES);
+            }
+        }
+
+        if (entry) {
+            entry->in_use = TRUE;
+            entry->last_used = ++self->clock;
+            pixels = entry->pixels;
+        }
+    }
+    return pixels;
+}
+
+void
+spectral_cache_release(SpectralCache *self, SpectralCachePixel *pixels)
+{
+    #pragma omp critical (spectral_cache)
+    {
+        for (int i = 0; i < self->entries_n; i++) {
+            if (self->entries[i].pixels == pixels) {
+                self->entries[i].in_use = FALSE;
+                break;
+            }
+        }
+    }
+}
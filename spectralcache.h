@@ -0,0 +1,38 @@
+#ifndef SPECTRALCACHE_H
+#define SPECTRALCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mypaint-config.h"
+
+#if MYPAINT_CONFIG_USE_GLIB
+#include <glib.h>
+#else // not MYPAINT_CONFIG_USE_GLIB
+#include "mypaint-glib-compat.h"
+#endif
+
+G_BEGIN_DECLS
+
+// Log-spectral representation of one canvas pixel, together with the
+// pixel value it describes. The data is only valid while the pixel still
+// has that value; a zero alpha key never matches, since fully transparent
+// pixels are not mixed spectrally.
+typedef struct {
+    uint16_t rgba[4];
+    float log_spectral[10];
+} SpectralCachePixel;
+
+typedef struct SpectralCache SpectralCache;
+
+SpectralCache *spectral_cache_new(size_t budget);
+void spectral_cache_free(SpectralCache *self);
+
+void spectral_cache_set_budget(SpectralCache *self, size_t budget);
+
+SpectralCachePixel *spectral_cache_acquire(SpectralCache *self, int tx, int ty);
+void spectral_cache_release(SpectralCache *self, SpectralCachePixel *pixels);
+
+G_END_DECLS
+
+#endif // SPECTRALCACHE_H
@@ -1,8 +1,11 @@
 
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <mypaint-gegl-surface.h>
 #include "mypaint-test-surface.h"
+#include "testutils.h"
 
 MyPaintSurface *
 gegl_surface_factory(gpointer user_data)
@@ -11,6 +14,71 @@ gegl_surface_factory(gpointer user_data)
     return (MyPaintSurface *)surface;
 }
 
+MyPaintSurface *
+gegl_foreign_surface_factory(gpointer user_data)
+{
+    MyPaintGeglTiledSurface * surface = mypaint_gegl_tiled_surface_new();
+    // Neither the format nor the tile size of the surface
+    GeglRectangle extent = {0, 0, 1000, 1000};
+    GeglBuffer *buffer = gegl_buffer_new(&extent, babl_format("RGBA float"));
+    mypaint_gegl_tiled_surface_set_buffer(surface, buffer);
+    g_object_unref(buffer);
+    return (MyPaintSurface *)surface;
+}
+
+static MyPaintGeglTiledSurface *
+render(const char *brush_name, gboolean foreign)
+{
+    MyPaintGeglTiledSurface *surface = mypaint_gegl_tiled_surface_new();
+    if (foreign) {
+        // Same format, other tile size: only copies, so the pixels must match
+        GeglBuffer *native = mypaint_gegl_tiled_surface_get_buffer(surface);
+        GeglBuffer *buffer = GEGL_BUFFER(g_object_new(GEGL_TYPE_BUFFER,
+                                "x", 0, "y", 0, "width", 0, "height", 0,
+                                "format", gegl_buffer_get_format(native),
+                                "tile-width", 128, "tile-height", 128,
+                                NULL));
+        mypaint_gegl_tiled_surface_set_buffer(surface, buffer);
+        g_object_unref(buffer);
+    }
+    // Native buffers are sampled in parallel, which must not change the result
+    mypaint_tiled_surface_set_deterministic((MyPaintTiledSurface *)surface, TRUE);
+
+    MyPaintBrush *brush = test_brush_load(brush_name);
+    test_events_play((MyPaintSurface *)surface, brush, FALSE);
+    mypaint_brush_unref(brush);
+    return surface;
+}
+
+int
+test_foreign_same_pixels(void *user_data)
+{
+    const char *brush_name = (const char *)user_data;
+    MyPaintGeglTiledSurface *native = render(brush_name, FALSE);
+    MyPaintGeglTiledSurface *foreign = render(brush_name, TRUE);
+    GeglBuffer *native_buffer = mypaint_gegl_tiled_surface_get_buffer(native);
+    GeglBuffer *foreign_buffer = mypaint_gegl_tiled_surface_get_buffer(foreign);
+
+    const GeglRectangle *extent = gegl_buffer_get_extent(native_buffer);
+    int passed = expect_true(extent->width > 0 && extent->height > 0, "painted");
+    passed &= expect_true(gegl_rectangle_equal(extent, gegl_buffer_get_extent(foreign_buffer)),
+                          "same extent");
+
+    const Babl *format = gegl_buffer_get_format(native_buffer);
+    const size_t bytes = babl_format_get_bytes_per_pixel(format) * extent->width * extent->height;
+    void *native_pixels = malloc(bytes);
+    void *foreign_pixels = malloc(bytes);
+    gegl_buffer_get(native_buffer, extent, 1, format, native_pixels, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+    gegl_buffer_get(foreign_buffer, extent, 1, format, foreign_pixels, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+    passed &= expect_true(memcmp(native_pixels, foreign_pixels, bytes) == 0, "same pixels");
+
+    free(native_pixels);
+    free(foreign_pixels);
+    mypaint_surface_unref((MyPaintSurface *)native);
+    mypaint_surface_unref((MyPaintSurface *)foreign);
+    return passed;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -18,6 +86,13 @@ main(int argc, char **argv)
     gegl_init(0, NULL);
 
     int retval = mypaint_test_surface_run(argc, argv, gegl_surface_factory, "MyPaintGeglSurface", NULL);
+    retval |= mypaint_test_surface_run(argc, argv, gegl_foreign_surface_factory, "MyPaintGeglSurfaceForeign", NULL);
+
+    TestCase test_cases[] = {
+        {"/gegl_surface/foreign/charcoal", test_foreign_same_pixels, (void *)"charcoal"},
+        {"/gegl_surface/foreign/smudge", test_foreign_same_pixels, (void *)"impressionism"},
+    };
+    retval |= test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
 
     gegl_exit();
     return retval;
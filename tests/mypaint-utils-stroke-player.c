@@ -180,6 +180,50 @@ mypaint_utils_stroke_player_run_sync(MyPaintUtilsStrokePlayer *self)
     }
 }
 
+/* Plays all events, passing up to batch_size of them at a time to
+ * mypaint_brush_stroke_to_events(). With transactions on, each batch is
+ * done between one MyPaintSurface::begin_atomic() end_atomic() pair. */
+void
+mypaint_utils_stroke_player_run_batched(MyPaintUtilsStrokePlayer *self, int batch_size)
+{
+    MyPaintMotionEvent *batch = (MyPaintMotionEvent *)malloc(sizeof(MyPaintMotionEvent) * batch_size);
+    int batch_n = 0;
+
+    assert(batch);
+
+    for (int i=0; i<self->number_of_events; i++) {
+        const MotionEvent *event = &self->events[i];
+        const float last_event_time = i > 0 ? self->events[i-1].time : 0.0;
+        if (event->valid) {
+            MyPaintMotionEvent *out = &batch[batch_n++];
+            out->x = event->x*self->scale;
+            out->y = event->y*self->scale;
+            out->pressure = event->pressure;
+            out->xtilt = event->xtilt;
+            out->ytilt = event->ytilt;
+            out->dtime = event->time - last_event_time;
+            out->viewzoom = event->viewzoom;
+            out->viewrotation = event->viewrotation;
+            out->barrel_rotation = event->barrel_rotation;
+        }
+        if (batch_n == batch_size || (i == self->number_of_events-1 && batch_n > 0)) {
+            if (self->transaction_on_stroke) {
+                mypaint_surface_begin_atomic(self->surface);
+            }
+
+            mypaint_brush_stroke_to_events(self->brush, self->surface, batch, batch_n, FALSE, NULL);
+
+            if (self->transaction_on_stroke) {
+                mypaint_surface_end_atomic(self->surface, NULL);
+            }
+            batch_n = 0;
+        }
+    }
+
+    free(batch);
+    mypaint_utils_stroke_player_reset(self);
+}
+
 void
 mypaint_utils_stroke_player_set_transactions_on_stroke_to(MyPaintUtilsStrokePlayer *self, gboolean value)
 {
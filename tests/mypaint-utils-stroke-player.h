@@ -46,6 +46,9 @@ mypaint_utils_stroke_player_reset(MyPaintUtilsStrokePlayer *self);
 void
 mypaint_utils_stroke_player_run_sync(MyPaintUtilsStrokePlayer *self);
 
+void
+mypaint_utils_stroke_player_run_batched(MyPaintUtilsStrokePlayer *self, int batch_size);
+
 void
 mypaint_utils_stroke_player_set_transactions_on_stroke_to(MyPaintUtilsStrokePlayer *self, gboolean value);
 
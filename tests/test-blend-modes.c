@@ -0,0 +1,366 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "brushmodes.h"
+#include "helpers.h"
+#include "mypaint-tiled-surface.h"
+#include "mypaint-benchmark.h"
+#include "testutils.h"
+
+#define TILE_PIXELS (MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE)
+#define TILE_CHANNELS (TILE_PIXELS * 4)
+
+static uint32_t
+next_random(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// The float implementation that the posterize kernel replaces
+static void
+reference_posterize(uint16_t *mask, uint16_t *rgba, uint16_t opacity, uint16_t posterize_num)
+{
+    while (1) {
+        for (; mask[0]; mask++, rgba += 4) {
+            float r = (float)rgba[0] / (1 << 15);
+            float g = (float)rgba[1] / (1 << 15);
+            float b = (float)rgba[2] / (1 << 15);
+
+            uint32_t post_r = (1 << 15) * ROUND(r * posterize_num) / posterize_num;
+            uint32_t post_g = (1 << 15) * ROUND(g * posterize_num) / posterize_num;
+            uint32_t post_b = (1 << 15) * ROUND(b * posterize_num) / posterize_num;
+
+            uint32_t opa_a = mask[0] * (uint32_t)opacity / (1 << 15);
+            uint32_t opa_b = (1 << 15) - opa_a;
+            rgba[0] = (opa_a * post_r + opa_b * rgba[0]) / (1 << 15);
+            rgba[1] = (opa_a * post_g + opa_b * rgba[1]) / (1 << 15);
+            rgba[2] = (opa_a * post_b + opa_b * rgba[2]) / (1 << 15);
+        }
+        if (!mask[1]) break;
+        rgba += mask[1];
+        mask += 2;
+    }
+}
+
+// A mask covering the whole tile, without skips
+static void
+full_mask(uint16_t *mask, uint32_t seed)
+{
+    for (int i = 0; i < TILE_PIXELS; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        mask[i] = 1 + (seed >> 8) % (1 << 15);
+    }
+    mask[TILE_PIXELS] = 0;
+    mask[TILE_PIXELS + 1] = 0;
+}
+
+// Premultiplied pixels, with the color channels of consecutive tiles
+// running through all values from 0 to 1 << 15
+static void
+fill_pixels(uint16_t *rgba, int tile)
+{
+    for (int i = 0; i < TILE_PIXELS; i++) {
+        const uint32_t value = (tile * TILE_PIXELS + i) % ((1 << 15) + 1);
+        rgba[i * 4 + 0] = value;
+        rgba[i * 4 + 1] = value / 2;
+        rgba[i * 4 + 2] = (1 << 15) - value;
+        rgba[i * 4 + 3] = 1 << 15;
+    }
+}
+
+#define LUMA(r, g, b) \
+    ((r) * (float)(0.2126 * (1 << 15)) + (g) * (float)(0.7152 * (1 << 15)) + (b) * (float)(0.0722 * (1 << 15)))
+
+// The implementation that the color kernel replaces, with a separate
+// SetLum() and both sides of ClipColor() tested for every pixel
+static void
+reference_set_lum(const uint16_t topr, const uint16_t topg, const uint16_t topb,
+                  uint16_t *botr, uint16_t *botg, uint16_t *botb)
+{
+    const uint16_t botlum = LUMA(*botr, *botg, *botb) / (1 << 15);
+    const uint16_t toplum = LUMA(topr, topg, topb) / (1 << 15);
+    const int16_t diff = botlum - toplum;
+    int32_t r = topr + diff;
+    int32_t g = topg + diff;
+    int32_t b = topb + diff;
+
+    int32_t lum = LUMA(r, g, b) / (1 << 15);
+    int32_t cmin = MIN3(r, g, b);
+    int32_t cmax = MAX3(r, g, b);
+    if (cmin < 0) {
+        r = lum + (((r - lum) * lum) / (lum - cmin));
+        g = lum + (((g - lum) * lum) / (lum - cmin));
+        b = lum + (((b - lum) * lum) / (lum - cmin));
+    }
+    if (cmax > (1 << 15)) {
+        r = lum + (((r - lum) * ((1 << 15) - lum)) / (cmax - lum));
+        g = lum + (((g - lum) * ((1 << 15) - lum)) / (cmax - lum));
+        b = lum + (((b - lum) * ((1 << 15) - lum)) / (cmax - lum));
+    }
+    *botr = r;
+    *botg = g;
+    *botb = b;
+}
+
+static void
+reference_color(uint16_t *mask, uint16_t *rgba, uint16_t color_r, uint16_t color_g, uint16_t color_b,
+                uint16_t opacity)
+{
+    while (1) {
+        for (; mask[0]; mask++, rgba += 4) {
+            uint16_t r, g, b;
+            const uint16_t a = rgba[3];
+            r = g = b = 0;
+            if (rgba[3] != 0) {
+                r = ((1 << 15) * ((uint32_t)rgba[0])) / a;
+                g = ((1 << 15) * ((uint32_t)rgba[1])) / a;
+                b = ((1 << 15) * ((uint32_t)rgba[2])) / a;
+            }
+            reference_set_lum(color_r, color_g, color_b, &r, &g, &b);
+            r = ((uint32_t)r) * a / (1 << 15);
+            g = ((uint32_t)g) * a / (1 << 15);
+            b = ((uint32_t)b) * a / (1 << 15);
+
+            uint32_t opa_a = mask[0] * opacity / (1 << 15);
+            uint32_t opa_b = (1 << 15) - opa_a;
+            rgba[0] = (opa_a * r + opa_b * rgba[0]) / (1 << 15);
+            rgba[1] = (opa_a * g + opa_b * rgba[1]) / (1 << 15);
+            rgba[2] = (opa_a * b + opa_b * rgba[2]) / (1 << 15);
+        }
+        if (!mask[1]) break;
+        rgba += mask[1];
+        mask += 2;
+    }
+}
+
+// A run length encoded mask with runs and skips of random length
+static void
+random_mask(uint16_t *mask, uint32_t *seed)
+{
+    uint16_t *mask_p = mask;
+    int pixel = 0;
+    while (pixel < TILE_PIXELS) {
+        // MIN() evaluates its arguments twice
+        const int run_random = 1 + next_random(seed) % 70;
+        const int run = MIN(run_random, TILE_PIXELS - pixel);
+        for (int i = 0; i < run; i++) {
+            *mask_p++ = 1 + next_random(seed) % (1 << 15);
+        }
+        pixel += run;
+        const int skip_random = 1 + next_random(seed) % 30;
+        const int skip = MIN(skip_random, TILE_PIXELS - pixel);
+        if (skip > 0 && pixel + skip < TILE_PIXELS) {
+            *mask_p++ = 0;
+            *mask_p++ = skip * 4;
+        }
+        pixel += skip;
+    }
+    *mask_p++ = 0;
+    *mask_p++ = 0;
+}
+
+// Premultiplied pixels with random alpha, some of them transparent or opaque
+static void
+random_pixels(uint16_t *rgba, uint32_t *seed)
+{
+    for (int i = 0; i < TILE_PIXELS; i++) {
+        uint32_t a;
+        switch (next_random(seed) % 4) {
+        case 0: a = 0; break;
+        case 1: a = 1 << 15; break;
+        default: a = next_random(seed) % ((1 << 15) + 1); break;
+        }
+        for (int c = 0; c < 3; c++) {
+            rgba[i * 4 + c] = next_random(seed) % (a + 1);
+        }
+        rgba[i * 4 + 3] = a;
+    }
+}
+
+int
+test_color_exact(void *user_data)
+{
+    // Saturated colours clip on one side for most pixels, white and black on both
+    static const uint16_t colors[][3] = {
+        {1 << 15, 0, 0}, {0, 1 << 15, 0}, {0, 0, 1 << 15}, {0, 0, 0}, {1 << 15, 1 << 15, 1 << 15},
+        {16384, 16384, 16384}, {1 << 15, 1 << 15, 0}, {3000, 20000, 31000}, {30000, 100, 9000},
+    };
+    static const uint16_t opacities[] = {1 << 15, 12345, 1};
+    // Up to two skip values for every pixel
+    uint16_t mask[TILE_PIXELS * 3 + 2];
+    uint16_t *actual = (uint16_t *)malloc(TILE_CHANNELS * sizeof(uint16_t));
+    uint16_t *expected = (uint16_t *)malloc(TILE_CHANNELS * sizeof(uint16_t));
+    uint32_t seed = 1;
+    int same = 1;
+
+    for (int i = 0; i < 200; i++) {
+        uint16_t color[3];
+        if (i < (int)(sizeof(colors) / sizeof(colors[0]))) {
+            memcpy(color, colors[i], sizeof(color));
+        } else {
+            for (int c = 0; c < 3; c++) {
+                color[c] = next_random(&seed) % ((1 << 15) + 1);
+            }
+        }
+        const uint16_t opacity = opacities[i % 3];
+
+        random_mask(mask, &seed);
+        random_pixels(actual, &seed);
+        memcpy(expected, actual, TILE_CHANNELS * sizeof(uint16_t));
+        draw_dab_pixels_BlendMode_Color(mask, actual, color[0], color[1], color[2], opacity);
+        reference_color(mask, expected, color[0], color[1], color[2], opacity);
+        if (memcmp(actual, expected, TILE_CHANNELS * sizeof(uint16_t)) != 0) {
+            printf("color %d %d %d, opacity %d differs\n", color[0], color[1], color[2], opacity);
+            same = 0;
+        }
+    }
+
+    free(actual);
+    free(expected);
+    return expect_true(same, "same result as the per pixel implementation");
+}
+
+int
+test_color_benchmark(void *user_data)
+{
+    const int iterations = 2000;
+    uint16_t mask[TILE_PIXELS + 2];
+    uint16_t *rgba = (uint16_t *)malloc(TILE_CHANNELS * sizeof(uint16_t));
+    uint32_t seed = 1;
+    full_mask(mask, 1);
+    random_pixels(rgba, &seed);
+
+    mypaint_benchmark_start("reference_color");
+    for (int i = 0; i < iterations; i++) {
+        reference_color(mask, rgba, 30000, 100 * (i % 100), 9000, 1 << 10);
+    }
+    const int reference_ms = mypaint_benchmark_end();
+
+    mypaint_benchmark_start("draw_dab_pixels_BlendMode_Color");
+    for (int i = 0; i < iterations; i++) {
+        draw_dab_pixels_BlendMode_Color(mask, rgba, 30000, 100 * (i % 100), 9000, 1 << 10);
+    }
+    const int color_ms = mypaint_benchmark_end();
+
+    mypaint_benchmark_start("draw_dab_pixels_BlendMode_Normal");
+    for (int i = 0; i < iterations; i++) {
+        draw_dab_pixels_BlendMode_Normal(mask, rgba, 1000, 2000, 3000, 1 << 10);
+    }
+    const int normal_ms = mypaint_benchmark_end();
+
+    printf("%d full tiles: reference color %d ms, color %d ms, normal %d ms\n",
+           iterations, reference_ms, color_ms, normal_ms);
+    free(rgba);
+    return 1;
+}
+
+int
+test_posterize_exact(void *user_data)
+{
+    static const uint16_t nums[] = {1, 2, 3, 5, 7, 10, 33, 64, 100, 127, 128};
+    static const uint16_t opacities[] = {1 << 15, 12345, 1};
+    uint16_t mask[TILE_PIXELS + 2];
+    uint16_t *actual = (uint16_t *)malloc(TILE_PIXELS * 4 * sizeof(uint16_t));
+    uint16_t *expected = (uint16_t *)malloc(TILE_PIXELS * 4 * sizeof(uint16_t));
+    int same = 1;
+
+    for (size_t n = 0; n < sizeof(nums) / sizeof(nums[0]); n++) {
+        for (size_t o = 0; o < sizeof(opacities) / sizeof(opacities[0]); o++) {
+            // Enough tiles for every channel value
+            for (int tile = 0; tile < (1 << 15) / TILE_PIXELS + 1; tile++) {
+                full_mask(mask, tile);
+                fill_pixels(actual, tile);
+                fill_pixels(expected, tile);
+                draw_dab_pixels_BlendMode_Posterize(mask, actual, opacities[o], nums[n]);
+                reference_posterize(mask, expected, opacities[o], nums[n]);
+                if (memcmp(actual, expected, TILE_PIXELS * 4 * sizeof(uint16_t)) != 0) {
+                    printf("posterize_num %d, opacity %d: tile %d differs\n", nums[n], opacities[o], tile);
+                    same = 0;
+                }
+            }
+        }
+    }
+
+    free(actual);
+    free(expected);
+    return expect_true(same, "same result as the float implementation");
+}
+
+int
+test_posterize_out_of_range(void *user_data)
+{
+    static const uint16_t nums[] = {1, 7, 128};
+    uint16_t mask[TILE_PIXELS + 2];
+    uint16_t *rgba = (uint16_t *)malloc(TILE_PIXELS * 4 * sizeof(uint16_t));
+    int passed = 1;
+
+    for (int i = 0; i < TILE_PIXELS; i++) {
+        mask[i] = 1 << 15;
+    }
+    mask[TILE_PIXELS] = 0;
+    mask[TILE_PIXELS + 1] = 0;
+
+    // Invalid channels above 1.0 get the highest level
+    for (size_t n = 0; n < sizeof(nums) / sizeof(nums[0]); n++) {
+        for (int i = 0; i < TILE_PIXELS * 4; i++) {
+            rgba[i] = 0xffff;
+        }
+        draw_dab_pixels_BlendMode_Posterize(mask, rgba, 1 << 15, nums[n]);
+        passed &= expect_int(1 << 15, rgba[0], "red of the highest level");
+        passed &= expect_int(1 << 15, rgba[TILE_PIXELS * 4 - 2], "blue of the highest level");
+    }
+
+    free(rgba);
+    return passed;
+}
+
+int
+test_posterize_benchmark(void *user_data)
+{
+    const int iterations = 2000;
+    uint16_t mask[TILE_PIXELS + 2];
+    uint16_t *rgba = (uint16_t *)malloc(TILE_PIXELS * 4 * sizeof(uint16_t));
+    full_mask(mask, 1);
+    fill_pixels(rgba, 0);
+
+    mypaint_benchmark_start("reference_posterize");
+    for (int i = 0; i < iterations; i++) {
+        reference_posterize(mask, rgba, 1 << 14, 1 + i % 128);
+    }
+    const int reference_ms = mypaint_benchmark_end();
+
+    mypaint_benchmark_start("draw_dab_pixels_BlendMode_Posterize");
+    for (int i = 0; i < iterations; i++) {
+        draw_dab_pixels_BlendMode_Posterize(mask, rgba, 1 << 14, 1 + i % 128);
+    }
+    const int posterize_ms = mypaint_benchmark_end();
+
+    mypaint_benchmark_start("draw_dab_pixels_BlendMode_Normal");
+    for (int i = 0; i < iterations; i++) {
+        draw_dab_pixels_BlendMode_Normal(mask, rgba, 1000, 2000, 3000, 1 << 14);
+    }
+    const int normal_ms = mypaint_benchmark_end();
+
+    printf("%d full tiles: float posterize %d ms, posterize %d ms, normal %d ms\n",
+           iterations, reference_ms, posterize_ms, normal_ms);
+    free(rgba);
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    TestCase test_cases[] = {
+        {"/blend_modes/posterize/exact", test_posterize_exact, NULL},
+        {"/blend_modes/posterize/out_of_range", test_posterize_out_of_range, NULL},
+        {"/blend_modes/posterize/benchmark", test_posterize_benchmark, NULL},
+        {"/blend_modes/color/exact", test_color_exact, NULL},
+        {"/blend_modes/color/benchmark", test_color_benchmark, NULL},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
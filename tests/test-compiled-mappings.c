@@ -0,0 +1,218 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "mypaint-brush.h"
+#include "mypaint-fixed-tiled-surface.h"
+#include "mypaint-mapping.h"
+#include "compiledmappings.h"
+#include "helpers.h"
+#include "testutils.h"
+#include "mypaint-benchmark.h"
+
+#define SAMPLES 1000
+#define BENCHMARK_ITERATIONS 200
+
+typedef struct {
+    MyPaintMapping *mappings[MYPAINT_BRUSH_SETTINGS_COUNT];
+    float inputs[SAMPLES][MYPAINT_BRUSH_INPUTS_COUNT];
+} BrushMappings;
+
+// Copies the mappings of a shipped brush, and picks input values that
+// cover the soft range of each input, plus some distance outside of it.
+static gboolean
+brush_mappings_init(BrushMappings *data, const char *name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/tests/brushes/%s.myb", LIBMYPAINT_TESTING_ABS_TOP_SRCDIR, name);
+    char *json = read_file(path);
+    MyPaintBrush *brush = mypaint_brush_new();
+    const gboolean loaded = mypaint_brush_from_string(brush, json);
+    free(json);
+
+    for (int s = 0; s < MYPAINT_BRUSH_SETTINGS_COUNT; s++) {
+        MyPaintMapping *mapping = mypaint_mapping_new(MYPAINT_BRUSH_INPUTS_COUNT);
+        mypaint_mapping_set_base_value(mapping, mypaint_brush_get_base_value(brush, s));
+        for (int i = 0; i < MYPAINT_BRUSH_INPUTS_COUNT; i++) {
+            const int n = mypaint_brush_get_mapping_n(brush, s, i);
+            mypaint_mapping_set_n(mapping, i, n);
+            for (int p = 0; p < n; p++) {
+                float x, y;
+                mypaint_brush_get_mapping_point(brush, s, i, p, &x, &y);
+                mypaint_mapping_set_point(mapping, i, p, x, y);
+            }
+        }
+        data->mappings[s] = mapping;
+    }
+    mypaint_brush_unref(brush);
+
+    srand(1);
+    for (int i = 0; i < MYPAINT_BRUSH_INPUTS_COUNT; i++) {
+        const MyPaintBrushInputInfo *info = mypaint_brush_input_info(i);
+        const float range = info->soft_max - info->soft_min;
+        for (int k = 0; k < SAMPLES; k++) {
+            const float t = (float)rand() / RAND_MAX;
+            data->inputs[k][i] = info->soft_min - 0.25f * range + t * 1.5f * range;
+        }
+    }
+    return loaded;
+}
+
+static void
+brush_mappings_free(BrushMappings *data)
+{
+    for (int s = 0; s < MYPAINT_BRUSH_SETTINGS_COUNT; s++) {
+        mypaint_mapping_free(data->mappings[s]);
+    }
+}
+
+int
+test_compiled_mappings_match(void *user_data)
+{
+    BrushMappings data;
+    if (!expect_true(brush_mappings_init(&data, (const char *)user_data), "brush loads")) {
+        brush_mappings_free(&data);
+        return 0;
+    }
+
+    CompiledMappings *compiled = compiled_mappings_new(MYPAINT_BRUSH_SETTINGS_COUNT);
+    int passed = expect_true(compiled_mappings_compile(compiled, data.mappings, MYPAINT_BRUSH_INPUTS_COUNT), "compile");
+
+    float max_error = 0;
+    for (int k = 0; k < SAMPLES; k++) {
+        float values[MYPAINT_BRUSH_SETTINGS_COUNT];
+        compiled_mappings_evaluate(compiled, data.inputs[k], values);
+        for (int s = 0; s < MYPAINT_BRUSH_SETTINGS_COUNT; s++) {
+            const float expected = mypaint_mapping_calculate(data.mappings[s], data.inputs[k]);
+            max_error = MAX(max_error, fabsf(values[s] - expected) / (1.0f + fabsf(expected)));
+        }
+    }
+    printf("%s: max relative error %g\n", (const char *)user_data, max_error);
+    passed &= expect_true(max_error < 1e-5f, "compiled mappings match");
+
+    compiled_mappings_free(compiled);
+    brush_mappings_free(&data);
+    return passed;
+}
+
+int
+test_compiled_mappings_benchmark(void *user_data)
+{
+    BrushMappings data;
+    brush_mappings_init(&data, (const char *)user_data);
+    CompiledMappings *compiled = compiled_mappings_new(MYPAINT_BRUSH_SETTINGS_COUNT);
+    compiled_mappings_compile(compiled, data.mappings, MYPAINT_BRUSH_INPUTS_COUNT);
+
+    float values[MYPAINT_BRUSH_SETTINGS_COUNT];
+    float sum = 0;
+
+    mypaint_benchmark_start("mypaint_mapping_calculate");
+    for (int it = 0; it < BENCHMARK_ITERATIONS; it++) {
+        for (int k = 0; k < SAMPLES; k++) {
+            for (int s = 0; s < MYPAINT_BRUSH_SETTINGS_COUNT; s++) {
+                values[s] = mypaint_mapping_calculate(data.mappings[s], data.inputs[k]);
+            }
+            sum += values[it % MYPAINT_BRUSH_SETTINGS_COUNT];
+        }
+    }
+    const int calculate_duration = mypaint_benchmark_end();
+
+    mypaint_benchmark_start("compiled_mappings_evaluate");
+    for (int it = 0; it < BENCHMARK_ITERATIONS; it++) {
+        for (int k = 0; k < SAMPLES; k++) {
+            compiled_mappings_evaluate(compiled, data.inputs[k], values);
+            sum += values[it % MYPAINT_BRUSH_SETTINGS_COUNT];
+        }
+    }
+    const int compiled_duration = mypaint_benchmark_end();
+
+    printf("%s: mypaint_mapping_calculate %d ms, compiled %d ms (%g)\n",
+           (const char *)user_data, calculate_duration, compiled_duration, sum);
+
+    compiled_mappings_free(compiled);
+    brush_mappings_free(&data);
+    return 1;
+}
+
+typedef struct {
+    const char *name;
+    MyPaintBrushInput input;
+    MyPaintBrushState state; // a filtered state that only feeds the input
+} UnusedInput;
+
+// Replays the test events with charcoal, without any mapping on the input,
+// or with one that adds 0 to a setting. Returns a hash of the result, and
+// the value of the state afterwards.
+static uint64_t
+render_charcoal(const UnusedInput *unused, gboolean mapped, float *state)
+{
+    MyPaintBrush *brush = test_brush_load("charcoal");
+    // Settles somewhere other than 0 if the custom input state is updated
+    mypaint_brush_set_base_value(brush, MYPAINT_BRUSH_SETTING_CUSTOM_INPUT, 0.5);
+    for (int s = 0; s < MYPAINT_BRUSH_SETTINGS_COUNT; s++) {
+        mypaint_brush_set_mapping_n(brush, s, unused->input, 0);
+    }
+    if (mapped) {
+        const MyPaintBrushSetting setting = MYPAINT_BRUSH_SETTING_OPAQUE_MULTIPLY;
+        mypaint_brush_set_mapping_n(brush, setting, unused->input, 2);
+        mypaint_brush_set_mapping_point(brush, setting, unused->input, 0, 0.0, 0.0);
+        mypaint_brush_set_mapping_point(brush, setting, unused->input, 1, 1.0, 0.0);
+    }
+
+    MyPaintFixedTiledSurface *surface = mypaint_fixed_tiled_surface_new(1000, 1000);
+    mypaint_tiled_surface_set_deterministic((MyPaintTiledSurface *)surface, TRUE);
+    test_events_play((MyPaintSurface *)surface, brush, FALSE);
+    const uint64_t hash = test_surface_hash((MyPaintTiledSurface *)surface, 1000, 1000);
+    *state = mypaint_brush_get_state(brush, unused->state);
+
+    mypaint_surface_unref((MyPaintSurface *)surface);
+    mypaint_brush_unref(brush);
+    return hash;
+}
+
+// An input that no setting depends on is not calculated, and its filtered
+// state is not updated. Making a setting depend on the input, without
+// changing the setting, must not change what is drawn.
+int
+test_unused_input(void *user_data)
+{
+    const UnusedInput *unused = (const UnusedInput *)user_data;
+    float skipped_state, used_state;
+    const uint64_t skipped_hash = render_charcoal(unused, FALSE, &skipped_state);
+    const uint64_t used_hash = render_charcoal(unused, TRUE, &used_state);
+    printf("%s: state %g when used\n", unused->name, used_state);
+
+    int passed = expect_float(0.0, skipped_state, "state not updated");
+    passed &= expect_true(used_state != 0.0, "state updated once used");
+    passed &= expect_true(used_hash == skipped_hash, "same result");
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const UnusedInput speed = {"speed1", MYPAINT_BRUSH_INPUT_SPEED1, MYPAINT_BRUSH_STATE_NORM_SPEED1_SLOW};
+    static const UnusedInput direction = {"direction", MYPAINT_BRUSH_INPUT_DIRECTION, MYPAINT_BRUSH_STATE_DIRECTION_DX};
+    static const UnusedInput custom = {"custom", MYPAINT_BRUSH_INPUT_CUSTOM, MYPAINT_BRUSH_STATE_CUSTOM_INPUT};
+    static const UnusedInput stroke = {"stroke", MYPAINT_BRUSH_INPUT_STROKE, MYPAINT_BRUSH_STATE_STROKE};
+    TestCase test_cases[] = {
+        {"/mapping/compiled/bulk", test_compiled_mappings_match, (void *)"bulk"},
+        {"/mapping/compiled/charcoal", test_compiled_mappings_match, (void *)"charcoal"},
+        {"/mapping/compiled/coarse_bulk_2", test_compiled_mappings_match, (void *)"coarse_bulk_2"},
+        {"/mapping/compiled/impressionism", test_compiled_mappings_match, (void *)"impressionism"},
+        {"/mapping/compiled/modelling", test_compiled_mappings_match, (void *)"modelling"},
+        {"/mapping/compiled/unused_input/speed1", test_unused_input, (void *)&speed},
+        {"/mapping/compiled/unused_input/direction", test_unused_input, (void *)&direction},
+        {"/mapping/compiled/unused_input/custom", test_unused_input, (void *)&custom},
+        {"/mapping/compiled/unused_input/stroke", test_unused_input, (void *)&stroke},
+        {"/mapping/compiled/benchmark/bulk", test_compiled_mappings_benchmark, (void *)"bulk"},
+        {"/mapping/compiled/benchmark/charcoal", test_compiled_mappings_benchmark, (void *)"charcoal"},
+        {"/mapping/compiled/benchmark/coarse_bulk_2", test_compiled_mappings_benchmark, (void *)"coarse_bulk_2"},
+        {"/mapping/compiled/benchmark/impressionism", test_compiled_mappings_benchmark, (void *)"impressionism"},
+        {"/mapping/compiled/benchmark/modelling", test_compiled_mappings_benchmark, (void *)"modelling"},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
@@ -0,0 +1,142 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "mypaint-brush.h"
+#include "mypaint-compressed-tiled-surface.h"
+#include "helpers.h"
+#include "testutils.h"
+
+#define SURFACE_SIZE 1000
+#define TILE_BYTES (MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4 * sizeof(uint16_t))
+
+static uint64_t
+render(const char *brush_name, int cache_tiles, gboolean bulk_requests, MyPaintCompressedTiledSurfaceStats *stats)
+{
+    MyPaintCompressedTiledSurface *surface = mypaint_compressed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE, cache_tiles);
+    // Smudging brushes read back the surface, which must not depend on the thread count
+    mypaint_tiled_surface_set_deterministic((MyPaintTiledSurface *)surface, TRUE);
+    if (!bulk_requests) {
+        ((MyPaintTiledSurface *)surface)->tile_requests_start = NULL;
+        ((MyPaintTiledSurface *)surface)->tile_requests_end = NULL;
+    }
+
+    MyPaintBrush *brush = test_brush_load(brush_name);
+    test_events_play(mypaint_compressed_tiled_surface_interface(surface), brush, FALSE);
+
+    const uint64_t hash = test_surface_hash((MyPaintTiledSurface *)surface, SURFACE_SIZE, SURFACE_SIZE);
+    mypaint_compressed_tiled_surface_get_stats(surface, stats);
+
+    mypaint_brush_unref(brush);
+    mypaint_surface_unref((MyPaintSurface *)surface);
+    return hash;
+}
+
+int
+test_eviction_keeps_content(void *user_data)
+{
+    const char *brush_name = (const char *)user_data;
+    MyPaintCompressedTiledSurfaceStats uncompressed;
+    MyPaintCompressedTiledSurfaceStats compressed;
+    int passed = 1;
+
+    // Every tile fits in the cache, so nothing is ever compressed
+    const uint64_t expected = render(brush_name, 1024, TRUE, &uncompressed);
+    passed &= expect_int(0, uncompressed.tiles_stored, "no tiles evicted");
+
+    const uint64_t actual = render(brush_name, 4, TRUE, &compressed);
+    passed &= expect_true(actual == expected, "same tile bytes after eviction");
+    passed &= expect_true(compressed.tiles_stored > 0, "tiles evicted");
+    passed &= expect_true(compressed.tiles_cached <= 4, "cache bounded");
+
+    const double ratio = (double)compressed.tiles_stored * TILE_BYTES / compressed.compressed_bytes;
+    const double hit_rate = (double)compressed.cache_hits / (compressed.cache_hits + compressed.cache_misses);
+    printf("%s: %d tiles stored in %lu bytes, compression ratio %.1f, hit rate %.2f\n",
+           brush_name, compressed.tiles_stored, (unsigned long)compressed.compressed_bytes, ratio, hit_rate);
+    passed &= expect_true(ratio > 1.0, "tiles shrink");
+    return passed;
+}
+
+int
+test_bulk_requests(void *user_data)
+{
+    const char *brush_name = (const char *)user_data;
+    MyPaintCompressedTiledSurfaceStats stats;
+
+    const uint64_t expected = render(brush_name, 4, FALSE, &stats);
+    const uint64_t actual = render(brush_name, 4, TRUE, &stats);
+    return expect_true(actual == expected, "same tile bytes with bulk requests");
+}
+
+static MyPaintTileRequestsStartFunction compressed_requests_start;
+static int largest_batch;
+
+static void
+record_requests_start(MyPaintTiledSurface *surface, MyPaintTileRequest *requests, int requests_n)
+{
+    largest_batch = MAX(largest_batch, requests_n);
+    compressed_requests_start(surface, requests, requests_n);
+}
+
+static uint64_t
+render_one_transaction(gboolean bulk_requests, int *tiles_changed)
+{
+    MyPaintCompressedTiledSurface *surface = mypaint_compressed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE, 4);
+    MyPaintTiledSurface *tiled_surface = (MyPaintTiledSurface *)surface;
+    mypaint_tiled_surface_set_deterministic(tiled_surface, TRUE);
+    mypaint_tiled_surface_set_stats_enabled(tiled_surface, TRUE);
+    if (bulk_requests) {
+        compressed_requests_start = tiled_surface->tile_requests_start;
+        tiled_surface->tile_requests_start = record_requests_start;
+    } else {
+        tiled_surface->tile_requests_start = NULL;
+        tiled_surface->tile_requests_end = NULL;
+    }
+
+    MyPaintBrush *brush = test_brush_load("charcoal");
+    // Wide enough to change most tiles of the surface
+    mypaint_brush_set_base_value(brush, MYPAINT_BRUSH_SETTING_RADIUS_LOGARITHMIC, logf(40.0f));
+    test_events_play(mypaint_compressed_tiled_surface_interface(surface), brush, TRUE);
+
+    MyPaintTiledSurfaceStats stats;
+    mypaint_tiled_surface_get_stats(tiled_surface, &stats);
+    *tiles_changed = (int)stats.tiles_processed;
+    const uint64_t hash = test_surface_hash(tiled_surface, SURFACE_SIZE, SURFACE_SIZE);
+
+    mypaint_brush_unref(brush);
+    mypaint_surface_unref((MyPaintSurface *)surface);
+    return hash;
+}
+
+int
+test_bulk_requests_batched(void *user_data)
+{
+    int tiles_changed;
+    int passed = 1;
+
+    const uint64_t expected = render_one_transaction(FALSE, &tiles_changed);
+    largest_batch = 0;
+    const uint64_t actual = render_one_transaction(TRUE, &tiles_changed);
+    printf("%d tiles changed, at most %d requested at once\n", tiles_changed, largest_batch);
+
+    passed &= expect_true(tiles_changed > 64, "more tiles than one batch");
+    passed &= expect_true(largest_batch > 0 && largest_batch < tiles_changed, "tiles requested in batches");
+    passed &= expect_true(actual == expected, "same tile bytes with batched requests");
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    TestCase test_cases[] = {
+        {"/compressed_tiled_surface/eviction/charcoal", test_eviction_keeps_content, (void *)"charcoal"},
+        {"/compressed_tiled_surface/eviction/impressionism", test_eviction_keeps_content, (void *)"impressionism"},
+        {"/compressed_tiled_surface/bulk_requests", test_bulk_requests, (void *)"impressionism"},
+        {"/compressed_tiled_surface/bulk_requests/batched", test_bulk_requests_batched, NULL},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
@@ -31,4 +31,35 @@ int main(int argc, char *argv[])
     }
     const int duration = mypaint_benchmark_end();
     printf("render_dab_mask: %d ms\n", duration);
+
+    // A large dab, rendered on every tile it touches
+    const float large_radius = 500;
+    const int tiles = 2 * (int)(large_radius / MYPAINT_TILE_SIZE + 1);
+    const int large_iterations = 20;
+    const float large_angle = 30.0;
+    const float large_aspect_ratio = 2.0;
+
+    mypaint_benchmark_start("render_dab_mask_large");
+    for (int i=0; i < large_iterations; i++) {
+        for (int t=0; t < tiles * tiles; t++) {
+            const float tx = (t % tiles - tiles / 2) * MYPAINT_TILE_SIZE;
+            const float ty = (t / tiles - tiles / 2) * MYPAINT_TILE_SIZE;
+            render_dab_mask(buffer, -tx, -ty, large_radius, hardness, softness, large_aspect_ratio, large_angle);
+        }
+    }
+    const int per_tile_duration = mypaint_benchmark_end();
+
+    mypaint_benchmark_start("render_dab_mask_geometry_large");
+    for (int i=0; i < large_iterations; i++) {
+        DabGeometry geometry;
+        dab_geometry_init(&geometry, large_radius, hardness, softness, large_aspect_ratio, large_angle);
+        for (int t=0; t < tiles * tiles; t++) {
+            const float tx = (t % tiles - tiles / 2) * MYPAINT_TILE_SIZE;
+            const float ty = (t / tiles - tiles / 2) * MYPAINT_TILE_SIZE;
+            render_dab_mask_geometry(buffer, -tx, -ty, &geometry);
+        }
+    }
+    const int per_dab_duration = mypaint_benchmark_end();
+    printf("radius %.0f dab on %d tiles: geometry per tile %d ms, per dab %d ms\n",
+           large_radius, tiles * tiles, per_tile_duration, per_dab_duration);
 }
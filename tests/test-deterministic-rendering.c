@@ -0,0 +1,77 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "mypaint-brush.h"
+#include "mypaint-fixed-tiled-surface.h"
+#include "testutils.h"
+
+#define SURFACE_SIZE 1000
+
+static const int thread_counts[] = {1, 2, 4, 8};
+
+typedef struct {
+    const char *brush;
+    float paint_mode;
+} RenderParams;
+
+static uint64_t
+render(const RenderParams *params, int threads)
+{
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    // The result must not depend on what else the process does with rand()
+    srand(threads);
+
+    MyPaintFixedTiledSurface *surface = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+    mypaint_fixed_tiled_surface_set_threaded(surface, TRUE);
+    mypaint_tiled_surface_set_deterministic((MyPaintTiledSurface *)surface, TRUE);
+    mypaint_tiled_surface_set_spectral_cache_budget((MyPaintTiledSurface *)surface, 4 * 1024 * 1024);
+
+    MyPaintBrush *brush = test_brush_load(params->brush);
+    mypaint_brush_set_base_value(brush, MYPAINT_BRUSH_SETTING_PAINT_MODE, params->paint_mode);
+    test_events_play((MyPaintSurface *)surface, brush, FALSE);
+
+    const uint64_t hash = test_surface_hash((MyPaintTiledSurface *)surface, SURFACE_SIZE, SURFACE_SIZE);
+
+    mypaint_brush_unref(brush);
+    mypaint_surface_unref((MyPaintSurface *)surface);
+    return hash;
+}
+
+int
+test_same_hash_for_all_thread_counts(void *user_data)
+{
+    const RenderParams *params = (const RenderParams *)user_data;
+    const uint64_t expected = render(params, thread_counts[0]);
+    int passed = 1;
+    for (size_t i = 1; i < TEST_CASES_NUMBER(thread_counts); i++) {
+        const uint64_t actual = render(params, thread_counts[i]);
+        printf("%s, %d threads: %016llx\n", params->brush, thread_counts[i], (unsigned long long)actual);
+        passed &= expect_true(actual == expected, "same tile bytes");
+    }
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    RenderParams smudge = {"impressionism", 0.0f};
+    RenderParams pigment = {"impressionism", 1.0f};
+    RenderParams plain = {"charcoal", 0.0f};
+
+    TestCase test_cases[] = {
+        {"/surface/deterministic/smudge", test_same_hash_for_all_thread_counts, &smudge},
+        {"/surface/deterministic/pigment", test_same_hash_for_all_thread_counts, &pigment},
+        {"/surface/deterministic/plain", test_same_hash_for_all_thread_counts, &plain},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
@@ -0,0 +1,93 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mypaint-fixed-tiled-surface.h"
+#include "testutils.h"
+
+static uint16_t
+read_channel(MyPaintFixedTiledSurface *surface, int x, int y, int channel)
+{
+    return test_surface_read_channel((MyPaintTiledSurface *)surface, x, y, channel);
+}
+
+static void
+draw_dab(MyPaintFixedTiledSurface *surface, float x, float y, float radius, float r, float g, float b)
+{
+    MyPaintSurface *s = (MyPaintSurface *)surface;
+    mypaint_surface_begin_atomic(s);
+    test_surface_draw_dab(s, x, y, radius, r, g, b);
+    mypaint_surface_end_atomic(s, NULL);
+}
+
+int
+test_lazy_allocation(void *user_data)
+{
+    // 256 MiB worth of tiles if they were all allocated up front
+    MyPaintFixedTiledSurface *surface = mypaint_fixed_tiled_surface_new(4096, 4096);
+    int private_tiles = -1;
+    int uniform_tiles = -1;
+    int passed = expect_true(surface != NULL, "surface created");
+
+    passed &= expect_int(1, mypaint_fixed_tiled_surface_get_tile_counts(surface, &private_tiles, &uniform_tiles),
+                         "only the blank tile is resident");
+    passed &= expect_int(0xffff, read_channel(surface, 4000, 4000, 0), "unwritten tiles are blank");
+    passed &= expect_int(0, private_tiles, "no private tiles");
+    passed &= expect_int(0, uniform_tiles, "no uniform tiles");
+
+    draw_dab(surface, 100, 100, 5, 1, 0, 0);
+    mypaint_fixed_tiled_surface_get_tile_counts(surface, &private_tiles, &uniform_tiles);
+    passed &= expect_true(private_tiles > 0 && private_tiles <= 4, "small dab only allocates the tiles it touches");
+    passed &= expect_int(0, read_channel(surface, 100, 100, 1), "dab is drawn");
+    passed &= expect_int(0xffff, read_channel(surface, 2000, 2000, 1), "other tiles stay blank");
+
+    mypaint_surface_unref((MyPaintSurface *)surface);
+    return passed;
+}
+
+int
+test_uniform_tiles_shared(void *user_data)
+{
+    MyPaintFixedTiledSurface *surface = mypaint_fixed_tiled_surface_new(1024, 1024);
+    int private_tiles = -1;
+    int uniform_tiles = -1;
+    int passed = 1;
+
+    // Covers the interior tiles completely
+    draw_dab(surface, 512, 512, 300, 0, 0, 1);
+    mypaint_fixed_tiled_surface_get_tile_counts(surface, &private_tiles, &uniform_tiles);
+    passed &= expect_int(1, uniform_tiles, "interior tiles share one buffer");
+    passed &= expect_true(private_tiles < 60, "only edge tiles are private");
+    passed &= expect_int(0, read_channel(surface, 512, 512, 0), "interior red");
+    passed &= expect_int(0x8000, read_channel(surface, 512, 512, 2), "interior blue");
+
+    // Writing to a shared tile must only change that tile
+    draw_dab(surface, 500, 500, 5, 0, 1, 0);
+    passed &= expect_int(0x8000, read_channel(surface, 500, 500, 1), "written tile changed");
+    passed &= expect_int(0, read_channel(surface, 600, 600, 1), "shared tile unchanged");
+    passed &= expect_int(0x8000, read_channel(surface, 600, 600, 2), "shared tile keeps its content");
+
+    // Erasing replaces the shared tile with a transparent one
+    MyPaintSurface *s = (MyPaintSurface *)surface;
+    mypaint_surface_begin_atomic(s);
+    mypaint_surface_draw_dab(s, 512, 512, 300, 0, 0, 0, 1.0, 1.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
+    mypaint_surface_end_atomic(s, NULL);
+    mypaint_fixed_tiled_surface_get_tile_counts(surface, &private_tiles, &uniform_tiles);
+    passed &= expect_int(1, uniform_tiles, "erased tiles share one buffer");
+    passed &= expect_int(0, read_channel(surface, 500, 500, 3), "erased tile is transparent");
+
+    mypaint_surface_unref((MyPaintSurface *)surface);
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    TestCase test_cases[] = {
+        {"/fixed_tiled_surface/tiles/lazy", test_lazy_allocation, NULL},
+        {"/fixed_tiled_surface/tiles/uniform", test_uniform_tiles_shared, NULL},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
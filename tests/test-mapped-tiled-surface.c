@@ -0,0 +1,100 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mypaint-mapped-tiled-surface.h"
+#include "mypaint-benchmark.h"
+#include "testutils.h"
+
+#define SURFACE_SIZE 65536
+// Distance between the dabs of the stress test
+#define GRID_SPACING 1024
+
+static uint16_t
+read_channel(MyPaintMappedTiledSurface *surface, int x, int y, int channel)
+{
+    return test_surface_read_channel((MyPaintTiledSurface *)surface, x, y, channel);
+}
+
+int
+test_sparse(void *user_data)
+{
+    MyPaintMappedTiledSurface *surface = mypaint_mapped_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE, NULL);
+    if (!expect_true(surface != NULL, "surface created")) {
+        return 0;
+    }
+    MyPaintSurface *s = mypaint_mapped_tiled_surface_interface(surface);
+    int passed = 1;
+
+    passed &= expect_int(0, mypaint_mapped_tiled_surface_get_tiles_stored(surface), "new surface stores no tiles");
+    passed &= expect_int(0, read_channel(surface, SURFACE_SIZE - 1, SURFACE_SIZE - 1, 3),
+                         "unwritten tiles are transparent");
+    passed &= expect_int(0, mypaint_mapped_tiled_surface_get_tiles_stored(surface), "reading stores no tiles");
+
+    mypaint_surface_begin_atomic(s);
+    test_surface_draw_dab(s, SURFACE_SIZE - 100, SURFACE_SIZE - 100, 10, 1, 0, 0);
+    mypaint_surface_end_atomic(s, NULL);
+
+    const int stored = mypaint_mapped_tiled_surface_get_tiles_stored(surface);
+    passed &= expect_true(stored > 0 && stored <= 4, "dab only stores the tiles it touches");
+    passed &= expect_int(1 << 15, read_channel(surface, SURFACE_SIZE - 100, SURFACE_SIZE - 100, 0), "dab red");
+    passed &= expect_int(1 << 15, read_channel(surface, SURFACE_SIZE - 100, SURFACE_SIZE - 100, 3), "dab alpha");
+    passed &= expect_int(0, read_channel(surface, 100, 100, 3), "other tiles stay transparent");
+
+    mypaint_surface_unref(s);
+    return passed;
+}
+
+int
+test_stress(void *user_data)
+{
+    MyPaintMappedTiledSurface *surface = mypaint_mapped_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE, NULL);
+    if (!expect_true(surface != NULL, "surface created")) {
+        return 0;
+    }
+    MyPaintSurface *s = mypaint_mapped_tiled_surface_interface(surface);
+    const int grid = SURFACE_SIZE / GRID_SPACING;
+    int passed = 1;
+
+    mypaint_benchmark_start("mapped_surface_stress");
+    // One row per transaction, so that many tiles are processed at once
+    for (int row = 0; row < grid; row++) {
+        mypaint_surface_begin_atomic(s);
+        for (int col = 0; col < grid; col++) {
+            // Centered on a tile
+            const float x = col * GRID_SPACING + MYPAINT_TILE_SIZE / 2;
+            const float y = row * GRID_SPACING + MYPAINT_TILE_SIZE / 2;
+            test_surface_draw_dab(s, x, y, 20, (float)col / grid, (float)row / grid, 0.5);
+        }
+        mypaint_surface_end_atomic(s, NULL);
+    }
+    const int duration = mypaint_benchmark_end();
+
+    const int stored = mypaint_mapped_tiled_surface_get_tiles_stored(surface);
+    printf("%d dabs, %d tiles stored in %d ms\n", grid * grid, stored, duration);
+    passed &= expect_int(grid * grid, stored, "only touched tiles are stored");
+
+    for (int row = 0; row < grid; row += 7) {
+        for (int col = 0; col < grid; col += 5) {
+            const int x = col * GRID_SPACING + MYPAINT_TILE_SIZE / 2;
+            const int y = row * GRID_SPACING + MYPAINT_TILE_SIZE / 2;
+            passed &= expect_int(1 << 15, read_channel(surface, x, y, 3), "dab alpha");
+            passed &= expect_int(0, read_channel(surface, x + GRID_SPACING / 2, y, 3), "between dabs");
+        }
+    }
+
+    mypaint_surface_unref(s);
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    TestCase test_cases[] = {
+        {"/mapped_tiled_surface/sparse", test_sparse, NULL},
+        {"/mapped_tiled_surface/stress", test_stress, NULL},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
@@ -0,0 +1,176 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mypaint-brush.h"
+#include "mypaint-fixed-tiled-surface.h"
+#include "testutils.h"
+#include "tiled-surface-private.h"
+
+#define SURFACE_SIZE 1000
+
+// Renders the whole stroke in a single transaction
+static uint64_t
+render(const char *brush_name, size_t max_bytes, size_t max_ops, MyPaintTiledSurfaceStats *stats)
+{
+    MyPaintFixedTiledSurface *surface = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+    MyPaintTiledSurface *tiled = (MyPaintTiledSurface *)surface;
+    mypaint_tiled_surface_set_deterministic(tiled, TRUE);
+    mypaint_tiled_surface_set_stats_enabled(tiled, TRUE);
+    mypaint_tiled_surface_set_queue_budget(tiled, max_bytes, max_ops);
+
+    MyPaintBrush *brush = test_brush_load(brush_name);
+    test_events_play((MyPaintSurface *)surface, brush, TRUE);
+
+    const uint64_t hash = test_surface_hash(tiled, SURFACE_SIZE, SURFACE_SIZE);
+    mypaint_tiled_surface_get_stats(tiled, stats);
+
+    mypaint_brush_unref(brush);
+    mypaint_surface_unref((MyPaintSurface *)surface);
+    return hash;
+}
+
+int
+test_same_result(void *user_data)
+{
+    const char *brush_name = (const char *)user_data;
+    MyPaintTiledSurfaceStats unbounded;
+    MyPaintTiledSurfaceStats by_ops;
+    MyPaintTiledSurfaceStats by_bytes;
+    int passed = 1;
+
+    const uint64_t expected = render(brush_name, 0, 0, &unbounded);
+    passed &= expect_true(unbounded.forced_flushes == 0, "no forced flushes without budget");
+
+    const uint64_t ops_hash = render(brush_name, 0, 50, &by_ops);
+    passed &= expect_true(ops_hash == expected, "same result with an op budget");
+    passed &= expect_true(by_ops.forced_flushes > 0, "op budget forces flushes");
+
+    const uint64_t bytes_hash = render(brush_name, 16 * 1024, 0, &by_bytes);
+    passed &= expect_true(bytes_hash == expected, "same result with a byte budget");
+    passed &= expect_true(by_bytes.forced_flushes > 0, "byte budget forces flushes");
+
+    printf("%s: %llu dabs, %llu forced flushes of %llu tiles (ops), %llu of %llu tiles (bytes)\n", brush_name,
+           (unsigned long long)unbounded.dabs_queued,
+           (unsigned long long)by_ops.forced_flushes, (unsigned long long)by_ops.forced_flush_tiles,
+           (unsigned long long)by_bytes.forced_flushes, (unsigned long long)by_bytes.forced_flush_tiles);
+    passed &= expect_true(by_ops.ops_processed == unbounded.ops_processed, "every op processed once");
+    return passed;
+}
+
+int
+test_unfinished_transaction(void *user_data)
+{
+    MyPaintFixedTiledSurface *surface = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+    MyPaintTiledSurface *tiled = (MyPaintTiledSurface *)surface;
+    MyPaintSurface *s = (MyPaintSurface *)surface;
+    MyPaintTiledSurfaceStats stats;
+    int passed = 1;
+
+    mypaint_tiled_surface_set_stats_enabled(tiled, TRUE);
+    mypaint_tiled_surface_set_queue_budget(tiled, 0, 1000);
+
+    // The transaction is never ended
+    mypaint_surface_begin_atomic(s);
+    for (int i = 0; i < 2000; i++) {
+        mypaint_surface_draw_dab(s, (i * 37) % SURFACE_SIZE, (i * 91) % SURFACE_SIZE, 200,
+                                 1, 0, 0, 0.1, 0.5, 0.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
+    }
+    mypaint_tiled_surface_get_stats(tiled, &stats);
+
+    passed &= expect_true(stats.forced_flushes > 0, "forced flushes");
+    passed &= expect_true(stats.ops_queued - stats.ops_processed <= 1000, "queue kept within budget");
+
+    mypaint_surface_unref(s);
+    return passed;
+}
+
+static MyPaintTileRequestStartFunction fixed_request_start;
+static MyPaintTileRequestEndFunction fixed_request_end;
+
+// Tile 0, 0 cannot be requested
+static void
+failing_request_start(MyPaintTiledSurface *self, MyPaintTileRequest *request)
+{
+    if (request->tx == 0 && request->ty == 0) {
+        request->buffer = NULL;
+        return;
+    }
+    fixed_request_start(self, request);
+}
+
+static void
+failing_request_end(MyPaintTiledSurface *self, MyPaintTileRequest *request)
+{
+    if (request->buffer) {
+        fixed_request_end(self, request);
+    }
+}
+
+static void
+failing_requests_start(MyPaintTiledSurface *self, MyPaintTileRequest *requests, int requests_n)
+{
+    for (int i = 0; i < requests_n; i++) {
+        failing_request_start(self, &requests[i]);
+    }
+}
+
+static void
+failing_requests_end(MyPaintTiledSurface *self, MyPaintTileRequest *requests, int requests_n)
+{
+    for (int i = 0; i < requests_n; i++) {
+        failing_request_end(self, &requests[i]);
+    }
+}
+
+int
+test_failed_requests(void *user_data)
+{
+    const gboolean bulk = user_data != NULL;
+    MyPaintFixedTiledSurface *surface = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+    MyPaintTiledSurface *tiled = (MyPaintTiledSurface *)surface;
+    MyPaintSurface *s = (MyPaintSurface *)surface;
+    int passed = 1;
+
+    fixed_request_start = tiled->tile_request_start;
+    fixed_request_end = tiled->tile_request_end;
+    tiled->tile_request_start = failing_request_start;
+    tiled->tile_request_end = failing_request_end;
+    if (bulk) {
+        tiled->tile_requests_start = failing_requests_start;
+        tiled->tile_requests_end = failing_requests_end;
+    }
+
+    // One dab on the tile that fails, one on a tile that does not
+    mypaint_surface_begin_atomic(s);
+    mypaint_surface_draw_dab(s, 10, 10, 5, 1, 0, 0, 1.0, 1.0, 0.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
+    mypaint_surface_draw_dab(s, 300, 300, 5, 1, 0, 0, 1.0, 1.0, 0.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
+    mypaint_surface_end_atomic(s, NULL);
+
+    passed &= expect_true(operation_queue_get_queued_ops(tiled->operation_queue) == 0,
+                          "no operations left queued");
+    passed &= expect_true(operation_queue_get_queued_bytes(tiled->operation_queue) == 0,
+                          "no dabs left queued");
+
+    // The tile that could be requested was painted
+    passed &= expect_true(test_surface_read_channel(tiled, 300, 300, 3) > 0, "other tile painted");
+
+    mypaint_surface_unref(s);
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    TestCase test_cases[] = {
+        {"/tiled_surface/queue_budget/charcoal", test_same_result, (void *)"charcoal"},
+        {"/tiled_surface/queue_budget/impressionism", test_same_result, (void *)"impressionism"},
+        {"/tiled_surface/queue_budget/unfinished_transaction", test_unfinished_transaction, NULL},
+        {"/tiled_surface/queue_budget/failed_requests", test_failed_requests, NULL},
+        {"/tiled_surface/queue_budget/failed_requests_bulk", test_failed_requests, (void *)"bulk"},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
@@ -0,0 +1,184 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include "helpers.h"
+#include "testutils.h"
+
+// Largest acceptable deviation from the reference implementation, in
+// normalized rgb units. The per-pixel mixers use the fastapprox
+// approximations of log2 and exp2, the exact variants only differ by
+// float rounding.
+static const float fast_tolerance = 1.0f / 1024;
+static const float exact_tolerance = 1e-5f;
+
+static const int steps = 8;
+
+// Straightforward WGM of two straight rgb colors, as the brush modes
+// used to compute it.
+static void
+reference_mix(const float *a, const float *b, float fac_a, float *rgb_)
+{
+    float spectral_a[10] = {0};
+    float spectral_b[10] = {0};
+    float spectral_mix[10] = {0};
+    rgb_to_spectral(a[0], a[1], a[2], spectral_a);
+    rgb_to_spectral(b[0], b[1], b[2], spectral_b);
+    for (int i = 0; i < 10; i++) {
+        spectral_mix[i] = powf(spectral_a[i], fac_a) * powf(spectral_b[i], 1.0f - fac_a);
+    }
+    spectral_to_rgb(spectral_mix, rgb_);
+}
+
+static float
+max_difference(const float *expected, const float *actual)
+{
+    float diff = 0;
+    for (int i = 0; i < 3; i++) {
+        diff = MAX(diff, fabsf(expected[i] - actual[i]));
+    }
+    return diff;
+}
+
+static int
+report(float max_diff, float tolerance, const char *description)
+{
+    printf("%s: max difference %g\n", description, max_diff);
+    return expect_true(max_diff <= tolerance, description);
+}
+
+int
+test_log_spectral_roundtrip(void *user_data)
+{
+    float max_diff = 0;
+    for (int r = 0; r <= steps; r++) {
+        for (int g = 0; g <= steps; g++) {
+            for (int b = 0; b <= steps; b++) {
+                const float c[3] = {(float)r / steps, (float)g / steps, (float)b / steps};
+                float spectral[10] = {0};
+                float log_spectral[10];
+                float expected[3];
+                float actual[3];
+                rgb_to_spectral(c[0], c[1], c[2], spectral);
+                spectral_to_rgb(spectral, expected);
+                rgb_to_log_spectral(c[0], c[1], c[2], log_spectral);
+                log_spectral_to_rgb(log_spectral, actual);
+                max_diff = MAX(max_diff, max_difference(expected, actual));
+            }
+        }
+    }
+    return report(max_diff, exact_tolerance, "log spectral roundtrip");
+}
+
+int
+test_log_spectral_mix(void *user_data)
+{
+    float max_fused = 0;
+    float max_split = 0;
+    const float facs[] = {0.0f, 0.01f, 0.25f, 0.5f, 0.75f, 0.99f, 1.0f};
+
+    for (int ia = 0; ia <= steps; ia += 2) {
+        for (int ib = 0; ib <= steps; ib++) {
+            for (size_t f = 0; f < TEST_CASES_NUMBER(facs); f++) {
+                // Two families of colors, covering greys and saturated hues
+                const float a[3] = {(float)ia / steps, 1.0f - (float)ia / steps, 0.5f};
+                const float b[3] = {(float)ib / steps, 0.2f, 1.0f - (float)ib / steps};
+                float log_a[10];
+                float log_b[10];
+                float expected[3];
+                float fused[3];
+                float split[3];
+
+                reference_mix(a, b, facs[f], expected);
+                rgb_to_log_spectral(a[0], a[1], a[2], log_a);
+                rgb_to_log_spectral_fast(b[0], b[1], b[2], log_b);
+                log_spectral_mix_rgb(log_a, facs[f], b[0], b[1], b[2], fused);
+                log_spectral_mix_in_place(log_a, facs[f], log_b, split);
+
+                max_fused = MAX(max_fused, max_difference(expected, fused));
+                max_split = MAX(max_split, max_difference(expected, split));
+            }
+        }
+    }
+    return report(max_fused, fast_tolerance, "fused mix") &&
+           report(max_split, fast_tolerance, "split mix");
+}
+
+int
+test_mix_colors(void *user_data)
+{
+    float max_diff = 0;
+    for (int i = 0; i <= steps; i++) {
+        float a[4] = {(float)i / steps, 0.3f, 1.0f - (float)i / steps, 1.0f};
+        float b[4] = {0.9f, (float)i / steps, 0.1f, 0.5f};
+        const float fac = 0.3f;
+        float expected[3];
+
+        // Same weighting as mix_colors, in pure paint mode
+        const float sfac_a = fac * a[3] / (a[3] + b[3] * (1.0f - fac));
+        reference_mix(a, b, sfac_a, expected);
+        float actual[4];
+        mix_colors(a, b, fac, 1.0f, actual);
+        max_diff = MAX(max_diff, max_difference(expected, actual));
+    }
+    return report(max_diff, exact_tolerance, "mix_colors");
+}
+
+int
+test_mix_colors_batch(void *user_data)
+{
+    // More than one chunk, with a partial one at the end
+    const int n = 19;
+    const float paint_modes[] = {0.0f, 0.4f, 1.0f};
+    float a[n][4];
+    float b[n][4];
+    float fac[n];
+    float batch[n][4];
+    int passed = 1;
+
+    for (int j = 0; j < n; j++) {
+        const float t = (float)j / n;
+        a[j][0] = t; a[j][1] = 1.0f - t; a[j][2] = 0.5f; a[j][3] = j % 3 ? 1.0f : 0.0f;
+        b[j][0] = 0.2f; b[j][1] = t; b[j][2] = 1.0f - t; b[j][3] = 0.7f;
+        fac[j] = t;
+    }
+
+    for (size_t p = 0; p < TEST_CASES_NUMBER(paint_modes); p++) {
+        mix_colors_n(&a[0][0], &b[0][0], fac, paint_modes[p], &batch[0][0], n);
+        for (int j = 0; j < n; j++) {
+            float single[4];
+            mix_colors(a[j], b[j], fac[j], paint_modes[p], single);
+            for (int i = 0; i < 4; i++) {
+                passed &= expect_float(single[i], batch[j][i], "batched mix");
+            }
+        }
+        // Mixing in place must give the same result
+        float in_place[n][4];
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < 4; i++) {
+                in_place[j][i] = a[j][i];
+            }
+        }
+        mix_colors_n(&in_place[0][0], &b[0][0], fac, paint_modes[p], &in_place[0][0], n);
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < 4; i++) {
+                passed &= expect_float(batch[j][i], in_place[j][i], "in-place mix");
+            }
+        }
+    }
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    TestCase test_cases[] = {
+        {"/spectral/log/roundtrip", test_log_spectral_roundtrip, NULL},
+        {"/spectral/log/mix", test_log_spectral_mix, NULL},
+        {"/spectral/mix_colors", test_mix_colors, NULL},
+        {"/spectral/mix_colors/batch", test_mix_colors_batch, NULL},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
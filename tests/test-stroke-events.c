@@ -0,0 +1,161 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "mypaint-brush.h"
+#include "mypaint-fixed-tiled-surface.h"
+#include "mypaint-utils-stroke-player.h"
+#include "testutils.h"
+
+#define SURFACE_SIZE 500
+#define EVENTS_N 600
+
+static MyPaintBrush *
+load_brush(const char *name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/tests/brushes/%s.myb", LIBMYPAINT_TESTING_ABS_TOP_SRCDIR, name);
+    char *brush_data = read_file(path);
+    MyPaintBrush *brush = mypaint_brush_new();
+    mypaint_brush_from_defaults(brush);
+    mypaint_brush_from_string(brush, brush_data);
+    free(brush_data);
+    return brush;
+}
+
+static int
+surfaces_equal(MyPaintFixedTiledSurface *a, MyPaintFixedTiledSurface *b)
+{
+    const int tiles_n = (SURFACE_SIZE + MYPAINT_TILE_SIZE - 1) / MYPAINT_TILE_SIZE;
+    int equal = 1;
+    for (int ty = 0; ty < tiles_n; ty++) {
+        for (int tx = 0; tx < tiles_n; tx++) {
+            MyPaintTileRequest request_a;
+            MyPaintTileRequest request_b;
+            mypaint_tile_request_init(&request_a, 0, tx, ty, TRUE);
+            mypaint_tile_request_init(&request_b, 0, tx, ty, TRUE);
+            mypaint_tiled_surface_tile_request_start((MyPaintTiledSurface *)a, &request_a);
+            mypaint_tiled_surface_tile_request_start((MyPaintTiledSurface *)b, &request_b);
+            equal &= memcmp(request_a.buffer, request_b.buffer,
+                            MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4 * sizeof(uint16_t)) == 0;
+            mypaint_tiled_surface_tile_request_end((MyPaintTiledSurface *)a, &request_a);
+            mypaint_tiled_surface_tile_request_end((MyPaintTiledSurface *)b, &request_b);
+        }
+    }
+    return equal;
+}
+
+// Wavy strokes with pauses in between, so that some events finish a stroke
+static void
+make_events(MyPaintMotionEvent *events)
+{
+    for (int i = 0; i < EVENTS_N; i++) {
+        const float t = (float)(i % 200) / 200;
+        MyPaintMotionEvent *e = &events[i];
+        e->x = 50 + 400 * t;
+        e->y = 100 + (i / 200) * 150 + 40 * sinf(t * 12);
+        e->pressure = t < 0.9f ? 0.3f + 0.5f * t : 0.0f;
+        e->xtilt = 0.5f * cosf(t * 5);
+        e->ytilt = 0.3f;
+        e->dtime = i % 200 == 0 ? 2.0 : 0.01;
+        e->viewzoom = 1.0f;
+        e->viewrotation = 0.0f;
+        e->barrel_rotation = t;
+    }
+}
+
+int
+test_stroke_to_events(void *user_data)
+{
+    MyPaintMotionEvent events[EVENTS_N];
+    gboolean finished[EVENTS_N];
+    make_events(events);
+
+    MyPaintFixedTiledSurface *single_surface = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+    MyPaintFixedTiledSurface *batch_surface = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+    mypaint_tiled_surface_set_deterministic((MyPaintTiledSurface *)single_surface, TRUE);
+    mypaint_tiled_surface_set_deterministic((MyPaintTiledSurface *)batch_surface, TRUE);
+    MyPaintBrush *single_brush = load_brush((const char *)user_data);
+    MyPaintBrush *batch_brush = load_brush((const char *)user_data);
+
+    int passed = 1;
+    int finished_n = 0;
+    for (int i = 0; i < EVENTS_N; i++) {
+        const MyPaintMotionEvent *e = &events[i];
+        mypaint_surface_begin_atomic((MyPaintSurface *)single_surface);
+        const gboolean single_finished = mypaint_brush_stroke_to(
+            single_brush, (MyPaintSurface *)single_surface, e->x, e->y, e->pressure, e->xtilt, e->ytilt,
+            e->dtime, e->viewzoom, e->viewrotation, e->barrel_rotation, FALSE) != 0;
+        mypaint_surface_end_atomic((MyPaintSurface *)single_surface, NULL);
+        finished_n += single_finished;
+        finished[i] = single_finished;
+    }
+
+    gboolean batch_finished[EVENTS_N];
+    mypaint_surface_begin_atomic((MyPaintSurface *)batch_surface);
+    const int batch_finished_n = mypaint_brush_stroke_to_events(
+        batch_brush, (MyPaintSurface *)batch_surface, events, EVENTS_N, FALSE, batch_finished);
+    mypaint_surface_end_atomic((MyPaintSurface *)batch_surface, NULL);
+
+    passed &= expect_true(finished_n > 0, "some strokes finish");
+    passed &= expect_int(finished_n, batch_finished_n, "number of finished strokes");
+    for (int i = 0; i < EVENTS_N; i++) {
+        passed &= expect_int(finished[i], batch_finished[i], "stroke finished flag");
+    }
+    passed &= expect_true(surfaces_equal(single_surface, batch_surface), "same pixels");
+
+    mypaint_brush_unref(single_brush);
+    mypaint_brush_unref(batch_brush);
+    mypaint_surface_unref((MyPaintSurface *)single_surface);
+    mypaint_surface_unref((MyPaintSurface *)batch_surface);
+    return passed;
+}
+
+int
+test_stroke_player_batched(void *user_data)
+{
+    char *event_data = read_file(LIBMYPAINT_TESTING_ABS_TOP_SRCDIR "/tests/events/painting30sec.dat");
+    MyPaintFixedTiledSurface *surfaces[2];
+    MyPaintBrush *brushes[2];
+
+    for (int i = 0; i < 2; i++) {
+        surfaces[i] = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+        mypaint_tiled_surface_set_deterministic((MyPaintTiledSurface *)surfaces[i], TRUE);
+        brushes[i] = load_brush((const char *)user_data);
+        MyPaintUtilsStrokePlayer *player = mypaint_utils_stroke_player_new();
+        mypaint_utils_stroke_player_set_brush(player, brushes[i]);
+        mypaint_utils_stroke_player_set_surface(player, (MyPaintSurface *)surfaces[i]);
+        mypaint_utils_stroke_player_set_source_data(player, event_data);
+        mypaint_utils_stroke_player_set_scale(player, 0.5);
+        if (i == 0) {
+            mypaint_utils_stroke_player_run_sync(player);
+        } else {
+            mypaint_utils_stroke_player_run_batched(player, 100);
+        }
+        mypaint_utils_stroke_player_free(player);
+    }
+
+    const int passed = expect_true(surfaces_equal(surfaces[0], surfaces[1]), "same pixels");
+
+    for (int i = 0; i < 2; i++) {
+        mypaint_brush_unref(brushes[i]);
+        mypaint_surface_unref((MyPaintSurface *)surfaces[i]);
+    }
+    free(event_data);
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    TestCase test_cases[] = {
+        {"/brush/stroke_to_events/charcoal", test_stroke_to_events, (void *)"charcoal"},
+        {"/brush/stroke_to_events/impressionism", test_stroke_to_events, (void *)"impressionism"},
+        {"/brush/stroke_to_events/player", test_stroke_player_batched, (void *)"bulk"},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
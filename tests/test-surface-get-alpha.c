@@ -0,0 +1,123 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include "mypaint-compressed-tiled-surface.h"
+#include "mypaint-benchmark.h"
+#include "testutils.h"
+
+#define SURFACE_SIZE 1000
+
+static void
+draw_dab(MyPaintSurface *surface, float x, float y, float radius, float opaque)
+{
+    mypaint_surface_draw_dab(surface, x, y, radius, 1, 0, 0, opaque, 0.5, 0.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
+}
+
+static float
+alpha_from_color(MyPaintSurface *surface, float x, float y, float radius)
+{
+    float r, g, b, a;
+    mypaint_surface_get_color(surface, x, y, radius, &r, &g, &b, &a, 1.0);
+    return a;
+}
+
+static MyPaintSurface *
+painted_surface(void)
+{
+    MyPaintCompressedTiledSurface *surface = mypaint_compressed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE, 1024);
+    MyPaintSurface *s = mypaint_compressed_tiled_surface_interface(surface);
+    mypaint_surface_begin_atomic(s);
+    for (int i = 0; i < 40; i++) {
+        draw_dab(s, 100 + i * 20, 500 + 200 * sinf(i * 0.3f), 20 + i, 0.1f + 0.02f * i);
+    }
+    mypaint_surface_end_atomic(s, NULL);
+    // Left pending, must be processed by the queries
+    mypaint_surface_begin_atomic(s);
+    draw_dab(s, 500, 500, 30, 0.5f);
+    return s;
+}
+
+int
+test_matches_get_color(void *user_data)
+{
+    MyPaintSurface *s = painted_surface();
+    int passed = 1;
+
+    passed &= expect_float(0.0, mypaint_surface_get_alpha(s, 500, 100, 5), "transparent");
+    passed &= expect_true(mypaint_surface_get_alpha(s, 500, 500, 1) > 0.4, "pending dab processed");
+
+    // Small radii are sampled completely by get_color
+    int matches = 1;
+    for (int i = 0; i < 100; i++) {
+        const float x = 50 + i * 9.1f;
+        const float y = 300 + i * 4.3f;
+        const float expected = alpha_from_color(s, x, y, 2);
+        const float actual = mypaint_surface_get_alpha(s, x, y, 2);
+        if (fabsf(expected - actual) > 1e-3) {
+            printf("alpha at (%f, %f): %f, expected %f\n", x, y, actual, expected);
+            matches = 0;
+        }
+    }
+    passed &= expect_true(matches, "same alpha as get_color");
+
+    mypaint_surface_end_atomic(s, NULL);
+    mypaint_surface_unref(s);
+    return passed;
+}
+
+int
+test_fallback(void *user_data)
+{
+    MyPaintSurface *s = painted_surface();
+    s->get_alpha = NULL;
+    const float expected = alpha_from_color(s, 400, 500, 10);
+    const float actual = mypaint_surface_get_alpha(s, 400, 500, 10);
+    mypaint_surface_end_atomic(s, NULL);
+    mypaint_surface_unref(s);
+    return expect_float(expected, actual, "get_color used without get_alpha vfunc");
+}
+
+int
+test_benchmark(void *user_data)
+{
+    const float radius = *(const float *)user_data;
+    MyPaintSurface *s = painted_surface();
+    mypaint_surface_end_atomic(s, NULL);
+    float sum_color = 0;
+    float sum_alpha = 0;
+
+    mypaint_benchmark_start("get_color");
+    for (int i = 0; i < 1000; i++) {
+        sum_color += alpha_from_color(s, 100 + (i % 80) * 10, 500, radius);
+    }
+    const int color_ms = mypaint_benchmark_end();
+
+    mypaint_benchmark_start("get_alpha");
+    for (int i = 0; i < 1000; i++) {
+        sum_alpha += mypaint_surface_get_alpha(s, 100 + (i % 80) * 10, 500, radius);
+    }
+    const int alpha_ms = mypaint_benchmark_end();
+
+    printf("radius %.0f: get_color %d ms, get_alpha %d ms, mean alpha %f / %f\n",
+           radius, color_ms, alpha_ms, sum_color / 1000, sum_alpha / 1000);
+    mypaint_surface_unref(s);
+    // get_color only samples part of large dabs
+    return expect_true(fabsf(sum_color - sum_alpha) / 1000 < 0.05, "similar alpha");
+}
+
+int
+main(int argc, char **argv)
+{
+    static const float small = 5;
+    static const float large = 60;
+    TestCase test_cases[] = {
+        {"/surface/get_alpha/matches_get_color", test_matches_get_color, NULL},
+        {"/surface/get_alpha/fallback", test_fallback, NULL},
+        {"/surface/get_alpha/benchmark/small", test_benchmark, (void *)&small},
+        {"/surface/get_alpha/benchmark/large", test_benchmark, (void *)&large},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
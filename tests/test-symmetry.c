@@ -0,0 +1,278 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mypaint-fixed-tiled-surface.h"
+#include "mypaint-symmetry.h"
+#include "testutils.h"
+
+#define SURFACE_SIZE 512
+#define PIXEL_CHANNELS (SURFACE_SIZE * SURFACE_SIZE * 4)
+
+typedef struct {
+    MyPaintSymmetryType type;
+    int lines;
+} SymmetryCase;
+
+typedef struct {
+    MyPaintSymmetryType type;
+    float center;
+    gboolean mirrored; // see mypaint_tiled_surface_set_mirrored_symmetry()
+} MirrorCase;
+
+static void
+draw_dab(MyPaintSurface *surface, float x, float y, float angle, int i)
+{
+    mypaint_surface_draw_dab(surface, x, y, 3 + i % 9, 0.3, 0.6, 0.1 * (i % 10), 0.7, 0.8, 0.1, 1.0,
+                             1.0 + (i % 3), angle, 0.0, 0.0, 0.0, 0.0, 0.0);
+}
+
+// The copies that the symmetry pass of draw_dab is expected to make, drawn one by one
+static void
+draw_copies(MyPaintSurface *surface, const MyPaintSymmetryData *data, float x, float y, float angle, int i)
+{
+    const MyPaintSymmetryState symm = data->state_current;
+    const MyPaintTransform *matrices = data->symmetry_matrices;
+    const float rot_angle = 360.0 / symm.num_lines;
+    float x_out, y_out;
+
+    switch (symm.type) {
+    case MYPAINT_SYMMETRY_TYPE_VERTICAL:
+        mypaint_transform_point(&matrices[0], x, y, &x_out, &y_out);
+        draw_dab(surface, x_out, y_out, -2.0 * (90 + symm.angle) - angle, i);
+        break;
+    case MYPAINT_SYMMETRY_TYPE_HORIZONTAL:
+        mypaint_transform_point(&matrices[0], x, y, &x_out, &y_out);
+        draw_dab(surface, x_out, y_out, -2.0 * symm.angle - angle, i);
+        break;
+    case MYPAINT_SYMMETRY_TYPE_VERTHORZ:
+        mypaint_transform_point(&matrices[0], x, y, &x_out, &y_out);
+        draw_dab(surface, x_out, y_out, -2.0 * symm.angle - angle, i);
+        mypaint_transform_point(&matrices[1], x, y, &x_out, &y_out);
+        draw_dab(surface, x_out, y_out, angle, i);
+        mypaint_transform_point(&matrices[2], x, y, &x_out, &y_out);
+        draw_dab(surface, x_out, y_out, -2.0 * symm.angle - angle, i);
+        break;
+    case MYPAINT_SYMMETRY_TYPE_SNOWFLAKE:
+        for (int dab_count = 0; dab_count < symm.num_lines; dab_count++) {
+            const int base_idx = symm.num_lines - 1;
+            const float base_angle = -2 * symm.angle - angle;
+            mypaint_transform_point(&matrices[base_idx + dab_count], x, y, &x_out, &y_out);
+            draw_dab(surface, x_out, y_out, base_angle - dab_count * rot_angle, i);
+        }
+        // fall through
+    case MYPAINT_SYMMETRY_TYPE_ROTATIONAL:
+        for (int dab_count = 1; dab_count < symm.num_lines; dab_count++) {
+            mypaint_transform_point(&matrices[dab_count - 1], x, y, &x_out, &y_out);
+            draw_dab(surface, x_out, y_out, angle - dab_count * rot_angle, i);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+int
+test_same_as_single_dabs(void *user_data)
+{
+    const SymmetryCase *test = (const SymmetryCase *)user_data;
+    MyPaintFixedTiledSurface *symmetric = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+    MyPaintFixedTiledSurface *single = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+    MyPaintSurface *a = (MyPaintSurface *)symmetric;
+    MyPaintSurface *b = (MyPaintSurface *)single;
+
+    const float center = SURFACE_SIZE / 2 + 0.3;
+    const float symmetry_angle = 12.5;
+    mypaint_tiled_surface_set_symmetry_state((MyPaintTiledSurface *)symmetric, TRUE, center, center,
+                                             symmetry_angle, test->type, test->lines);
+    MyPaintSymmetryData data = mypaint_default_symmetry_data();
+    mypaint_symmetry_set_pending(&data, TRUE, center, center, symmetry_angle, test->type, test->lines);
+    mypaint_update_symmetry_state(&data);
+
+    mypaint_surface_begin_atomic(a);
+    mypaint_surface_begin_atomic(b);
+    for (int i = 0; i < 100; i++) {
+        const float x = center + 20 + (i * 37) % 200;
+        const float y = center - 100 + (i * 53) % 150;
+        const float angle = i * 7.0 - 90.0;
+        draw_dab(a, x, y, angle, i);
+        draw_dab(b, x, y, angle, i);
+        draw_copies(b, &data, x, y, angle, i);
+    }
+    mypaint_surface_end_atomic(a, NULL);
+    mypaint_surface_end_atomic(b, NULL);
+
+    int same = 1;
+    const int tiles_n = SURFACE_SIZE / MYPAINT_TILE_SIZE;
+    for (int ty = 0; ty < tiles_n; ty++) {
+        for (int tx = 0; tx < tiles_n; tx++) {
+            MyPaintTileRequest request_a;
+            MyPaintTileRequest request_b;
+            mypaint_tile_request_init(&request_a, 0, tx, ty, TRUE);
+            mypaint_tile_request_init(&request_b, 0, tx, ty, TRUE);
+            mypaint_tiled_surface_tile_request_start((MyPaintTiledSurface *)symmetric, &request_a);
+            mypaint_tiled_surface_tile_request_start((MyPaintTiledSurface *)single, &request_b);
+            if (memcmp(request_a.buffer, request_b.buffer, MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4 * sizeof(uint16_t))) {
+                printf("tile %d, %d differs\n", tx, ty);
+                same = 0;
+            }
+            mypaint_tiled_surface_tile_request_end((MyPaintTiledSurface *)symmetric, &request_a);
+            mypaint_tiled_surface_tile_request_end((MyPaintTiledSurface *)single, &request_b);
+        }
+    }
+
+    mypaint_symmetry_data_destroy(&data);
+    mypaint_surface_unref(a);
+    mypaint_surface_unref(b);
+    return expect_true(same, "same result as drawing each copy");
+}
+
+// Copies all tiles of the surface into pixels, row by row
+static void
+read_pixels(MyPaintTiledSurface *surface, uint16_t *pixels)
+{
+    const int tiles_n = SURFACE_SIZE / MYPAINT_TILE_SIZE;
+    for (int ty = 0; ty < tiles_n; ty++) {
+        for (int tx = 0; tx < tiles_n; tx++) {
+            MyPaintTileRequest request;
+            mypaint_tile_request_init(&request, 0, tx, ty, TRUE);
+            mypaint_tiled_surface_tile_request_start(surface, &request);
+            for (int y = 0; y < MYPAINT_TILE_SIZE; y++) {
+                const int row = ty * MYPAINT_TILE_SIZE + y;
+                memcpy(pixels + (row * SURFACE_SIZE + tx * MYPAINT_TILE_SIZE) * 4,
+                       request.buffer + y * MYPAINT_TILE_SIZE * 4, MYPAINT_TILE_SIZE * 4 * sizeof(uint16_t));
+            }
+            mypaint_tiled_surface_tile_request_end(surface, &request);
+        }
+    }
+}
+
+// With the axes on tile boundaries or through the middle of tiles, the result
+// is the same as drawing each copy separately. With mirrored symmetry, the
+// masks of reflected dabs are flipped ones of the original instead: the result
+// is a mirror image, and close to drawing each copy separately.
+int
+test_aligned_axes(void *user_data)
+{
+    const MirrorCase *test = (const MirrorCase *)user_data;
+    MyPaintFixedTiledSurface *symmetric = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+    MyPaintFixedTiledSurface *single = mypaint_fixed_tiled_surface_new(SURFACE_SIZE, SURFACE_SIZE);
+    MyPaintSurface *a = (MyPaintSurface *)symmetric;
+    MyPaintSurface *b = (MyPaintSurface *)single;
+    mypaint_tiled_surface_set_stats_enabled((MyPaintTiledSurface *)symmetric, TRUE);
+    mypaint_tiled_surface_set_mirrored_symmetry((MyPaintTiledSurface *)symmetric, test->mirrored);
+
+    const float center = test->center;
+    mypaint_tiled_surface_set_symmetry_state((MyPaintTiledSurface *)symmetric, TRUE, center, center,
+                                             0.0, test->type, 2);
+    MyPaintSymmetryData data = mypaint_default_symmetry_data();
+    mypaint_symmetry_set_pending(&data, TRUE, center, center, 0.0, test->type, 2);
+    mypaint_update_symmetry_state(&data);
+
+    mypaint_surface_begin_atomic(a);
+    mypaint_surface_begin_atomic(b);
+    for (int i = 0; i < 100; i++) {
+        // Dabs that overlap their own reflection are blended in the same order on
+        // both sides, and the result is not a mirror image. Away from the axes:
+        const float x = center + 20 + (i * 37) % 200;
+        const float y = center + 20 + (i * 53) % 150;
+        const float angle = i * 7.0 - 90.0;
+        draw_dab(a, x, y, angle, i);
+        draw_dab(b, x, y, angle, i);
+        draw_copies(b, &data, x, y, angle, i);
+    }
+    mypaint_surface_end_atomic(a, NULL);
+    mypaint_surface_end_atomic(b, NULL);
+
+    uint16_t *pixels_a = (uint16_t *)malloc(PIXEL_CHANNELS * sizeof(uint16_t));
+    uint16_t *pixels_b = (uint16_t *)malloc(PIXEL_CHANNELS * sizeof(uint16_t));
+    read_pixels((MyPaintTiledSurface *)symmetric, pixels_a);
+    read_pixels((MyPaintTiledSurface *)single, pixels_b);
+
+    const int flip_x = test->type != MYPAINT_SYMMETRY_TYPE_HORIZONTAL;
+    const int flip_y = test->type != MYPAINT_SYMMETRY_TYPE_VERTICAL;
+    const int mirror_sum = 2 * center - 1;
+    int mirrored = 1;
+    int max_difference = 0;
+    for (int y = 0; y < SURFACE_SIZE; y++) {
+        for (int x = 0; x < SURFACE_SIZE; x++) {
+            const int mx = flip_x ? mirror_sum - x : x;
+            const int my = flip_y ? mirror_sum - y : y;
+            for (int c = 0; c < 4; c++) {
+                const int value = pixels_a[(y * SURFACE_SIZE + x) * 4 + c];
+                if (mx >= 0 && mx < SURFACE_SIZE && my >= 0 && my < SURFACE_SIZE &&
+                    value != pixels_a[(my * SURFACE_SIZE + mx) * 4 + c]) {
+                    mirrored = 0;
+                }
+                const int difference = abs(value - pixels_b[(y * SURFACE_SIZE + x) * 4 + c]);
+                if (difference > max_difference) {
+                    max_difference = difference;
+                }
+            }
+        }
+    }
+
+    MyPaintTiledSurfaceStats stats;
+    mypaint_tiled_surface_get_stats((MyPaintTiledSurface *)symmetric, &stats);
+    printf("%llu masks rendered, %llu reused, largest difference %d\n", (unsigned long long)stats.mask_renders,
+           (unsigned long long)stats.masks_reused, max_difference);
+
+    int passed = 1;
+    if (test->mirrored) {
+        passed &= expect_true(mirrored, "exact mirror image");
+        passed &= expect_true(max_difference <= 32, "close to drawing each copy");
+        // Ideally, each mask rendered is reused for every copy
+        const int copies = test->type == MYPAINT_SYMMETRY_TYPE_VERTHORZ ? 3 : 1;
+        passed &= expect_true(stats.masks_reused * 10 >= stats.mask_renders * copies * 9, "masks reused");
+    } else {
+        passed &= expect_true(max_difference == 0, "same result as drawing each copy");
+        passed &= expect_true(stats.masks_reused == 0, "no masks reused");
+    }
+
+    free(pixels_a);
+    free(pixels_b);
+    mypaint_symmetry_data_destroy(&data);
+    mypaint_surface_unref(a);
+    mypaint_surface_unref(b);
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const SymmetryCase vertical = {MYPAINT_SYMMETRY_TYPE_VERTICAL, 2};
+    static const SymmetryCase horizontal = {MYPAINT_SYMMETRY_TYPE_HORIZONTAL, 2};
+    static const SymmetryCase verthorz = {MYPAINT_SYMMETRY_TYPE_VERTHORZ, 2};
+    static const SymmetryCase rotational = {MYPAINT_SYMMETRY_TYPE_ROTATIONAL, 7};
+    static const SymmetryCase snowflake = {MYPAINT_SYMMETRY_TYPE_SNOWFLAKE, 5};
+    // More copies than are queued in one batch
+    static const SymmetryCase many_lines = {MYPAINT_SYMMETRY_TYPE_SNOWFLAKE, 150};
+    static const MirrorCase vertical_boundary = {MYPAINT_SYMMETRY_TYPE_VERTICAL, 256, FALSE};
+    static const MirrorCase horizontal_middle = {MYPAINT_SYMMETRY_TYPE_HORIZONTAL, 288, FALSE};
+    static const MirrorCase verthorz_boundary = {MYPAINT_SYMMETRY_TYPE_VERTHORZ, 256, FALSE};
+    static const MirrorCase verthorz_middle = {MYPAINT_SYMMETRY_TYPE_VERTHORZ, 224, FALSE};
+    static const MirrorCase mirrored_vertical_boundary = {MYPAINT_SYMMETRY_TYPE_VERTICAL, 256, TRUE};
+    static const MirrorCase mirrored_horizontal_middle = {MYPAINT_SYMMETRY_TYPE_HORIZONTAL, 288, TRUE};
+    static const MirrorCase mirrored_verthorz_boundary = {MYPAINT_SYMMETRY_TYPE_VERTHORZ, 256, TRUE};
+    static const MirrorCase mirrored_verthorz_middle = {MYPAINT_SYMMETRY_TYPE_VERTHORZ, 224, TRUE};
+    TestCase test_cases[] = {
+        {"/symmetry/vertical", test_same_as_single_dabs, (void *)&vertical},
+        {"/symmetry/horizontal", test_same_as_single_dabs, (void *)&horizontal},
+        {"/symmetry/verthorz", test_same_as_single_dabs, (void *)&verthorz},
+        {"/symmetry/rotational", test_same_as_single_dabs, (void *)&rotational},
+        {"/symmetry/snowflake", test_same_as_single_dabs, (void *)&snowflake},
+        {"/symmetry/many_lines", test_same_as_single_dabs, (void *)&many_lines},
+        {"/symmetry/aligned/vertical_boundary", test_aligned_axes, (void *)&vertical_boundary},
+        {"/symmetry/aligned/horizontal_middle", test_aligned_axes, (void *)&horizontal_middle},
+        {"/symmetry/aligned/verthorz_boundary", test_aligned_axes, (void *)&verthorz_boundary},
+        {"/symmetry/aligned/verthorz_middle", test_aligned_axes, (void *)&verthorz_middle},
+        {"/symmetry/mirrored/vertical_boundary", test_aligned_axes, (void *)&mirrored_vertical_boundary},
+        {"/symmetry/mirrored/horizontal_middle", test_aligned_axes, (void *)&mirrored_horizontal_middle},
+        {"/symmetry/mirrored/verthorz_boundary", test_aligned_axes, (void *)&mirrored_verthorz_boundary},
+        {"/symmetry/mirrored/verthorz_middle", test_aligned_axes, (void *)&mirrored_verthorz_middle},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
@@ -0,0 +1,212 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mypaint-brush.h"
+#include "mypaint-compressed-tiled-surface.h"
+#include "mypaint-tiled-surface.h"
+#include "tiled-surface-private.h"
+#include "testutils.h"
+
+#define TILE_CHANNELS (MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4)
+#define MASK_SIZE (MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE + 2 * MYPAINT_TILE_SIZE)
+
+static uint32_t
+next_random(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static float
+random_float(uint32_t *state)
+{
+    return (float)next_random(state) / (1 << 24);
+}
+
+// A dab of one of the kinds that process_op() treats differently on empty tiles
+static void
+random_op(OperationDataDrawDab *op, uint32_t *seed)
+{
+    const float x = random_float(seed) * 96 - 16;
+    const float y = random_float(seed) * 96 - 16;
+    const float radius = 4 + random_float(seed) * 40;
+    const float r = random_float(seed);
+    const float g = random_float(seed);
+    const float b = random_float(seed);
+    float color_a = 1.0;
+    float lock_alpha = 0.0;
+    float colorize = 0.0;
+    float posterize = 0.0;
+    float paint = 0.0;
+
+    switch (next_random(seed) % 8) {
+    case 0: paint = 1.0; break;
+    case 1: paint = 0.5; break;
+    case 2: color_a = 0.0; break;
+    case 3: color_a = 0.5; paint = next_random(seed) % 2; break;
+    case 4: lock_alpha = 1.0; paint = next_random(seed) % 2; break;
+    case 5: lock_alpha = 0.5; break;
+    case 6: colorize = 1.0; break;
+    case 7: posterize = 1.0; break;
+    }
+    draw_dab_operation_init(op, x, y, radius, r, g, b, 0.8, 0.7, 0.0, color_a, 1.0, 0.0,
+                            lock_alpha, colorize, posterize, 0.05, paint);
+}
+
+// A dab that erases the whole tile
+static void
+clear_op(OperationDataDrawDab *op)
+{
+    draw_dab_operation_init(op, 32, 32, 100, 0, 0, 0, 1.0, 1.0, 0.0, 0.0, 1.0, 0.0,
+                            0.0, 0.0, 0.0, 0.05, 0.0);
+}
+
+int
+test_same_result(void *user_data)
+{
+    uint16_t *skipping = (uint16_t *)calloc(TILE_CHANNELS, sizeof(uint16_t));
+    uint16_t *reference = (uint16_t *)calloc(TILE_CHANNELS, sizeof(uint16_t));
+    uint16_t mask[MASK_SIZE];
+    MyPaintTiledSurfaceStats stats = {0};
+    uint32_t seed = 1;
+    int same = 1;
+
+    for (int batch = 0; batch < 200 && same; batch++) {
+        // Each batch is like the operations queued for the tile in one transaction
+        TileState state = TILE_STATE_UNKNOWN;
+        const int ops_n = 1 + next_random(&seed) % 8;
+        for (int i = 0; i < ops_n; i++) {
+            OperationDataDrawDab op;
+            if (next_random(&seed) % 16 == 0) {
+                clear_op(&op);
+            } else {
+                random_op(&op, &seed);
+            }
+            process_op(skipping, mask, 0, 0, &op, NULL, NULL, &state, &stats);
+            process_op(reference, mask, 0, 0, &op, NULL, NULL, NULL, NULL);
+        }
+        if (memcmp(skipping, reference, TILE_CHANNELS * sizeof(uint16_t)) != 0) {
+            printf("tile differs after batch %d\n", batch);
+            same = 0;
+        }
+    }
+    printf("%llu ops, %llu elided, %llu blends elided, %llu tile scans\n",
+           (unsigned long long)stats.ops_processed, (unsigned long long)stats.ops_elided,
+           (unsigned long long)stats.blends_elided, (unsigned long long)stats.tile_scans);
+
+    int passed = expect_true(same, "same result as without tile state");
+    passed &= expect_true(stats.ops_elided > 0, "ops elided");
+    passed &= expect_true(stats.mask_renders + stats.ops_elided == stats.ops_processed, "no masks for elided ops");
+
+    free(skipping);
+    free(reference);
+    return passed;
+}
+
+// Dabs that no blend mode applies to still count as drawn and invalidate
+// their area, like before the blend modes were selected per dab, but leave
+// the pixels alone
+int
+test_no_blend_modes(void *user_data)
+{
+    MyPaintCompressedTiledSurface *surface = mypaint_compressed_tiled_surface_new(256, 256, 256);
+    MyPaintTiledSurface *tiled = (MyPaintTiledSurface *)surface;
+    MyPaintSurface *s = mypaint_compressed_tiled_surface_interface(surface);
+    mypaint_tiled_surface_set_stats_enabled(tiled, TRUE);
+
+    mypaint_surface_begin_atomic(s);
+    mypaint_surface_draw_dab(s, 32, 32, 10, 0, 1, 0, 1.0, 1.0, 0.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.05, 0.0);
+    mypaint_surface_end_atomic(s, NULL);
+    const uint64_t painted = test_surface_hash(tiled, 256, 256);
+
+    // Locked alpha, and no colour to put on the pixels
+    MyPaintRectangle rect;
+    MyPaintRectangles roi = {1, &rect};
+    mypaint_surface_begin_atomic(s);
+    const int drawn = mypaint_surface_draw_dab(s, 32, 32, 10, 1, 0, 0, 1.0, 1.0, 0.0, 0.0, 1.0, 0.0,
+                                               1.0, 0.0, 0.0, 0.05, 0.0);
+    mypaint_surface_end_atomic(s, &roi);
+
+    MyPaintTiledSurfaceStats stats;
+    mypaint_tiled_surface_get_stats(tiled, &stats);
+
+    int passed = expect_true(drawn, "locked alpha without colour drawn");
+    passed &= expect_true(rect.width > 0 && rect.height > 0, "area invalidated");
+    passed &= expect_true(test_surface_hash(tiled, 256, 256) == painted, "pixels unchanged");
+    passed &= expect_true(stats.ops_elided > 0, "ops elided");
+    uint64_t blend_calls = 0;
+    for (int mode = 0; mode < MYPAINT_BLEND_MODES_COUNT; mode++) {
+        blend_calls += stats.blend_calls[mode];
+    }
+    // Only those of the first dab
+    passed &= expect_true(stats.mask_renders == 1 && blend_calls == 1, "no mask or blend for the dab");
+
+    mypaint_surface_unref(s);
+    return passed;
+}
+
+typedef struct {
+    const char *name;
+    MyPaintBrushSetting setting;
+    float value;
+} Workload;
+
+// Strokes with a modified charcoal brush on a blank surface.
+// Except for the normal mode, none of them can change it.
+int
+test_workload(void *user_data)
+{
+    const Workload *workload = (const Workload *)user_data;
+
+    MyPaintCompressedTiledSurface *surface = mypaint_compressed_tiled_surface_new(1000, 1000, 256);
+    MyPaintTiledSurface *tiled = (MyPaintTiledSurface *)surface;
+    mypaint_tiled_surface_set_stats_enabled(tiled, TRUE);
+
+    MyPaintBrush *brush = test_brush_load("charcoal");
+    mypaint_brush_set_base_value(brush, workload->setting, workload->value);
+    test_events_play(mypaint_compressed_tiled_surface_interface(surface), brush, FALSE);
+
+    MyPaintTiledSurfaceStats stats;
+    mypaint_tiled_surface_get_stats(tiled, &stats);
+    printf("%s: %llu ops, %llu elided, %llu blends elided, %llu tile scans\n", workload->name,
+           (unsigned long long)stats.ops_processed, (unsigned long long)stats.ops_elided,
+           (unsigned long long)stats.blends_elided, (unsigned long long)stats.tile_scans);
+
+    int passed = expect_true(stats.ops_processed > 0, "ops processed");
+    if (workload->value == 0.0) {
+        // Dabs that add alpha never need the tile inspected
+        passed &= expect_int(0, stats.tile_scans, "no tile scans");
+        passed &= expect_int(0, stats.ops_elided, "nothing elided");
+    } else {
+        passed &= expect_true(stats.ops_elided == stats.ops_processed, "every op elided");
+        passed &= expect_int(0, stats.mask_renders, "no masks rendered");
+    }
+
+    mypaint_brush_unref(brush);
+    mypaint_surface_unref(mypaint_compressed_tiled_surface_interface(surface));
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const Workload eraser = {"eraser", MYPAINT_BRUSH_SETTING_ERASER, 1.0};
+    static const Workload lock_alpha = {"lock_alpha", MYPAINT_BRUSH_SETTING_LOCK_ALPHA, 1.0};
+    static const Workload colorize = {"colorize", MYPAINT_BRUSH_SETTING_COLORIZE, 1.0};
+    static const Workload posterize = {"posterize", MYPAINT_BRUSH_SETTING_POSTERIZE, 1.0};
+    static const Workload normal = {"normal", MYPAINT_BRUSH_SETTING_ERASER, 0.0};
+    TestCase test_cases[] = {
+        {"/tiled_surface/tile_state/same_result", test_same_result, NULL},
+        {"/tiled_surface/tile_state/no_blend_modes", test_no_blend_modes, NULL},
+        {"/tiled_surface/tile_state/eraser", test_workload, (void *)&eraser},
+        {"/tiled_surface/tile_state/lock_alpha", test_workload, (void *)&lock_alpha},
+        {"/tiled_surface/tile_state/colorize", test_workload, (void *)&colorize},
+        {"/tiled_surface/tile_state/posterize", test_workload, (void *)&posterize},
+        {"/tiled_surface/tile_state/normal", test_workload, (void *)&normal},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
@@ -0,0 +1,92 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mypaint-brush.h"
+#include "mypaint-fixed-tiled-surface.h"
+#include "testutils.h"
+
+static void
+paint(MyPaintTiledSurface *surface, const char *brush_name)
+{
+    MyPaintBrush *brush = test_brush_load(brush_name);
+    test_events_play((MyPaintSurface *)surface, brush, FALSE);
+    mypaint_brush_unref(brush);
+}
+
+static int
+is_zero(const MyPaintTiledSurfaceStats *stats)
+{
+    const MyPaintTiledSurfaceStats zero = {0};
+    return memcmp(stats, &zero, sizeof(zero)) == 0;
+}
+
+int
+test_stats_disabled(void *user_data)
+{
+    MyPaintFixedTiledSurface *surface = mypaint_fixed_tiled_surface_new(1000, 1000);
+    MyPaintTiledSurfaceStats stats;
+    memset(&stats, 0xff, sizeof(stats));
+
+    paint((MyPaintTiledSurface *)surface, "charcoal");
+    mypaint_tiled_surface_get_stats((MyPaintTiledSurface *)surface, &stats);
+
+    mypaint_surface_unref((MyPaintSurface *)surface);
+    return expect_true(is_zero(&stats), "nothing collected by default");
+}
+
+int
+test_stats_counters(void *user_data)
+{
+    const char *brush_name = (const char *)user_data;
+    MyPaintFixedTiledSurface *surface = mypaint_fixed_tiled_surface_new(1000, 1000);
+    MyPaintTiledSurface *tiled = (MyPaintTiledSurface *)surface;
+    MyPaintTiledSurfaceStats stats;
+    int passed = 1;
+
+    mypaint_tiled_surface_set_stats_enabled(tiled, TRUE);
+    paint(tiled, brush_name);
+    mypaint_tiled_surface_get_stats(tiled, &stats);
+
+    uint64_t blend_calls = 0;
+    for (int i = 0; i < MYPAINT_BLEND_MODES_COUNT; i++) {
+        blend_calls += stats.blend_calls[i];
+    }
+    printf("%s: %llu dabs, %llu ops on %llu tiles, %llu blends, %llu tile requests\n", brush_name,
+           (unsigned long long)stats.dabs_queued, (unsigned long long)stats.ops_processed,
+           (unsigned long long)stats.tiles_processed, (unsigned long long)blend_calls,
+           (unsigned long long)stats.tile_requests);
+    printf("%s: queue %llu us, mask %llu us, blend %llu us, tile io %llu us\n", brush_name,
+           (unsigned long long)stats.queue_ns / 1000, (unsigned long long)stats.mask_ns / 1000,
+           (unsigned long long)stats.blend_ns / 1000, (unsigned long long)stats.tile_io_ns / 1000);
+
+    passed &= expect_true(stats.dabs_queued > 0, "dabs queued");
+    passed &= expect_true(stats.ops_queued >= stats.dabs_queued, "at least one op per dab");
+    passed &= expect_true(stats.ops_processed == stats.ops_queued, "every op processed");
+    passed &= expect_true(stats.mask_renders == stats.ops_processed, "one mask per op");
+    passed &= expect_true(blend_calls >= stats.ops_processed, "at least one blend per op");
+    passed &= expect_true(stats.tiles_processed > 0, "tiles processed");
+    passed &= expect_true(stats.tile_requests >= stats.tiles_processed, "tiles requested");
+    passed &= expect_true(stats.mask_ns > 0 && stats.blend_ns > 0, "time measured");
+
+    mypaint_tiled_surface_reset_stats(tiled);
+    mypaint_tiled_surface_get_stats(tiled, &stats);
+    passed &= expect_true(is_zero(&stats), "reset");
+
+    mypaint_surface_unref((MyPaintSurface *)surface);
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    TestCase test_cases[] = {
+        {"/tiled_surface/stats/disabled", test_stats_disabled, NULL},
+        {"/tiled_surface/stats/charcoal", test_stats_counters, (void *)"charcoal"},
+        {"/tiled_surface/stats/impressionism", test_stats_counters, (void *)"impressionism"},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
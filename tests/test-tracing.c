@@ -0,0 +1,70 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mypaint-brush.h"
+#include "mypaint-fixed-tiled-surface.h"
+#include "mypaint-tracing.h"
+#include "testutils.h"
+
+static void
+paint(MyPaintSurface *surface)
+{
+    MyPaintBrush *brush = test_brush_load("charcoal");
+    test_events_play(surface, brush, FALSE);
+    mypaint_brush_unref(brush);
+}
+
+int
+test_trace_spans(void *user_data)
+{
+    const int capacity = *(const int *)user_data;
+    MyPaintFixedTiledSurface *surface = mypaint_fixed_tiled_surface_new(1000, 1000);
+    int passed = 1;
+
+    if (!mypaint_tracing_start(capacity)) {
+        // Not built with --enable-tracing
+        paint(mypaint_fixed_tiled_surface_interface(surface));
+        mypaint_surface_unref((MyPaintSurface *)surface);
+        return expect_int(0, mypaint_tracing_get_span_count(), "nothing recorded");
+    }
+
+    paint(mypaint_fixed_tiled_surface_interface(surface));
+    mypaint_tracing_stop();
+    mypaint_surface_unref((MyPaintSurface *)surface);
+
+    const int spans = mypaint_tracing_get_span_count();
+    printf("%d spans recorded\n", spans);
+    passed &= expect_true(spans > 0 && spans <= capacity, "spans recorded");
+
+    const char *filename = "test-tracing.json";
+    passed &= expect_true(mypaint_tracing_write(filename), "trace written");
+    char *trace = read_file(filename);
+    remove(filename);
+
+    passed &= expect_true(strncmp(trace, "{\"traceEvents\":[", 16) == 0, "trace event format");
+    if (spans < capacity) {
+        passed &= expect_true(strstr(trace, "\"name\":\"mypaint_brush_stroke_to\"") != NULL, "stroke spans");
+        passed &= expect_true(strstr(trace, "\"name\":\"prepare_and_draw_dab\"") != NULL, "dab spans");
+        passed &= expect_true(strstr(trace, "\"name\":\"mypaint_tiled_surface_end_atomic\"") != NULL, "end_atomic spans");
+        passed &= expect_true(strstr(trace, "\"name\":\"process_tile\"") != NULL, "tile spans");
+        passed &= expect_true(strstr(trace, "\"args\":{\"tx\":") != NULL, "tile coordinates");
+    }
+    free(trace);
+    return passed;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int small = 100;
+    static const int large = 200000;
+    TestCase test_cases[] = {
+        {"/tracing/ring_buffer", test_trace_spans, (void *)&small},
+        {"/tracing/spans", test_trace_spans, (void *)&large},
+    };
+
+    return test_cases_run(argc, argv, test_cases, TEST_CASES_NUMBER(test_cases), TEST_CASE_NORMAL);
+}
@@ -4,6 +4,7 @@
 #include <assert.h>
 
 #include "testutils.h"
+#include "mypaint-utils-stroke-player.h"
 
 static const char * const pass = "PASS";
 static const char * const fail = "FAIL";
@@ -91,3 +92,81 @@ test_cases_run(int argc, char **argv, TestCase *tests, int tests_n, TestCaseType
 
     return (failures != 0);
 }
+
+MyPaintBrush *
+test_brush_load(const char *name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/tests/brushes/%s.myb", LIBMYPAINT_TESTING_ABS_TOP_SRCDIR, name);
+    char *brush_data = read_file(path);
+
+    MyPaintBrush *brush = mypaint_brush_new();
+    mypaint_brush_from_defaults(brush);
+    mypaint_brush_from_string(brush, brush_data);
+
+    free(brush_data);
+    return brush;
+}
+
+void
+test_events_play(MyPaintSurface *surface, MyPaintBrush *brush, int one_transaction)
+{
+    char *event_data = read_file(LIBMYPAINT_TESTING_ABS_TOP_SRCDIR "/tests/events/painting30sec.dat");
+
+    MyPaintUtilsStrokePlayer *player = mypaint_utils_stroke_player_new();
+    mypaint_utils_stroke_player_set_brush(player, brush);
+    mypaint_utils_stroke_player_set_surface(player, surface);
+    mypaint_utils_stroke_player_set_source_data(player, event_data);
+    if (one_transaction) {
+        mypaint_utils_stroke_player_set_transactions_on_stroke_to(player, FALSE);
+        mypaint_surface_begin_atomic(surface);
+    }
+    mypaint_utils_stroke_player_run_sync(player);
+    if (one_transaction) {
+        mypaint_surface_end_atomic(surface, NULL);
+    }
+
+    mypaint_utils_stroke_player_free(player);
+    free(event_data);
+}
+
+uint64_t
+test_surface_hash(MyPaintTiledSurface *surface, int width, int height)
+{
+    const int tiles_x = (width + MYPAINT_TILE_SIZE - 1) / MYPAINT_TILE_SIZE;
+    const int tiles_y = (height + MYPAINT_TILE_SIZE - 1) / MYPAINT_TILE_SIZE;
+    const size_t tile_bytes = MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4 * sizeof(uint16_t);
+    uint64_t hash = 14695981039346656037ULL;
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            MyPaintTileRequest request;
+            mypaint_tile_request_init(&request, 0, tx, ty, TRUE);
+            mypaint_tiled_surface_tile_request_start(surface, &request);
+            const unsigned char *bytes = (const unsigned char *)request.buffer;
+            for (size_t i = 0; i < tile_bytes; i++) {
+                hash = (hash ^ bytes[i]) * 1099511628211ULL;
+            }
+            mypaint_tiled_surface_tile_request_end(surface, &request);
+        }
+    }
+    return hash;
+}
+
+uint16_t
+test_surface_read_channel(MyPaintTiledSurface *surface, int x, int y, int channel)
+{
+    MyPaintTileRequest request;
+    mypaint_tile_request_init(&request, 0, x / MYPAINT_TILE_SIZE, y / MYPAINT_TILE_SIZE, TRUE);
+    mypaint_tiled_surface_tile_request_start(surface, &request);
+    const int px = x % MYPAINT_TILE_SIZE;
+    const int py = y % MYPAINT_TILE_SIZE;
+    const uint16_t value = request.buffer ? request.buffer[(py * MYPAINT_TILE_SIZE + px) * 4 + channel] : 0xffff;
+    mypaint_tiled_surface_tile_request_end(surface, &request);
+    return value;
+}
+
+void
+test_surface_draw_dab(MyPaintSurface *surface, float x, float y, float radius, float r, float g, float b)
+{
+    mypaint_surface_draw_dab(surface, x, y, radius, r, g, b, 1.0, 1.0, 0.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
+}
@@ -1,6 +1,11 @@
 #ifndef TESTUTILS_H
 #define TESTUTILS_H
 
+#include <stdint.h>
+
+#include "mypaint-brush.h"
+#include "mypaint-tiled-surface.h"
+
 typedef int (*TestFunction) (void *user_data);
 
 typedef struct {
@@ -22,6 +27,25 @@ int expect_int(int expected, int actual, const char *description);
 int expect_float(float expected, float actual, const char *description);
 int expect_true(int actual, const char *description);
 
+// Helpers for tests that paint on tiled surfaces
+
+// The brush of tests/brushes/<name>.myb, on top of the default settings
+MyPaintBrush *test_brush_load(const char *name);
+
+// Replays tests/events/painting30sec.dat with the brush. With one_transaction,
+// all events are drawn in a single begin_atomic/end_atomic transaction,
+// instead of one per stroke.
+void test_events_play(MyPaintSurface *surface, MyPaintBrush *brush, int one_transaction);
+
+// FNV-1a over the bytes of the tiles covering width x height pixels
+uint64_t test_surface_hash(MyPaintTiledSurface *surface, int width, int height);
+
+// A channel of the pixel at x, y, or 0xffff if its tile cannot be requested
+uint16_t test_surface_read_channel(MyPaintTiledSurface *surface, int x, int y, int channel);
+
+// An opaque dab of the given radius and colour, outside of any transaction
+void test_surface_draw_dab(MyPaintSurface *surface, float x, float y, float radius, float r, float g, float b);
+
 #define TEST_CASES_NUMBER(array) (sizeof(array) / sizeof(array[0]))
 
 #endif // TESTUTILS_H
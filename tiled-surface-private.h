@@ -1,4 +1,7 @@
 
+#include "mypaint-tiled-surface.h"
+#include "operationqueue.h"
+#include "spectralcache.h"
 
 void render_dab_mask (uint16_t * mask,
                         float x, float y,
@@ -7,3 +10,70 @@ void render_dab_mask (uint16_t * mask,
                         float softness,
                         float aspect_ratio, float angle
                         );
+
+void dab_geometry_init (DabGeometry *geometry,
+                        float radius,
+                        float hardness,
+                        float softness,
+                        float aspect_ratio, float angle
+                        );
+
+void dab_geometry_set_angle (DabGeometry *geometry, float angle);
+
+void render_dab_mask_geometry (uint16_t * mask,
+                               float x, float y,
+                               const DabGeometry *geometry
+                               );
+
+// The opacities of a dab on one tile, before run length encoding.
+// Only the pixels from x0, y0 to x1, y1 are filled in.
+typedef struct {
+    int x0, y0, x1, y1;
+    uint16_t opa[MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE];
+} DabMaskWindow;
+
+void render_dab_mask_window (DabMaskWindow *window,
+                             float x, float y,
+                             const DabGeometry *geometry
+                             );
+
+void dab_mask_window_encode (const DabMaskWindow *window,
+                             uint16_t *mask,
+                             int mirror
+                             );
+
+// Recently rendered mask windows of a worker, see process_op()
+typedef struct MaskCache MaskCache;
+
+MaskCache *mask_cache_new (void);
+void mask_cache_free (MaskCache *cache);
+
+gboolean draw_dab_operation_init (OperationDataDrawDab *op,
+                                  float x, float y,
+                                  float radius,
+                                  float color_r, float color_g, float color_b,
+                                  float opaque, float hardness, float softness,
+                                  float color_a,
+                                  float aspect_ratio, float angle,
+                                  float lock_alpha,
+                                  float colorize,
+                                  float posterize,
+                                  float posterize_num,
+                                  float paint
+                                  );
+
+// What is known about the pixels of a tile while its queued operations
+// are applied, see process_op()
+typedef enum {
+    TILE_STATE_UNKNOWN, // not inspected yet
+    TILE_STATE_EMPTY, // every channel of every pixel is 0
+    TILE_STATE_PAINTED, // may have non-zero pixels
+} TileState;
+
+void process_op (uint16_t *rgba_p, uint16_t *mask,
+                 int tx, int ty, OperationDataDrawDab *op,
+                 SpectralCachePixel *spectral_cache,
+                 MaskCache *mask_cache,
+                 TileState *state,
+                 MyPaintTiledSurfaceStats *stats
+                 );
@@ -0,0 +1,61 @@
+/* libmypaint - The MyPaint Brush Library
+ * Copyright (C) 2019 The MyPaint Team
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TRACING_H
+#define TRACING_H
+
+#include "config.h"
+
+// Span instrumentation, see mypaint-tracing.h.
+// Without HAVE_TRACING the macros expand to nothing, arguments included.
+//
+//   TRACE_BEGIN(span);
+//   TRACE_ARG(span, 0, tx);
+//   TRACE_ADD(span, 1, 1);
+//   TRACE_END(span, "process_tile", "tx", "ops");
+//
+// Up to TRACE_ARGS_MAX integer arguments can be attached to a span,
+// named by the string literals after the span name.
+
+#ifdef HAVE_TRACING
+
+#include <stdint.h>
+
+#define TRACE_ARGS_MAX 3
+
+typedef struct {
+    uint64_t start_ns; // 0 when tracing is stopped
+    int args[TRACE_ARGS_MAX];
+} TraceSpan;
+
+TraceSpan tracing_span_begin(void);
+void tracing_span_end(const TraceSpan *span, const char *name, ...);
+
+#define TRACE_BEGIN(span) TraceSpan span = tracing_span_begin()
+#define TRACE_ARG(span, i, value) ((span).args[i] = (value))
+#define TRACE_ADD(span, i, value) ((span).args[i] += (value))
+#define TRACE_END(span, ...) tracing_span_end(&(span), __VA_ARGS__, NULL)
+
+#else // not HAVE_TRACING
+
+#define TRACE_BEGIN(span)
+#define TRACE_ARG(span, i, value)
+#define TRACE_ADD(span, i, value)
+#define TRACE_END(span, ...)
+
+#endif // HAVE_TRACING
+
+#endif // TRACING_H